@@ -0,0 +1,146 @@
+// CS415 Project #4: check_rating.c (ratings file check)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Compile: gcc -o check_rating check_rating.c -lm (use make check!)
+// Invoke: $ check_rating {-p players} {-g games}
+//   -p  players to draw from (default 3000, enough to grow a new file)
+//   -g  games to rate (default 20000)
+// Rates random games on a scratch ratings file and, every so often and
+// at the end, checks the skip list against the records sorted afresh: each
+// player's rank, the player at each rank, the hash and rating_intact().
+// Then breaks the file the two ways the server recovers from, an update
+// left half done with the dirty mark set and links lost with it clear,
+// and checks again after the rebuild. Prints what failed, if anything.
+
+// Exit Codes:
+// <0> Successful termination
+// <1> Argument error
+// <2> Could not create the scratch file
+// <3> Check failed
+
+#include "nim.h"
+#include "nim_proto.h"
+#include "nim_rating.h"
+
+struct nim_ratings ratings;
+char scratch[] = "/tmp/check_ratingXXXXXX"; // the ratings file
+
+void check(char *when);
+int check_cmp(const void *x, const void *y);
+void error(int code);
+
+int main(int argc, char *argv[]) { /////////////////////////////////////////////
+
+	// Process input arguments.
+	int i, players = 3000, games = 20000, fd;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			i += 1; // next argument is the players
+			if ( (players = atoi(argv[i])) < 2 ) error(1);
+		} else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+			i += 1; // next argument is the games
+			if ( (games = atoi(argv[i])) < 1 ) error(1);
+		} else error(1);
+	}
+
+	char a[20], b[20];
+	if ( (fd = mkstemp(scratch)) < 0 ) error(2);
+	close(fd);
+	if (rating_open(&ratings, scratch) < 0) error(2);
+	srand(time(NULL));
+
+	// Random games, checked ten times along the way.
+	for (i = 1; i <= games; i++) {
+		snprintf(a, 20, "p%d", rand() % players);
+		snprintf(b, 20, "p%d", rand() % players);
+		rating_game(&ratings, a, b, rand() & 1);
+		if (i % (games / 10 > 0 ? games / 10 : 1) == 0) check("rating games");
+	}
+	if (players > NIM_RATING_MIN && ratings.cap == NIM_RATING_MIN) {
+		fprintf(stderr, "check_rating: the file never grew\n");
+		error(3);
+	}
+
+	// An update that died part way: a player out of the list with a new
+	// rating and the dirty mark still set, rebuilt by the next lock.
+	rating_lock(&ratings);
+	i = 1 + rand() % ratings.head->count;
+	ratings.head->dirty = 1;
+	rating_unlink(&ratings, i);
+	ratings.rec[i].rating += NIM_RATING_K;
+	rating_unlock(&ratings);
+	check("a dirty update");
+
+	// Links lost with the mark clear, rebuilt by rating_open() when it
+	// finds the list broken.
+	rating_lock(&ratings);
+	ratings.rec[0].next[0] = 0;
+	rating_unlock(&ratings);
+	munmap(ratings.head, rating_size(ratings.cap));
+	close(ratings.fd);
+	if (rating_open(&ratings, scratch) < 0) error(2);
+	check("broken links");
+	unlink(scratch);
+
+	printf("check_rating: %d players, %d games, %d records: ok\n",
+		ratings.head->count, games, ratings.cap);
+	return 0;
+}
+
+// Check the list and the hash against the records sorted afresh.
+void check(char *when) {
+	int n, i, *order;
+	rating_lock(&ratings);
+	n = ratings.head->count;
+	if ( (order = malloc((n + 1) * sizeof(int))) == NULL ) error(3);
+	for (i = 0; i < n; i++) order[i] = i + 1;
+	qsort(order, n, sizeof(int), check_cmp);
+	if (!rating_intact(&ratings)) {
+		fprintf(stderr, "check_rating: after %s: list not intact\n", when);
+		error(3);
+	}
+	for (i = 0; i < n; i++) {
+		if (rating_rank(&ratings, order[i]) != i + 1) {
+			fprintf(stderr, "check_rating: after %s: %s has rank %d, not %d\n", when,
+				ratings.rec[order[i]].handle, rating_rank(&ratings, order[i]), i + 1);
+			error(3);
+		}
+		if (rating_at(&ratings, i + 1) != order[i]) {
+			fprintf(stderr, "check_rating: after %s: rank %d has record %d, not %d\n",
+				when, i + 1, rating_at(&ratings, i + 1), order[i]);
+			error(3);
+		}
+		if (rating_find(&ratings, ratings.rec[order[i]].handle) != order[i]) {
+			fprintf(stderr, "check_rating: after %s: %s not found\n", when,
+				ratings.rec[order[i]].handle);
+			error(3);
+		}
+	}
+	if (rating_at(&ratings, n + 1) != 0) {
+		fprintf(stderr, "check_rating: after %s: a rank past the last\n", when);
+		error(3);
+	}
+	rating_unlock(&ratings);
+	free(order);
+}
+
+int check_cmp(const void *x, const void *y) {
+	int a = *(int *) x, b = *(int *) y;
+	if (rating_before(&ratings, a, b)) return -1;
+	return rating_before(&ratings, b, a);
+}
+
+void error(int code) {
+	if (code > 1) unlink(scratch);
+	switch(code) {
+	case 1:
+		fprintf(stderr, "check_rating: argument error: exit 1\n");
+		exit(1); break;
+	case 2:
+		fprintf(stderr, "check_rating: could not create the scratch file: exit 2\n");
+		exit(2); break;
+	case 3:
+		fprintf(stderr, "check_rating: check failed: exit 3\n");
+		exit(3); break;
+	}
+}
@@ -0,0 +1,177 @@
+// CS415 Project #4: check_tourney.c (tournament check)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Compile: gcc -o check_tourney check_tourney.c (use make check!)
+// Invoke: $ check_tourney {-n entrants}
+//   -n  largest field to run (default 10000)
+// Runs every format for each field size from 2 to 64 and for a few larger
+// ones, either side of a power of two, up to the largest; a round robin
+// plays n(n-1)/2 matches, so its fields stop at 1000. Each goes by way of
+// the same start and release hooks and result calls the server uses. Every
+// entrant is there from the start and comes back the moment its match
+// ends; matches are played in random order with a random winner, one in
+// eight undecided and played again. Checks that each tournament ends with
+// every entrant out or done and no timer left armed, a bracket with the one
+// champion and a round robin with every pairing played. Prints what
+// failed, if anything.
+
+// Exit Codes:
+// <0> Successful termination
+// <1> Argument error
+// <2> Could not write the roster
+// <3> Check failed
+
+#include "nim.h"
+#include "nim_event.h"
+#include "nim_proto.h"
+#include "nim_timer.h"
+#include "nim_tourney.h"
+
+char *format_names[] = {"round robin", "single elimination", "double elimination"};
+char scratch[] = "/tmp/check_tourneyXXXXXX"; // the roster
+int *ids; // an entrant's connection is its seed's place in here
+int *pending, npending; // matches started, by first player's seed, then second's
+int starts;
+
+void run(int format, int n);
+void start(void *conn1, void *conn2);
+void release(void *conn);
+void fail(char *what);
+void error(int code);
+
+int main(int argc, char *argv[]) { /////////////////////////////////////////////
+
+	// Process input arguments.
+	int i, format, largest = 10000, most, n;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			i += 1; // next argument is the largest field
+			largest = atoi(argv[i]);
+			if (largest < 2 || largest > NIM_TOURNEY_MAX) error(1);
+		} else error(1);
+	}
+
+	if ( (i = mkstemp(scratch)) < 0 ) error(2);
+	close(i);
+	ids = malloc(largest * sizeof(int));
+	pending = malloc(largest * sizeof(int));
+	if (ids == NULL || pending == NULL) error(2);
+	for (i = 0; i < largest; i++) ids[i] = i;
+	srand(time(NULL));
+
+	for (format = TOURNEY_ROUND_ROBIN; format <= TOURNEY_DOUBLE; format++) {
+		most = format == TOURNEY_ROUND_ROBIN && largest > 1000 ? 1000 : largest;
+		for (n = 2; n <= 64 && n <= most; n++) run(format, n);
+		for (n = 100; n < most; n *= 10) run(format, n - 1);
+		for (n = 128; n < most; n *= 4) run(format, n + 1);
+		if (most > 64) run(format, most);
+	}
+	unlink(scratch);
+	printf("check_tourney: fields of 2 to %d: ok\n", largest);
+	return 0;
+}
+
+// Run a tournament among the first n handles of the roster and check how
+// it ended.
+void run(int format, int n) {
+	struct nim_tourney *t = &tourney;
+	struct nim_entrant *e;
+	int i, j, p1, p2, winner, replays = 0, champions = 0, lost = 0;
+	FILE *file;
+
+	if ( (file = fopen(scratch, "w")) == NULL ) error(2);
+	for (i = 0; i < n; i++) fprintf(file, "e%d\n", i);
+	if (fclose(file) != 0 || tourney_load(t, format, scratch) < 0) error(2);
+	t->forfeit_ms = 60000; // never reached, the wheel is not advanced
+	t->start = start;
+	t->release = release;
+	timer_init(&timers);
+	npending = starts = 0;
+	if (tourney_begin(t) < 0) error(2);
+	for (i = 0; i < n; i++) tourney_arrive(t, &t->e[i], &ids[i]);
+
+	while (npending > 0) {
+		j = rand() % npending; // any match in progress may end first
+		p1 = pending[2 * j];
+		p2 = pending[2 * j + 1];
+		npending -= 1;
+		pending[2 * j] = pending[2 * npending];
+		pending[2 * j + 1] = pending[2 * npending + 1];
+		winner = rand() % 8 == 0 ? -1 : rand() & 1;
+		if (winner < 0) replays += 1;
+		tourney_result(t, t->e[p1].handle, t->e[p2].handle, winner);
+		if ( (e = tourney_entrant(t, t->e[p1].handle)) != NULL )
+			tourney_arrive(t, e, &ids[p1]);
+		if ( (e = tourney_entrant(t, t->e[p2].handle)) != NULL )
+			tourney_arrive(t, e, &ids[p2]);
+	}
+
+	if (t->active != 0) fail("entrants still active");
+	if (t->playing != 0) fail("matches still playing");
+	if (timers.count != 0) fail("timers still armed");
+	if (starts != t->played + replays) fail("matches started and decided differ");
+	for (i = 0; i < n; i++) {
+		e = &t->e[i];
+		if (e->out == e->done) fail("an entrant neither out nor done");
+		if (e->conn != NULL) fail("an entrant left waiting");
+		champions += e->done;
+		lost += e->losses;
+		if (format == TOURNEY_ROUND_ROBIN && e->wins + e->losses != n - 1)
+			fail("an entrant missed a pairing");
+		if (format == TOURNEY_SINGLE && e->losses != !e->done)
+			fail("an entrant lost other than once, or the champion lost");
+		if (format == TOURNEY_DOUBLE && (e->losses > 2 || (e->done && e->losses > 1)))
+			fail("an entrant lost too often");
+	}
+	if (lost != t->played) fail("losses and matches played differ");
+	if (format == TOURNEY_ROUND_ROBIN) {
+		if (champions != n) fail("an entrant not done");
+		if (t->played != n * (n - 1) / 2) fail("pairings played");
+	} else {
+		if (champions != 1) fail("not one champion");
+		if (format == TOURNEY_SINGLE && t->played != n - 1)
+			fail("matches played");
+		if (format == TOURNEY_DOUBLE && t->played != 2 * n - 2 && t->played != 2 * n - 1)
+			fail("matches played");
+	}
+	free(t->e);
+	free(t->hash);
+	free(t->order);
+	free(t->m);
+}
+
+// Start hook: note the match, to be ended later.
+void start(void *conn1, void *conn2) {
+	pending[2 * npending] = *(int *) conn1;
+	pending[2 * npending + 1] = *(int *) conn2;
+	npending += 1;
+	starts += 1;
+}
+
+// Release hook: an entrant waiting with no match to come, which had
+// better be out or done.
+void release(void *conn) {
+	struct nim_entrant *e = &tourney.e[*(int *) conn];
+	if (!e->out && !e->done) fail("an entrant released with matches to come");
+}
+
+void fail(char *what) {
+	fprintf(stderr, "check_tourney: %s of %d: %s\n", format_names[tourney.format],
+		tourney.n, what);
+	error(3);
+}
+
+void error(int code) {
+	if (code > 1) unlink(scratch);
+	switch(code) {
+	case 1:
+		fprintf(stderr, "check_tourney: argument error: exit 1\n");
+		exit(1); break;
+	case 2:
+		fprintf(stderr, "check_tourney: could not write the roster: exit 2\n");
+		exit(2); break;
+	case 3:
+		fprintf(stderr, "check_tourney: check failed: exit 3\n");
+		exit(3); break;
+	}
+}
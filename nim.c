@@ -1,334 +1,799 @@
-// CS415 Project #4: nim.c (client)
-// Gavin Cabbage - gavincabbage@gmail.com
-
-// Compile: gcc -o nim nim.c (use Makefile!)
-// Invoke: $ nim {-q} {-p password} 
-
-// Exit Codes:
-// <0> Successful termination
-// <1> Argument error
-// <2> Problem locating server address file
-// <3> Problem querying server
-// <4> No response to server query
-// <5> Problem requesting to play
-// <6> Problem communicating with match server
-
-#include "nim.h"
-
-// Global variables and function prototypes.
-int query_mode = 0;
-char password[20];
-char handle[20];
-char hostname[HOST_NAME_MAX];
-char servaddr[HOST_NAME_MAX];
-char *query_port, *play_port;
-int play_sock;
-int first = 0;
-char b[28]; 
-
-void get_config(), query_server();
-void play_request(), play_game();
-void display_board(), win(), loss();
-int check_move(int row, int col);
-void error(int code);
-
-int main(int argc, char *argv[]) { /////////////////////////////////////////////
-
-	// Process input arguments.
-	int i;
-	for (i = 1; i < argc; i++) {
-		if ( (strcmp(argv[i], "-q") == 0) && (i == 1) ) query_mode = 1;
-		else if (strcmp(argv[i], "-p") == 0) {
-			i += 1; // next argument is the password string
-			if (argv[i] != NULL) strcpy(password, argv[i]);
-			else error(1);
-		} else error(1);
-	}
-
-	// Get server information from config file.
-	get_config();
-	// Build full server domain name from given hostname.
-	sprintf(servaddr, "%s", hostname);
-
-	// Query server or request to play a game.
-	if (query_mode) query_server();
-	else {                   
-		play_request();
-	}
-	
-	// Query or game complete, terminate successfully.
-	exit(0);
-
-} // end main //////////////////////////////////////////////////////////////////
-
-// Get server address information from config file.
-void get_config() {
-	
-	FILE *config;
-	config = fopen("nim.conf", "r");
-	if (config == NULL) { // failure on first attempt, try again in 60 seconds
-		fprintf(stderr, "nim: failure accessing server address file: retry in 60s\n");
-		sleep(60); config = fopen("nim.conf", "r");
-	} if (config == NULL) error(2); // failure on second attempt, exit
-	char line[LINE_MAX];
-	while (fgets(line, LINE_MAX, config) != NULL) {
-		strcpy(hostname, strtok(line, ":"));
-		query_port = strtok(NULL, ":");
-		play_port = strtok(NULL, "");
-	}
-	fclose(config);
-}
-
-// Send datagram to server.
-void query_server() {
-
-	// Get server info for query.
-	int query_sock, sent;
-	struct sockaddr_in *q_dest;
-	struct addrinfo hints, *addrlist;
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_flags = AI_NUMERICSERV;
-	hints.ai_protocol = 0;
-	hints.ai_canonname = NULL;
-	hints.ai_addr = NULL;
-	hints.ai_next = NULL;
-	if (getaddrinfo(servaddr, query_port, &hints, &addrlist) != 0 )
-		error(3);
-	q_dest = (struct sockaddr_in*) addrlist->ai_addr;
-	
-	// Initialize socket and send query request to server.
-	query_sock = socket(addrlist->ai_family, addrlist->ai_socktype, 0);
-	if (query_sock < 0) error(3);
-	struct nim_query *query = malloc(sizeof(struct nim_query));
-	memset(query, 0, sizeof(struct nim_query));
-	if (password != NULL) strcpy(query->password, password);
-	sent = sendto(query_sock, query, sizeof(query), 0,
-			(struct sockaddr*) q_dest,
-			sizeof(struct sockaddr_in));
-	if (sent < sizeof(query)) error(3);
-	
-	// Build select list.
-	fd_set socks;
-	FD_ZERO(&socks);
-	FD_SET(query_sock, &socks);
-	int max_sock = query_sock;
-	struct timeval timeout;
-	timeout.tv_sec = 60; timeout.tv_usec = 0;
-	
-	// Wait up to 60s for server response, terminate if none.
-	int active = select(max_sock+1, &socks, (fd_set*) 0, (fd_set*) 0, &timeout);
-	if (active < 0) error(3); // select() error
-	if (active == 0) error(4); // did not receive response
-	else { // received response
-	
-		// Receive response.
-		socklen_t q_size = sizeof(q_dest);
-		struct nim_query_response *response = 
-				malloc(sizeof(struct nim_query_response));
-		int rec = recvfrom(query_sock, response, sizeof(*response), 0,
-				(struct sockaddr*) q_dest, &q_size);
-		if (rec < sizeof(*response)) error(3);
-		int inprog = ntohl(response->inprog);
-		
-		// Display information and terminate.
-		if (inprog == 1) printf("> There is 1 game in progress\n");
-		else printf("> There are %d games in progress\n", inprog);
-		if (inprog) { // display any games in progress
-			int players = 2 * inprog - 1;
-			char current[20];
-			strcpy(current, strtok(response->games, ":"));
-			printf("%20s vs. ", current);
-			while (players) {
-				strcpy(current, strtok(NULL, ":"));
-				if (players % 2 == 0) printf("%20s vs. ", current);
-				else printf("%-20s\n", current);
-				players--;
-			}
-		}
-		if (response->waiting[0] != 0) { // display any player waiting
-			printf("> %s is waiting to play\n", response->waiting);
-		}
-		free(response);
-		exit(0);
-	}
-}
-
-// Connect to the server to play a game.
-void play_request() {
-
-	// Get server info for play request.
-	struct sockaddr_in *p_dest;
-	struct addrinfo hints, *addrlist;
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_NUMERICSERV | AI_PASSIVE;
-	hints.ai_protocol = 0;
-	hints.ai_canonname = NULL;
-	hints.ai_addr = NULL;
-	hints.ai_next = NULL;
-	if (getaddrinfo(servaddr, play_port, &hints, &addrlist) != 0)
-		error(5);
-	p_dest = (struct sockaddr_in*) addrlist->ai_addr;
-	
-	// Initialize socket and connect to server play port.
-	play_sock = socket(addrlist->ai_family, addrlist->ai_socktype, 0);
-	if (play_sock < 0) error(5);
-	if (connect(play_sock, (struct sockaddr*) p_dest, sizeof(struct sockaddr_in)) < 0)
-		exit(5);
-	
-	// Send password if enabled and respond to server handle request.
-	struct nim_msg *request = malloc(sizeof(struct nim_msg));
-	request->type = 'P';
-	strcpy(request->data, password);
-	if (s_send(play_sock, (void *) request, sizeof(struct nim_msg)) < 0)
-		error(5);
-	memset(request, 0, sizeof(struct nim_msg));
-	if (s_recv(play_sock, (void *) request, sizeof(struct nim_msg)) < 0)
-		error(5);
-	if (request->type != 'H') error(5);
-	printf("Enter a handle to play: "); // get handle from user
-	scanf("%s", handle);
-	memset(request, 0, sizeof(struct nim_msg));
-	strcpy(request->data, handle);
-	request->type = 'R';
-	if (s_send(play_sock, (void *) request, sizeof(struct nim_msg)) < 0)
-		error(5);
-	free(request);
-
-	play_game();
-}
-
-// Play a game of nim through a match server.
-void play_game() {
-
-	// Receive handles from server and display.
-	struct nim_msg *handle_msg = malloc(sizeof(struct nim_msg));
-	if (s_recv(play_sock, (void *) handle_msg, sizeof(struct nim_msg)) < 0)
-		error(4);
-	printf("\nTHE GAME HAS BEGUN!\n");
-	printf("Player 1: %s\n", handle_msg->data);
-	if (!strcmp(handle_msg->data, handle)) first = 1;
-	memset(handle_msg, 0, sizeof(struct nim_msg));
-	if (s_recv(play_sock, (void *) handle_msg, sizeof(struct nim_msg)) < 0)
-		error(4);
-	printf("Player 2: %s\n", handle_msg->data);
-	free(handle_msg);
-
-	// Enter game loop. 
-	int turn = first;
-	struct nim_board *board = malloc(sizeof(struct nim_board));
-	struct nim_msg *message = malloc(sizeof(struct nim_msg));
-	struct nim_move *move = malloc(sizeof(struct nim_move));
-	for ( ; ; ) {
-	
-		// Receive board config from server and display.
-		memset(board, 0, sizeof(struct nim_board));
-		if (s_recv(play_sock, (void *) board, sizeof(struct nim_board)) < 0)
-			error(6);
-		strcpy(b, board->board);
-		display_board();
-		
-		// Receive and respond to move request if appropriate.
-		memset(message, 0, sizeof(struct nim_msg));
-		if (s_recv(play_sock, (void *) message, sizeof(struct nim_msg)) < 0)
-			error(6);
-		if (message->type == 'W') { win(); break; }
-		else if (message->type == 'L') { loss(); break; }
-		else if ( (message->type == 'A') && (turn % 2 == 1) ) { // respond to move request
-			memset(move, 0, sizeof(struct nim_move));
-			int valid_move = 0;
-			char in[4]; int i; char cur;
-			int row = -1; int col = -1;
-			printf("\nEnter move: ");
-			while (valid_move == 0) {
-				fflush(stdin);
-				row = -1; col = -1;
-				fgets(in, sizeof(in), stdin);
-				if (in[0] == '\n') continue;
-				for (i = 0; i < strlen(in); i++) {
-					cur = in[i];
-					if (isspace(cur)) continue;
-					else if (row < 0) row = cur - '0';
-					else if (col < 0) col = cur - '0';
-				}
-				valid_move = check_move(row, col);
-				if (!valid_move) printf("\nInvalid move, try again: ");
-			}
-			move->row = row + '0';
-			move->col = col + '0';
-
-			if (s_send(play_sock, (void *) move, sizeof(struct nim_move)) < 0)
-				error(6);
-		} else { // not client's turn
-			printf("\nWaiting for opponent's move...\n");
-		}
-		turn += 1;
-	} // end play loop
-	free(board); free(message); free(move);
-}
-
-// Check a given move for validity.
-int check_move(int row, int col) {
-	if (row == 0 && col == 0) return -1;
-	if (row < 1 || row > 4) return 0;
-	if (col < 1 || col > 7) return 0;
-	int ndx = (7 * (row - 1)) + col - 1;
-	if (b[ndx] != 'O') return 0;
-	return 1;
-}
-
-void display_board() {
-	int i;
-	printf("\nrow\n1|"); 
-	for (i = 0; i < 7; i++) {
-		if (b[i] == 'O') printf(" %c", b[i]);
-		else printf("  ");
-	} printf("\n2|"); 
-	for (i = 7; i < 14; i++) {
-		if (b[i] == 'O') printf(" %c", b[i]);
-		else printf("  ");
-	} printf("\n3|"); 
-	for (i = 14; i < 21; i++) {
-		if (b[i] == 'O') printf(" %c", b[i]);
-		else printf("  ");
-	} printf("\n4|"); 
-	for (i = 21; i < 28; i++) {
-		if (b[i] == 'O') printf(" %c", b[i]);
-		else printf("  ");
-	} printf("\n +-----------------\n   1 2 3 4 5 6 7 col\n");  
-}
-
-void win() {
-	printf("\nGame over: you WIN!\n");
-}
-
-void loss() {
-	printf("\nGame over: you LOSE!\n");
-}
-
-// Print appropriate error message and exit.
-void error(int code) {
-	switch(code) {
-	case 1:
-		fprintf(stderr, "nim: argument error: exit 1\n");
-		exit(1); break;
-	case 2:
-		fprintf(stderr, "nim: unable to access server address file: exit 2\n");
-		exit(2); break;
-	case 3:
-		fprintf(stderr, "nim: problem querying server: exit 3\n");
-		exit(3); break;
-	case 4:
-		fprintf(stderr, "nim: no query response from server: exit 4\n");
-		exit(4); break;
-	case 5:
-		fprintf(stderr, "nim: problem requesting to play: exit 5\n");
-		exit(5); break;
-	case 6:
-		fprintf(stderr, "nim: problem communicating with match server: exit 6\n");
-		exit(6); break;
-	}
-}
+// CS415 Project #4: nim.c (client)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Compile: gcc -o nim nim.c (use Makefile!)
+// Invoke: $ nim {-q|-m|-t {rank}|-r {rank}|-R handle} {-p password}
+//           {-v variant} {-w handle}
+//         $ nim -b sessions {-g games} {-s bot|first|random|stdin|file}
+//           {-h prefix} {-d seconds} {-p password} {-v variant}
+// Speaks protocol v2 (see nim_proto.h) to the server and match; -v asks to
+// play a board variant the server offers, -m prints the server's metrics
+// instead of the games in progress, -t the standings of the server's
+// tournament from the given rank on (default 1), -r the server's best rated
+// players from the given rank on (default 1), -R the rating and rank of the
+// player with the given handle, and -w watches the game the player with
+// the given handle is in instead of playing. A tournament entrant plays its
+// matches one connection at a time, as it would games in the lobby (see
+// nim_tourney.h).
+//
+// Given several servers in nim.conf, a cluster's nodes, the client queries
+// one at random, but asks a player's rating of the node owning its handle,
+// and plays on the node owning its handle, following any
+// REDIRECT a node answers with (see nim_cluster.h); so do headless
+// sessions.
+//
+// With -b the client runs headless: this many sessions, handles prefix0,
+// prefix1, ... (default nim), play from one epoll loop (see nim_client.h)
+// until -g games have ended (default one per session) or -d seconds have
+// passed, each session reconnecting after its game while games remain.
+// Moves come from -s: the bot (default), the last stone of the first row
+// left, a random legal move, a file of "row col" lines that each game
+// replays from the top (the bot covering any illegal move or the end of
+// the file), or stdin, which must be a pipe or terminal. The bot plays by
+// the variant's rule as START gives it. With stdin each move wanted is
+// printed as a turn line, which carries the rows and the rule, and
+// answered by a "session row col" line. Output is one JSON object per
+// line: a game, reject or error line per session as each ends, then a
+// summary. Sessions pair with each other, so run an even number of them
+// or let the server's bot take the odd one (nim_server -b).
+
+// Exit Codes:
+// <0> Successful termination
+// <1> Argument error
+// <2> Problem locating server address file
+// <3> Problem querying server
+// <4> No response to server query
+// <5> Problem requesting to play
+// <6> Problem communicating with match server
+// <7> Problem reading move script
+
+#include "nim.h"
+#include "nim_board.h"
+#include "nim_proto.h"
+#include "nim_variant.h"
+#include "nim_event.h"
+#include "nim_eval.h"
+#include "nim_bot.h"
+#include "nim_cluster.h"
+#include "nim_client.h"
+
+#define NIM_SCRIPT_MAX 4096 // moves read from a script file
+
+// Global variables and function prototypes.
+int query_mode = 0; // frame type of the query to send, 0 to play
+char password[20];
+char handle[20];
+char variant_name[20]; // variant asked for, empty for the server's default
+char watch_handle[20]; // player whose game to watch, empty to play
+int first_rank = 0; // first standings or leaders row wanted, counted from 0
+char rated_handle[20]; // player whose rating to ask for
+char hostname[HOST_NAME_MAX];
+char servaddr[HOST_NAME_MAX];
+char query_port[NI_MAXSERV], play_port[NI_MAXSERV];
+int play_sock;
+struct nim_cluster cluster; // every server in nim.conf
+int redirects; // followed while joining
+struct nim_inbuf in; // frames received from the server
+nim_bits b; // current board
+struct nim_variant variant; // rows of a variant other than the classic
+struct nim_heaps heaps; // current board of such a variant
+int sessions = 0; // headless sessions, 0 to play interactively
+long long games = 0; // headless games to play, 0 for one per session
+int seconds = 0; // headless time limit, 0 for none
+char *source = "bot"; // where headless moves come from
+char prefix[12] = "nim"; // headless handle prefix
+unsigned char script[2 * NIM_SCRIPT_MAX]; // row and col of each script move
+int script_len; // moves in the script
+int *script_pos; // each session's next script move
+struct nim_client client;
+struct nim_session *session;
+struct nim_session **restarts; // sessions to reconnect after the batch
+int nrestarts;
+long long started, ended, wins, rejected, failed;
+struct nim_source input; // stdin, when it answers moves
+char input_buf[LINE_MAX];
+int input_len;
+
+void get_config(), use_node(int i), query_server();
+void play_request(), play_game();
+int recv_frame(struct nim_cursor *c);
+void display_board(), win(), loss();
+int check_move(int row, int col);
+void headless(), read_script(char *path), read_input();
+int headless_move(struct nim_session *s, int *row, int *col);
+void headless_hook(struct nim_session *s, int what);
+void print_json_str(char *name, char *value);
+void print_table(struct nim_cursor *c);
+void print_rating(struct nim_cursor *c), print_leaders(struct nim_cursor *c);
+void error(int code);
+
+int main(int argc, char *argv[]) { /////////////////////////////////////////////
+
+	// Process input arguments.
+	int i;
+	for (i = 1; i < argc; i++) {
+		if ( (strcmp(argv[i], "-q") == 0) && (i == 1) ) query_mode = FRAME_QUERY;
+		else if ( (strcmp(argv[i], "-m") == 0) && (i == 1) ) query_mode = FRAME_METRICS;
+		else if ( (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-r") == 0) && (i == 1) ) {
+			query_mode = argv[i][1] == 't' ? FRAME_STANDINGS : FRAME_TOP;
+			if (argv[i + 1] != NULL && isdigit(argv[i + 1][0])) {
+				i += 1; // next argument is the first rank to show
+				if ( (first_rank = atoi(argv[i]) - 1) < 0 ) error(1);
+			}
+		} else if ( (strcmp(argv[i], "-R") == 0) && (i == 1) ) {
+			i += 1; // next argument is the handle of a rated player
+			if (argv[i] != NULL) snprintf(rated_handle, 20, "%s", argv[i]);
+			else error(1);
+			query_mode = FRAME_RANK;
+		}
+		else if (strcmp(argv[i], "-p") == 0) {
+			i += 1; // next argument is the password string
+			if (argv[i] != NULL) strcpy(password, argv[i]);
+			else error(1);
+		} else if (strcmp(argv[i], "-v") == 0) {
+			i += 1; // next argument is the variant name
+			if (argv[i] != NULL) snprintf(variant_name, 20, "%s", argv[i]);
+			else error(1);
+		} else if (strcmp(argv[i], "-w") == 0) {
+			i += 1; // next argument is the handle of a player to watch
+			if (argv[i] != NULL) snprintf(watch_handle, 20, "%s", argv[i]);
+			else error(1);
+		} else if (strcmp(argv[i], "-b") == 0) {
+			i += 1; // next argument is the number of sessions
+			if (argv[i] == NULL || (sessions = atoi(argv[i])) < 1) error(1);
+		} else if (strcmp(argv[i], "-g") == 0) {
+			i += 1; // next argument is the number of games
+			if (argv[i] == NULL || (games = atoll(argv[i])) < 1) error(1);
+		} else if (strcmp(argv[i], "-d") == 0) {
+			i += 1; // next argument is the time limit
+			if (argv[i] == NULL || (seconds = atoi(argv[i])) < 1) error(1);
+		} else if (strcmp(argv[i], "-s") == 0) {
+			i += 1; // next argument is the move source
+			if ( (source = argv[i]) == NULL ) error(1);
+		} else if (strcmp(argv[i], "-h") == 0) {
+			i += 1; // next argument is the handle prefix
+			if (argv[i] != NULL) snprintf(prefix, sizeof(prefix), "%s", argv[i]);
+			else error(1);
+		} else error(1);
+	}
+
+	// Get server information from config file.
+	get_config();
+	// Build full server domain name from given hostname.
+	sprintf(servaddr, "%s", hostname);
+
+	// Query server, run headless sessions or request to play a game.
+	if (query_mode) query_server();
+	else if (sessions > 0) headless();
+	else {                   
+		play_request();
+	}
+	
+	// Query or game complete, terminate successfully.
+	exit(0);
+
+} // end main //////////////////////////////////////////////////////////////////
+
+// Get server address information from config file.
+void get_config() {
+	
+	FILE *config;
+	config = fopen("nim.conf", "r");
+	if (config == NULL) { // failure on first attempt, try again in 60 seconds
+		fprintf(stderr, "nim: failure accessing server address file: retry in 60s\n");
+		sleep(60); config = fopen("nim.conf", "r");
+	} if (config == NULL) error(2); // failure on second attempt, exit
+	char line[LINE_MAX];
+	while (fgets(line, LINE_MAX, config) != NULL) {
+		char *host = strtok(line, ":"), *query = strtok(NULL, ":"),
+				*play = strtok(NULL, ":\n");
+		if (host == NULL || query == NULL || play == NULL) continue;
+		snprintf(hostname, sizeof(hostname), "%s", host);
+		snprintf(query_port, sizeof(query_port), "%s", query);
+		snprintf(play_port, sizeof(play_port), "%s", play);
+	}
+	fclose(config);
+	cluster_load(&cluster, "nim.conf");
+}
+
+// Aim at one node of a cluster.
+void use_node(int i) {
+	snprintf(servaddr, sizeof(servaddr), "%s", cluster.node[i].host);
+	snprintf(query_port, sizeof(query_port), "%s", cluster.node[i].query_port);
+	snprintf(play_port, sizeof(play_port), "%s", cluster.node[i].play_port);
+}
+
+// Send datagram to server.
+void query_server() {
+
+	// Get server info for query, from any node of a cluster.
+	int query_sock, sent;
+	struct sockaddr_in *q_dest;
+	struct addrinfo hints, *addrlist;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	hints.ai_protocol = 0;
+	hints.ai_canonname = NULL;
+	hints.ai_addr = NULL;
+	hints.ai_next = NULL;
+	if (cluster.n > 1 && query_mode == FRAME_RANK)
+		use_node(cluster_owner(&cluster, rated_handle, 0));
+	else if (cluster.n > 1) {
+		srand(time(NULL) ^ getpid());
+		use_node(rand() % cluster.n);
+	}
+	if (getaddrinfo(servaddr, query_port, &hints, &addrlist) != 0 )
+		error(3);
+	q_dest = (struct sockaddr_in*) addrlist->ai_addr;
+	
+	// Initialize socket and send query request to server.
+	query_sock = socket(addrlist->ai_family, addrlist->ai_socktype, 0);
+	if (query_sock < 0) error(3);
+	struct nim_frame f;
+	unsigned char query[32];
+	frame_begin(&f, query, sizeof(query), query_mode);
+	frame_str(&f, password);
+	if (query_mode == FRAME_STANDINGS || query_mode == FRAME_TOP) frame_u32(&f, first_rank);
+	if (query_mode == FRAME_RANK) frame_str(&f, rated_handle);
+	int size = frame_end(&f);
+	sent = sendto(query_sock, query, size, 0,
+			(struct sockaddr*) q_dest,
+			sizeof(struct sockaddr_in));
+	if (sent < size) error(3);
+	
+	// Build select list.
+	fd_set socks;
+	FD_ZERO(&socks);
+	FD_SET(query_sock, &socks);
+	int max_sock = query_sock;
+	struct timeval timeout;
+	timeout.tv_sec = 60; timeout.tv_usec = 0;
+	
+	// Wait up to 60s for server response, terminate if none.
+	int active = select(max_sock+1, &socks, (fd_set*) 0, (fd_set*) 0, &timeout);
+	if (active < 0) error(3); // select() error
+	if (active == 0) error(4); // did not receive response
+	else { // received response
+	
+		// Receive LOBBY or REPORT response.
+		socklen_t q_size = sizeof(struct sockaddr_in);
+		unsigned char *response = malloc(0x10000 + NIM_FRAME_HEAD);
+		int rec = recvfrom(query_sock, response, 0x10000 + NIM_FRAME_HEAD, 0,
+				(struct sockaddr*) q_dest, &q_size);
+		struct nim_cursor c;
+		int type = frame_datagram(response, rec, &c);
+		if (type == FRAME_REPORT && query_mode == FRAME_METRICS) {
+			fwrite(c.p, 1, c.left, stdout);
+			free(response);
+			exit(0);
+		}
+		if (type == FRAME_TABLE && query_mode == FRAME_STANDINGS) {
+			print_table(&c);
+			free(response);
+			exit(0);
+		}
+		if (type == FRAME_RATING && query_mode == FRAME_RANK) {
+			print_rating(&c);
+			free(response);
+			exit(0);
+		}
+		if (type == FRAME_LEADERS && query_mode == FRAME_TOP) {
+			print_leaders(&c);
+			free(response);
+			exit(0);
+		}
+		if (type != FRAME_LOBBY) error(3);
+		char waiting[20], player1[20], player2[20];
+		int inprog = get_u32(&c);
+		get_str(&c, waiting);
+		int games = get_u16(&c);
+		if (c.bad) error(3);
+		
+		// Display information and terminate.
+		if (inprog == 1) printf("> There is 1 game in progress\n");
+		else printf("> There are %d games in progress\n", inprog);
+		while (games-- > 0) { // display any games in progress
+			get_str(&c, player1);
+			get_str(&c, player2);
+			if (c.bad) break;
+			printf("%20s vs. %-20s\n", player1, player2);
+		}
+		if (waiting[0] != 0) { // display any player waiting
+			printf("> %s is waiting to play\n", waiting);
+		}
+		free(response);
+		exit(0);
+	}
+}
+
+// Display a TABLE response, the tournament's standings.
+void print_table(struct nim_cursor *c) {
+	char *formats[] = {"Round robin", "Single elimination", "Double elimination"};
+	char *statuses[] = {"away", "waiting", "playing", "out", "finished"};
+	char entrant[20];
+	int format = get_u8(c), finished = get_u8(c);
+	unsigned entrants = get_u32(c), played = get_u32(c), playing = get_u32(c);
+	unsigned first = get_u32(c), rows = get_u16(c);
+	if (c->bad || format > 2) error(3);
+	if (entrants == 0) {
+		printf("> There is no tournament\n");
+		return;
+	}
+	printf("> %s of %u: %u matches played, %u in progress%s\n", formats[format],
+			entrants, played, playing, finished ? ", finished" : "");
+	for ( ; rows > 0; rows--, first++) {
+		get_str(c, entrant);
+		int won = get_u16(c), lost = get_u16(c), status = get_u8(c);
+		if (c->bad) break;
+		printf("%6u  %-20s %4d-%-4d %s\n", first + 1, entrant, won, lost,
+				statuses[status < 5 ? status : 0]);
+	}
+}
+
+// Display a RATING response, one player's rating.
+void print_rating(struct nim_cursor *c) {
+	char player[20];
+	get_str(c, player);
+	unsigned rating = get_u32(c), rank = get_u32(c), rated = get_u32(c);
+	unsigned played = get_u32(c), won = get_u32(c);
+	if (c->bad) error(3);
+	if (rank == 0) printf("> %s is not rated\n", player);
+	else printf("> %s is rated %d, ranked %u of %u, with %u of %u games won\n",
+			player, (int) rating, rank, rated, won, played);
+}
+
+// Display a LEADERS response, the best rated players.
+void print_leaders(struct nim_cursor *c) {
+	char player[20];
+	unsigned rated = get_u32(c), first = get_u32(c), rows = get_u16(c);
+	if (c->bad) error(3);
+	if (rated == 0) {
+		printf("> There are no rated players\n");
+		return;
+	}
+	printf("> %u rated player%s\n", rated, rated == 1 ? "" : "s");
+	for ( ; rows > 0; rows--, first++) {
+		get_str(c, player);
+		int rating = get_u32(c), played = get_u32(c), won = get_u32(c);
+		if (c->bad) break;
+		printf("%6u  %-20s %5d %6d games %6d won\n", first + 1, player, rating,
+				played, won);
+	}
+}
+
+// Connect to the server to play a game.
+void play_request() {
+
+	// Get server info for play request: a cluster's node owning the handle,
+	// unless a redirect has chosen the node already.
+	struct sockaddr_in *p_dest;
+	struct addrinfo hints, *addrlist;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_PASSIVE;
+	hints.ai_protocol = 0;
+	hints.ai_canonname = NULL;
+	hints.ai_addr = NULL;
+	hints.ai_next = NULL;
+	if (watch_handle[0] == '\0' && handle[0] == '\0') {
+		printf("Enter a handle to play: "); // get handle from user
+		scanf("%19s", handle);
+	}
+	if (watch_handle[0] == '\0' && cluster.n > 1 && redirects == 0)
+		use_node(cluster_owner(&cluster, handle, 0));
+	if (getaddrinfo(servaddr, play_port, &hints, &addrlist) != 0)
+		error(5);
+	p_dest = (struct sockaddr_in*) addrlist->ai_addr;
+	
+	// Initialize socket and connect to server play port.
+	play_sock = socket(addrlist->ai_family, addrlist->ai_socktype, 0);
+	if (play_sock < 0) error(5);
+	if (connect(play_sock, (struct sockaddr*) p_dest, sizeof(struct sockaddr_in)) < 0)
+		exit(5);
+	
+	// Send password and handle together, then wait for the server to
+	// accept or reject them. A spectator sends the handle of the player
+	// to watch instead.
+	struct nim_frame f;
+	struct nim_cursor c;
+	unsigned char request[64];
+	int size;
+	frame_begin(&f, request, sizeof(request), FRAME_HELLO);
+	frame_u8(&f, NIM_VERSION);
+	frame_str(&f, password);
+	size = frame_end(&f);
+	if (watch_handle[0] != '\0') {
+		frame_begin(&f, request + size, sizeof(request) - size, FRAME_WATCH);
+		frame_str(&f, watch_handle);
+	} else {
+		frame_begin(&f, request + size, sizeof(request) - size, FRAME_JOIN);
+		frame_str(&f, handle);
+		if (variant_name[0] != '\0') frame_str(&f, variant_name);
+	}
+	size += frame_end(&f);
+	if (s_send(play_sock, (void *) request, size) < 0)
+		error(5);
+	if (recv_frame(&c) != FRAME_WELCOME) error(5);
+
+	play_game();
+}
+
+// Play a game of nim through a match server, or watch one from seat 0.
+void play_game() {
+
+	// Receive handles from server and display.
+	struct nim_cursor c;
+	char player1[20], player2[20];
+	int type = recv_frame(&c), reason, seat;
+	if (type == FRAME_REDIRECT) { // try the node named instead
+		if ( (seat = get_u8(&c)) >= cluster.n || redirects++ == NIM_REDIRECT_MAX )
+			error(5);
+		close(play_sock);
+		in.len = in.off = 0;
+		use_node(seat);
+		play_request();
+		return;
+	}
+	if (type == FRAME_REJECT) { // turned away on joining
+		if ( (reason = get_u8(&c)) == REJECT_VARIANT )
+			fprintf(stderr, "nim: server has no variant %s\n", variant_name);
+		else if (reason == REJECT_WATCH)
+			fprintf(stderr, "nim: %s is not playing\n", watch_handle);
+		error(5);
+	}
+	if (type != FRAME_START) error(4);
+	seat = get_u8(&c);
+	get_str(&c, player1);
+	get_str(&c, player2);
+	get_str(&c, variant.name);
+	variant.misere = get_u8(&c);
+	if (c.bad) error(4);
+	printf(seat ? "\nTHE GAME HAS BEGUN!\n" : "\nWATCHING A GAME IN PROGRESS\n");
+	if (strcmp(variant.name, "classic") != 0)
+		printf("Variant: %s, %s\n", variant.name, variant.misere
+				? "taking the last stone loses" : "taking the last stone wins");
+	printf("Player 1: %s\n", player1);
+	printf("Player 2: %s\n", player2);
+
+	// Enter game loop. 
+	struct nim_frame f;
+	unsigned char move[16];
+	int size;
+	for ( ; ; ) {
+	
+		// Receive board config from server and display.
+		if (recv_frame(&c) != FRAME_TURN) error(6);
+		int turn = get_u16(&c);
+		struct nim_packed_board packed;
+		frame_get(&c, &packed, sizeof(packed));
+		b = board_unpack(&packed);
+		int status = get_u8(&c);
+		if (c.left > 0) { // a variant board, as row counts
+			int row;
+			variant.rows = get_u8(&c);
+			if (variant.rows > NIM_MAX_ROWS) error(6);
+			frame_get(&c, heaps.h, variant.rows);
+			for (row = 0; row < variant.rows; row++) // full rows come first
+				if (heaps.h[row] > variant.len[row]) variant.len[row] = heaps.h[row];
+		}
+		if (c.bad) error(6);
+		display_board();
+
+		// A spectator sees the game as player 1 does.
+		if (seat == 0) {
+			if (status == 'W' || status == 'L') {
+				printf("\nGame over: %s WINS!\n", status == 'W' ? player1 : player2);
+				break;
+			}
+			printf("\n%s to move...\n", status == 'A' ? player1 : player2);
+			continue;
+		}
+
+		// Respond to move request if appropriate.
+		if (status == 'W') { win(); break; }
+		else if (status == 'L') { loss(); break; }
+		else if (status == 'A') { // respond to move request
+			int valid_move = 0;
+			char in[16]; int i; char cur;
+			int row = -1; int col = -1;
+			printf("\nEnter move: ");
+			while (valid_move == 0) {
+				fflush(stdin);
+				row = -1; col = -1;
+				fgets(in, sizeof(in), stdin);
+				if (in[0] == '\n') continue;
+				// "row col", or two digits as the classic client took them
+				if (sscanf(in, "%d %d", &row, &col) == 2) i = strlen(in);
+				else { row = -1; i = 0; }
+				for ( ; i < strlen(in); i++) {
+					cur = in[i];
+					if (isspace(cur)) continue;
+					else if (row < 0) row = cur - '0';
+					else if (col < 0) col = cur - '0';
+				}
+				valid_move = check_move(row, col);
+				if (!valid_move) printf("\nInvalid move, try again: ");
+			}
+			frame_begin(&f, move, sizeof(move), FRAME_MOVE);
+			frame_u16(&f, turn);
+			frame_u8(&f, row);
+			frame_u8(&f, col);
+			size = frame_end(&f);
+			if (s_send(play_sock, (void *) move, size) < 0)
+				error(6);
+		} else { // not client's turn
+			printf("\nWaiting for opponent's move...\n");
+		}
+	} // end play loop
+}
+
+// Wait for the next frame from the server, returning its type or -1.
+int recv_frame(struct nim_cursor *c) {
+	int type;
+	while ( (type = frame_next(&in, c)) == 0 )
+		if (frame_read(play_sock, &in) <= 0) return -1;
+	return type;
+}
+
+// Check a given move for validity.
+int check_move(int row, int col) {
+	if (row == 0 && col == 0) return -1;
+	if (variant.rows > 0) return heaps_legal(&heaps, &variant, row, col);
+	return board_legal(b, row, col);
+}
+
+// Display the board, one row per line.
+void display_board() {
+	int row, col;
+	if (variant.rows > 0) { // a variant board, as wide as its longest row
+		int width = 0;
+		for (row = 0; row < variant.rows; row++)
+			if (variant.len[row] > width) width = variant.len[row];
+		printf("\nrow");
+		for (row = 1; row <= variant.rows; row++) {
+			printf("\n%2d|", row);
+			for (col = 1; col <= heaps.h[row - 1]; col++) printf(" O");
+		}
+		printf("\n  +");
+		for (col = 0; col <= width; col++) printf("--");
+		printf("\n   ");
+		for (col = 1; col <= width; col++) printf(" %d", col % 10);
+		printf(" col\n");
+		return;
+	}
+	printf("\nrow");
+	for (row = 1; row <= NIM_ROWS; row++) {
+		printf("\n%d|", row);
+		for (col = 1; col <= NIM_COLS; col++) {
+			if (board_legal(b, row, col)) printf(" O");
+			else printf("  ");
+		}
+	} printf("\n +-----------------\n   1 2 3 4 5 6 7 col\n");
+}
+
+// Run headless sessions until the games are played or time is up.
+void headless() {
+
+	// Get server info for play requests, and the moves to play.
+	struct addrinfo hints, *addrlist;
+	int epfd, i, n;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if (getaddrinfo(servaddr, play_port, &hints, &addrlist) != 0) error(5);
+	if ( (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) error(5);
+	client_init(&client, epfd, (struct sockaddr_in *) addrlist->ai_addr);
+	freeaddrinfo(addrlist);
+	if (cluster.n > 1) client.cluster = &cluster;
+	memcpy(client.password, password, 20);
+	memcpy(client.variant, variant_name, 20);
+	client.move = headless_move;
+	client.hook = headless_hook;
+	if (strcmp(source, "stdin") == 0) {
+		input.kind = SRC_CONTROL;
+		input.fd = STDIN_FILENO;
+		set_nonblock(STDIN_FILENO, 1);
+		if (ev_add(epfd, &input, EPOLLIN) < 0) error(7);
+	} else if (strcmp(source, "bot") && strcmp(source, "first") && strcmp(source, "random"))
+		read_script(source);
+	signal(SIGPIPE, SIG_IGN);
+	srand(time(NULL) ^ getpid());
+
+	// Start the sessions, then run until they are done.
+	if (games == 0) games = sessions;
+	if (sessions > games) sessions = games;
+	session = calloc(sessions, sizeof(struct nim_session));
+	script_pos = calloc(sessions, sizeof(int));
+	restarts = malloc(sessions * sizeof(struct nim_session *));
+	for (i = 0; i < sessions; i++) {
+		char handle[24];
+		session[i].id = i;
+		snprintf(handle, sizeof(handle), "%s%d", prefix, i);
+		started += 1;
+		session_connect(&client, &session[i], handle);
+	}
+	struct epoll_event events[NIM_MAX_EVENTS];
+	long long start = now_us(), deadline = start + seconds * 1000000LL;
+	while (client.active > 0) {
+		int timeout = seconds ? (deadline - now_us()) / 1000 : -1;
+		if (seconds && timeout <= 0) break;
+		if ( (n = epoll_wait(epfd, events, NIM_MAX_EVENTS, timeout)) < 0 ) {
+			if (errno == EINTR) continue;
+			error(6);
+		}
+		for (i = 0; i < n; i++) {
+			struct nim_source *src = events[i].data.ptr;
+			if (src->kind == SRC_CONTROL) read_input();
+			else session_event((struct nim_session *) src, events[i].events);
+		}
+		while (nrestarts > 0) { // reconnect for the games still to play
+			struct nim_session *s = restarts[--nrestarts];
+			if (started >= games) continue;
+			started += 1;
+			session_connect(&client, s, s->handle);
+		}
+	}
+	printf("{\"type\":\"summary\",\"games\":%lld,\"wins\":%lld,\"losses\":%lld,"
+			"\"rejected\":%lld,\"failed\":%lld,\"unfinished\":%d,\"seconds\":%.3f}\n",
+			ended, wins, ended - wins, rejected, failed, client.active,
+			(now_us() - start) / 1e6);
+}
+
+// Load a move script: "row col" per line, # starting a comment.
+void read_script(char *path) {
+	FILE *file;
+	char line[LINE_MAX];
+	int row, col;
+	if ( (file = fopen(path, "r")) == NULL ) error(7);
+	while (fgets(line, LINE_MAX, file) != NULL && script_len < NIM_SCRIPT_MAX) {
+		if (line[0] == '#' || sscanf(line, "%d %d", &row, &col) != 2) continue;
+		if (row < 0 || row > 255 || col < 0 || col > 255) error(7);
+		script[2 * script_len] = row;
+		script[2 * script_len++ + 1] = col;
+	}
+	fclose(file);
+	if (script_len == 0) error(7);
+}
+
+// Choose a session's move from the source given; with stdin, ask for it.
+int headless_move(struct nim_session *s, int *row, int *col) {
+	struct nim_variant *v = &s->variant;
+	int i;
+	if (strcmp(source, "stdin") == 0) {
+		if (input.kind == SRC_DEAD) { *row = *col = 0; return 1; } // resign
+		printf("{\"type\":\"turn\",\"session\":%d,\"turn\":%d,\"misere\":%d,\"rows\":[",
+				s->id, s->turn, v->misere);
+		for (i = 0; i < v->rows; i++) printf(i ? ",%d" : "%d", s->heaps.h[i]);
+		printf("]}\n");
+		fflush(stdout);
+		return 0;
+	}
+	if (strcmp(source, "first") == 0) {
+		for (*row = 1; s->heaps.h[*row - 1] == 0; *row += 1) ;
+		*col = s->heaps.h[*row - 1];
+	} else if (strcmp(source, "random") == 0) {
+		do { *row = 1 + rand() % v->rows; } while (s->heaps.h[*row - 1] == 0);
+		*col = 1 + rand() % s->heaps.h[*row - 1];
+	} else if (script_len > 0 && script_pos[s->id] < script_len) {
+		i = script_pos[s->id]++;
+		*row = script[2 * i];
+		*col = script[2 * i + 1];
+		if (heaps_legal(&s->heaps, v, *row, *col) || (*row == 0 && *col == 0))
+			return 1;
+		bot_move(&s->heaps, v, row, col);
+	} else bot_move(&s->heaps, v, row, col);
+	return 1;
+}
+
+// Take "session row col" lines from stdin as moves. Once stdin closes,
+// sessions waiting on a move resign.
+void read_input() {
+	char *line, *end;
+	int num, id, row, col, i;
+	while ( (num = read(STDIN_FILENO, input_buf + input_len,
+			sizeof(input_buf) - 1 - input_len)) > 0 ) {
+		input_len += num;
+		input_buf[input_len] = '\0';
+		for (line = input_buf; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+			*end = '\0';
+			if (sscanf(line, "%d %d %d", &id, &row, &col) != 3 || id < 0
+					|| id >= sessions || session_move(&session[id], row, col) < 0)
+				printf("{\"type\":\"error\",\"error\":\"unexpected move\"}\n");
+		}
+		input_len -= line - input_buf;
+		memmove(input_buf, line, input_len);
+		if (input_len == sizeof(input_buf) - 1) input_len = 0; // overlong line
+	}
+	if (num < 0 && (errno == EAGAIN || errno == EINTR)) return;
+	ev_del(client.epfd, &input);
+	input.kind = SRC_DEAD;
+	for (i = 0; i < sessions; i++) session_move(&session[i], 0, 0);
+}
+
+// Report a session's results as JSON lines, and reconnect it after a game.
+void headless_hook(struct nim_session *s, int what) {
+	char *reasons[] = {"", "password", "version", "protocol", "variant", "watch"};
+	switch (what) {
+	case SESSION_START: // a new game replays the script from the top
+		script_pos[s->id] = 0;
+		return;
+	case SESSION_END:
+		ended += 1;
+		if (s->status == 'W') wins += 1;
+		printf("{\"type\":\"game\",\"session\":%d,", s->id);
+		print_json_str("handle", s->handle);
+		print_json_str("player1", s->player1);
+		print_json_str("player2", s->player2);
+		print_json_str("variant", s->variant.name);
+		printf("\"seat\":%d,\"result\":\"%s\",\"moves\":%d,\"turns\":%d,"
+				"\"ms\":%.3f}\n", s->seat, s->status == 'W' ? "win" : "loss",
+				s->moves, s->turn, (s->t_turn - s->t_start) / 1000.0);
+		restarts[nrestarts++] = s;
+		break;
+	case SESSION_REJECT:
+		rejected += 1;
+		printf("{\"type\":\"reject\",\"session\":%d,", s->id);
+		print_json_str("handle", s->handle);
+		printf("\"reason\":\"%s\"}\n", s->reason < 6 ? reasons[s->reason] : "");
+		break;
+	case SESSION_FAILED:
+		failed += 1;
+		printf("{\"type\":\"error\",\"session\":%d,", s->id);
+		print_json_str("handle", s->handle);
+		printf("\"error\":\"connection\"}\n");
+		break;
+	default:
+		return;
+	}
+	fflush(stdout);
+}
+
+// Print a "name":"value", member with the value escaped for JSON.
+void print_json_str(char *name, char *value) {
+	printf("\"%s\":\"", name);
+	for ( ; *value != '\0'; value++) {
+		if (*value == '"' || *value == '\\') printf("\\%c", *value);
+		else if ((unsigned char) *value < 0x20) printf("\\u%04x", *value);
+		else putchar(*value);
+	}
+	printf("\",");
+}
+
+void win() {
+	printf("\nGame over: you WIN!\n");
+}
+
+void loss() {
+	printf("\nGame over: you LOSE!\n");
+}
+
+// Print appropriate error message and exit.
+void error(int code) {
+	switch(code) {
+	case 1:
+		fprintf(stderr, "nim: argument error: exit 1\n");
+		exit(1); break;
+	case 2:
+		fprintf(stderr, "nim: unable to access server address file: exit 2\n");
+		exit(2); break;
+	case 3:
+		fprintf(stderr, "nim: problem querying server: exit 3\n");
+		exit(3); break;
+	case 4:
+		fprintf(stderr, "nim: no query response from server: exit 4\n");
+		exit(4); break;
+	case 5:
+		fprintf(stderr, "nim: problem requesting to play: exit 5\n");
+		exit(5); break;
+	case 6:
+		fprintf(stderr, "nim: problem communicating with match server: exit 6\n");
+		exit(6); break;
+	case 7:
+		fprintf(stderr, "nim: problem reading move script: exit 7\n");
+		exit(7); break;
+	}
+}
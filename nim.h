@@ -1,97 +1,206 @@
-// CS415 Project #4: nim.h (header)
-// Gavin Cabbage - gavincabbage@gmail.com
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/wait.h>
-#include <netdb.h>
-#include <arpa/inet.h>
-#include <errno.h>
-#include <unistd.h>
-#include <limits.h>
-#include <signal.h>
-#include <ctype.h>
-
-#define MATCH_SOCK_1 3
-#define MATCH_SOCK_2 4
-
-
-// Safe send and receive functions for TCP communication.
-int s_send(int sock, void *buffer, int size) {
-	int to_send = size; int sent = 0; int num;
-	while (to_send > 0) {
-		if ( (num = write(sock, buffer+sent, to_send)) < 0 )
-			return -1; // error
-		else { to_send -= num; sent += num; }
-	} return 0;
-}
-int s_recv(int sock, void *buffer, int size) {
-	int to_rec = size; int rec = 0; int num;
-	while (to_rec > 0) {
-		if ( (num = read(sock, buffer+rec, to_rec)) < 0 )
-			return -1; // error
-		else { to_rec -= num; rec += num; }
-	} return 0;
-}
-
-
-// Games in progress linked list for server.
-struct nim_game {
-	int match_pid;
-	char player1[20];
-	char player2[20];
-	struct nim_game *next;
-};
-
-
-// Nim Messaging Protocol
-// ======================
-
- // General purpose message.
-struct nim_msg {
-	char type;
-		// <A> move request - match -> nim
-		// <H> handle request - server -> nim
-		// <L> loss notification - match -> nim
-		// <P> password submit - nim -> server
-		// <R> handle response - nim -> server | match -> nim
-		// <W> win notification - match -> nim
-		// <X> incorrect password - server -> nim
-	char data[20];
-};
-
- // Client query.
- // nim -> server
-struct nim_query {
-	char password[20];
-		// limit password to 20 characters
-};
-
- // Server query response.
- // server -> nim
-struct nim_query_response {
-	int inprog; 
-		// number of games in progress
-	char waiting[20]; 
-		// waiting user's handle
-	char games[LINE_MAX]; 
-		// list of games in progress
-};
-
- // Match server board config.
- // match -> nim
-struct nim_board {
-	char board[28];
-		// row order format:
-		// [ row1 row2 row3 row4 ]
-};
-
- // Client move response.
- // nim -> match
-struct nim_move {
-	char row;
-	char col;
-};
+// CS415 Project #4: nim.h (header)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+#ifndef NIM_H
+#define NIM_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <math.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/syscall.h>
+
+#define MATCH_SOCK_1 3
+#define MATCH_SOCK_2 4
+#define MATCH_SOCK_3 5 // a forked match server's control socket
+#define NIM_SPEC_MAX 320 // longest board variant spec, see nim_variant.h
+
+
+// Safe send and receive functions for TCP communication.
+int s_send(int sock, void *buffer, int size) {
+	int to_send = size; int sent = 0; int num;
+	while (to_send > 0) {
+		if ( (num = write(sock, buffer+sent, to_send)) < 0 )
+			return -1; // error
+		else { to_send -= num; sent += num; }
+	} return 0;
+}
+int s_recv(int sock, void *buffer, int size) {
+	int to_rec = size; int rec = 0; int num;
+	while (to_rec > 0) {
+		if ( (num = read(sock, buffer+rec, to_rec)) < 0 )
+			return -1; // error
+		else { to_rec -= num; rec += num; }
+	} return 0;
+}
+
+// Send a message with descriptors attached over a UNIX socket.
+int send_fds(int sock, void *buffer, int size, int *fds, int nfds) {
+	struct msghdr mh;
+	struct iovec iov;
+	char control[CMSG_SPACE(8 * sizeof(int))];
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = buffer; iov.iov_len = size;
+	mh.msg_iov = &iov; mh.msg_iovlen = 1;
+	if (nfds > 0) {
+		memset(control, 0, sizeof(control));
+		mh.msg_control = control;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+	}
+	return sendmsg(sock, &mh, MSG_NOSIGNAL) == size ? 0 : -1;
+}
+
+// Receive a message and any attached descriptors (at most 8).
+// Returns the number of bytes read, with *nfds set to descriptors received.
+int recv_fds(int sock, void *buffer, int size, int *fds, int *nfds) {
+	struct msghdr mh;
+	struct iovec iov;
+	char control[CMSG_SPACE(8 * sizeof(int))];
+	int num;
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = buffer; iov.iov_len = size;
+	mh.msg_iov = &iov; mh.msg_iovlen = 1;
+	mh.msg_control = control; mh.msg_controllen = sizeof(control);
+	if ( (num = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0 ) return -1;
+	*nfds = 0;
+	struct cmsghdr *cm;
+	for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cm), *nfds * sizeof(int));
+		}
+	}
+	return num;
+}
+
+
+// Games in progress registry entry for server.
+struct nim_game {
+	int match_pid; // forked match server, 0 if none
+	int worker; // pool worker hosting the match, -1 if none
+	int control; // control socket to the forked match server, -1 if none
+	struct nim_match *match; // match hosted in-process, NULL if none
+	unsigned id; // registry handle, also the game id given to a worker
+	char player1[20];
+	char player2[20];
+	int snap_off, snap_len; // entry in the query snapshot, 0 length if unlisted
+	unsigned gen; // slot generation
+	int live; // slot holds a game in progress
+	int free_next; // next free slot while not live
+	struct nim_game *prev, *next; // live games
+};
+
+
+// Nim Messaging Protocol
+// ======================
+
+ // General purpose message.
+struct nim_msg {
+	char type;
+		// <A> move request - match -> nim
+		// <H> handle request - server -> nim
+		// <L> loss notification - match -> nim
+		// <P> password submit - nim -> server
+		// <R> handle response - nim -> server | match -> nim
+		// <W> win notification - match -> nim
+		// <X> incorrect password - server -> nim
+	char data[20];
+};
+
+ // Client query.
+ // nim -> server
+struct nim_query {
+	char password[20];
+		// limit password to 20 characters
+};
+
+ // Server query response.
+ // server -> nim
+struct nim_query_response {
+	int inprog; 
+		// number of games in progress
+	char waiting[20]; 
+		// waiting user's handle
+	char games[LINE_MAX]; 
+		// list of games in progress
+};
+
+ // Match server board config.
+ // match -> nim
+struct nim_board {
+	char board[28];
+		// row order format:
+		// [ row1 row2 row3 row4 ]
+};
+
+ // Packed board config, see nim_board.h.
+ // match -> nim
+struct nim_packed_board {
+	uint32_t bits;
+		// one bit per stone, network byte order
+};
+
+ // Client move response.
+ // nim -> match
+struct nim_move {
+	char row;
+	char col;
+};
+
+ // Match worker game assignment, sent with both player sockets attached,
+ // or a spectator for a game, sent with the spectator's socket attached.
+ // server -> match worker | match server
+struct nim_match_assign {
+	unsigned id;
+		// game id, echoed in the result
+	unsigned char watch;
+		// nonzero for a spectator, which needs only the id
+	char handle1[20];
+	char handle2[20];
+	unsigned char version1, version2;
+		// protocol versions, see nim_proto.h
+	char variant[NIM_SPEC_MAX];
+		// board variant spec, empty for the classic board
+};
+
+ // Match worker game result.
+ // match worker -> server
+struct nim_match_result {
+	unsigned id;
+	int winner;
+		// 1 or 2, 0 if undecided
+};
+
+#endif
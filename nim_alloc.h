@@ -0,0 +1,135 @@
+// CS415 Project #4: nim_alloc.h (slab and arena allocation)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Memory for the objects the servers make and throw away as they play.
+// Each kind of fixed size object, a connection, a match, a spectator, has
+// a slab: objects are taken from and given back to its free list in O(1),
+// and the slab takes memory from malloc a chunk of many objects at a time
+// and never gives it back. Anything a match needs of varying size, its
+// move list and its game log record, comes from the match's arena, which
+// is carved from blocks of a slab of its own and given back in one step
+// when the match ends. Once a server has seen its busiest moment, play
+// calls malloc no more: each chunk taken counts toward
+// nim_alloc_mallocs_total in the metrics, which stays flat in steady state.
+// With NIM_ALLOC_STATS set, every slab's counts are reported on exit.
+
+#ifndef NIM_ALLOC_H
+#define NIM_ALLOC_H
+
+#include "nim_metrics.h"
+
+#define NIM_SLAB_CHUNK 65536 // bytes taken from malloc at a time
+#define NIM_ARENA_BLOCK 1024 // bytes in an arena block, its header included
+
+// Slab of one size of object, set up by naming it and its object size:
+// struct nim_slab s = {"name", sizeof(struct thing)};
+struct nim_slab {
+	char *name;
+	int size; // object size, rounded up to 16 bytes once in use
+	void *free; // free objects, linked through their first word
+	long long allocs, frees;
+	int in_use, peak, chunks;
+	struct nim_slab *next; // every slab in use, for the statistics
+};
+
+struct nim_slab *slabs; // every slab that has taken a chunk
+
+// Block of an arena, from the arena slab or, if larger, from malloc.
+struct nim_arena_block {
+	struct nim_arena_block *next;
+	int cap, used; // bytes of data
+	long long data[]; // aligned for anything stored
+};
+
+// Arena: allocate piecemeal, free everything at once.
+struct nim_arena {
+	struct nim_arena_block *first; // the block allocated from, NULL if none
+};
+
+struct nim_slab arena_slab = {"arena", NIM_ARENA_BLOCK};
+
+// Take a chunk from malloc and put its objects on the free list. Returns
+// -1 if there is no memory.
+int slab_grow(struct nim_slab *s) {
+	char *chunk;
+	int i, n;
+	if (s->chunks == 0) { // first use
+		s->size = (s->size + 15) & ~15;
+		s->next = slabs;
+		slabs = s;
+	}
+	n = NIM_SLAB_CHUNK / s->size > 0 ? NIM_SLAB_CHUNK / s->size : 1;
+	if ( (chunk = malloc((size_t) n * s->size)) == NULL ) return -1;
+	metrics_count(M_ALLOC_MALLOCS);
+	s->chunks += 1;
+	for (i = n - 1; i >= 0; i--) {
+		*(void **) (chunk + (size_t) i * s->size) = s->free;
+		s->free = chunk + (size_t) i * s->size;
+	}
+	return 0;
+}
+
+// Take an object from a slab, zeroed. Returns NULL if there is no memory.
+void *slab_alloc(struct nim_slab *s) {
+	void *obj;
+	if (s->free == NULL && slab_grow(s) < 0) return NULL;
+	obj = s->free;
+	s->free = *(void **) obj;
+	memset(obj, 0, s->size);
+	s->allocs += 1;
+	if ( (s->in_use += 1) > s->peak ) s->peak = s->in_use;
+	return obj;
+}
+
+// Give an object back to its slab; NULL is ignored.
+void slab_free(struct nim_slab *s, void *obj) {
+	if (obj == NULL) return;
+	*(void **) obj = s->free;
+	s->free = obj;
+	s->frees += 1;
+	s->in_use -= 1;
+}
+
+// Allocate from an arena, 8 byte aligned. Returns NULL if there is no
+// memory.
+void *arena_alloc(struct nim_arena *a, int size) {
+	struct nim_arena_block *b = a->first;
+	int small = NIM_ARENA_BLOCK - sizeof(struct nim_arena_block);
+	size = (size + 7) & ~7;
+	if (b == NULL || b->cap - b->used < size) {
+		if (size <= small) b = slab_alloc(&arena_slab);
+		else if ( (b = malloc(sizeof(struct nim_arena_block) + size)) != NULL )
+			metrics_count(M_ALLOC_MALLOCS);
+		if (b == NULL) return NULL;
+		b->cap = size <= small ? small : size;
+		b->used = 0;
+		b->next = a->first;
+		a->first = b;
+	}
+	b->used += size;
+	return (char *) b->data + b->used - size;
+}
+
+// Free everything allocated from an arena.
+void arena_free(struct nim_arena *a) {
+	struct nim_arena_block *b, *next;
+	int small = NIM_ARENA_BLOCK - sizeof(struct nim_arena_block);
+	for (b = a->first; b != NULL; b = next) {
+		next = b->next;
+		if (b->cap == small) slab_free(&arena_slab, b);
+		else free(b);
+	}
+	a->first = NULL;
+}
+
+// Report every slab's counts, if NIM_ALLOC_STATS is set.
+void alloc_print_stats(char *who) {
+	struct nim_slab *s;
+	if (getenv("NIM_ALLOC_STATS") == NULL) return;
+	for (s = slabs; s != NULL; s = s->next)
+		fprintf(stderr, "%s: slab %s of %d bytes: %lld allocs, %lld frees, "
+				"%d in use, %d peak, %d chunks\n", who, s->name, s->size,
+				s->allocs, s->frees, s->in_use, s->peak, s->chunks);
+}
+
+#endif
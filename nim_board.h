@@ -0,0 +1,53 @@
+// CS415 Project #4: nim_board.h (bitboard)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// The board as a single 32 bit word. Row r (1-4) occupies bits 7(r-1)
+// through 7(r-1)+6 and column c is bit c-1 of its row, set while that stone
+// is on the board, so bit i stands for byte i of the 28 byte 'O'/'X' form
+// old clients are sent. Stones in a row always form a prefix, since a move
+// takes a stone and everything to its right. Play itself is on the row
+// counts of nim_variant.h; the word is how the classic board is checked,
+// shown and sent.
+
+#ifndef NIM_BOARD_H
+#define NIM_BOARD_H
+
+typedef uint32_t nim_bits;
+
+#define NIM_ROWS 4
+#define NIM_COLS 7
+#define NIM_ROW_MASK(row) (0x7Fu << (NIM_COLS * ((row) - 1)))
+
+// Bit index of a stone, assuming row and col are on the board.
+int board_bit(int row, int col) {
+	return NIM_COLS * (row - 1) + col - 1;
+}
+
+// Check a move: the stone at row, col must still be on the board.
+int board_legal(nim_bits b, int row, int col) {
+	if (row < 1 || row > NIM_ROWS || col < 1 || col > NIM_COLS) return 0;
+	return (b >> board_bit(row, col)) & 1;
+}
+
+// Stones left in a row.
+int board_stones(nim_bits b, int row) {
+	return __builtin_popcount(b & NIM_ROW_MASK(row));
+}
+
+// Convert to the 28 byte form.
+void board_to_ascii(nim_bits b, struct nim_board *board) {
+	int i;
+	for (i = 0; i < NIM_ROWS * NIM_COLS; i++)
+		board->board[i] = ((b >> i) & 1) ? 'O' : 'X';
+}
+
+// Convert to and from the 4 byte wire form.
+void board_pack(nim_bits b, struct nim_packed_board *packed) {
+	packed->bits = htonl(b);
+}
+nim_bits board_unpack(struct nim_packed_board *packed) {
+	return ntohl(packed->bits) & (NIM_ROW_MASK(1) | NIM_ROW_MASK(2)
+			| NIM_ROW_MASK(3) | NIM_ROW_MASK(4));
+}
+
+#endif
@@ -0,0 +1,69 @@
+// CS415 Project #4: nim_bot.h (bot opponent)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Computer opponent. Taking the last stone loses, so the game is misere Nim
+// on rows of at most 1, 3, 5 and 7 stones: 2*4*6*8 = 384 positions, few
+// enough to solve outright by working back from the empty board. The
+// result is a table holding the best move in every position, so the bot
+// answers in O(1). On any other variant it plays the evaluator's move. With
+// probability bot_random percent it plays a random legal move instead.
+
+#ifndef NIM_BOT_H
+#define NIM_BOT_H
+
+#define NIM_BOT_STATES 384
+
+unsigned char bot_table[NIM_BOT_STATES]; // best move, row << 4 | col
+char bot_wins[NIM_BOT_STATES]; // the player to move can force a win
+int bot_ready = 0;
+int bot_random = 0; // percent of moves played at random
+
+// Index of a classic position.
+int bot_index(struct nim_heaps *p) {
+	return p->h[0] + 2 * (p->h[1] + 4 * (p->h[2] + 6 * p->h[3]));
+}
+
+// Solve every position. A move only ever lowers one row count, which
+// lowers the index, so positions are solved in index order.
+void bot_init() {
+	int base[5] = {0, 1, 2, 8, 48}; // index weight of each row
+	int size[5] = {0, 2, 4, 6, 8}; // counts each row can hold
+	int s, row, count, left, next;
+	if (bot_ready) return;
+	bot_wins[0] = 1; // the opponent took the last stone
+	for (s = 1; s < NIM_BOT_STATES; s++) {
+		int big = 0, big_count = 0;
+		bot_wins[s] = 0;
+		for (row = 1; row <= NIM_ROWS; row++) {
+			count = s / base[row] % size[row];
+			if (count > big_count) { big = row; big_count = count; }
+			for (left = 0; left < count && !bot_wins[s]; left++) {
+				next = s - (count - left) * base[row];
+				if (bot_wins[next]) continue;
+				bot_wins[s] = 1;
+				bot_table[s] = row << 4 | (left + 1);
+			}
+		}
+		// lost against best play, take one stone and hope for a mistake
+		if (!bot_wins[s]) bot_table[s] = big << 4 | big_count;
+	}
+	bot_ready = 1;
+}
+
+// Choose the bot's move on a board with stones left.
+void bot_move(struct nim_heaps *p, struct nim_variant *v, int *row, int *col) {
+	if (bot_random > 0 && rand() % 100 < bot_random) {
+		do { *row = 1 + rand() % v->rows; } while (p->h[*row - 1] == 0);
+		*col = 1 + rand() % p->h[*row - 1];
+		return;
+	}
+	if (v != &nim_variants[0]) {
+		eval_move(p, v, row, col);
+		return;
+	}
+	bot_init();
+	*row = bot_table[bot_index(p)] >> 4;
+	*col = bot_table[bot_index(p)] & 0xF;
+}
+
+#endif
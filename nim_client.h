@@ -0,0 +1,308 @@
+// CS415 Project #4: nim_client.h (client sessions)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Protocol v2 client as a state object per session, so one process can
+// play any number of games at once from a single epoll loop. A session
+// connects without blocking, sends HELLO and JOIN together, and then
+// follows the server's frames, keeping the board as row counts whatever
+// the variant. When it is the session's turn the client's strategy is
+// asked for a move; a strategy that cannot answer at once, such as one
+// waiting on input, answers later with session_move(). Each step of the
+// session is reported to the client's hook, which is where the caller
+// counts, times, prints or reconnects. The host dispatches readiness on a
+// session's source, kind SRC_PLAYER, to session_event(), and must not
+// reconnect a session while events for its old socket may still be
+// pending in the same batch. Given a cluster, a session connects to the
+// node owning its handle, follows a REDIRECT to another node and tries the
+// next node listed if the one it chose is down.
+
+#ifndef NIM_CLIENT_H
+#define NIM_CLIENT_H
+
+// Session states.
+enum {
+	SESSION_CONNECTING, // connect() in progress
+	SESSION_JOINING, // HELLO and JOIN sent, awaiting WELCOME
+	SESSION_QUEUED, // awaiting START
+	SESSION_PLAYING,
+	SESSION_CLOSED // game over, rejected or failed
+};
+
+// What a hook is told about.
+enum {
+	SESSION_WELCOME, // accepted by the lobby
+	SESSION_START, // paired; seat and handles are set
+	SESSION_TURN, // a board arrived; status holds its status
+	SESSION_END, // game over; status holds 'W' or 'L'
+	SESSION_REJECT, // turned away; reason holds why
+	SESSION_FAILED, // connection failed or the server broke protocol
+	SESSION_REDIRECT // sent to another node; node holds which
+};
+
+struct nim_session;
+
+// Settings and callbacks shared by a client's sessions.
+struct nim_client {
+	int epfd;
+	struct sockaddr_in addr; // server play port
+	struct nim_cluster *cluster; // nodes to pick from by handle, NULL for addr
+	char password[20];
+	char variant[20]; // variant asked for, empty for the server's default
+	int (*move)(struct nim_session *s, int *row, int *col);
+		// strategy: 1 with a move, or 0 to answer later
+	void (*hook)(struct nim_session *s, int what); // may be NULL
+	int active; // sessions not closed
+};
+
+// One session: a connection to the lobby and then one game.
+struct nim_session {
+	struct nim_source src; // kind SRC_PLAYER, SRC_DEAD once closed
+	struct nim_client *client;
+	int id; // the caller's
+	void *user; // the caller's
+	int state;
+	int node; // cluster node connected to, -1 for the client's addr
+	int redirects; // followed this session
+	char handle[20];
+	char player1[20], player2[20];
+	int seat; // 1 or 2 once started
+	int turn; // turn of the last board
+	int status; // status of the last board
+	int reason; // REJECT reason
+	int boards; // boards received this game
+	int moves; // moves made this game
+	int moved; // a MOVE awaits the board answering it
+	struct nim_variant variant; // rows of the board being played
+	struct nim_heaps heaps; // the board
+	long long t_connect, t_welcome, t_start, t_turn, t_move; // microseconds
+	struct nim_inbuf in;
+	struct nim_outbuf out;
+};
+
+int session_dial(struct nim_session *s);
+void session_close(struct nim_session *s, int what);
+void session_send(struct nim_session *s, void *buffer, int size);
+int session_frame(struct nim_session *s, int type, struct nim_cursor *c);
+int session_redirect(struct nim_session *s, int node);
+void session_turn(struct nim_session *s, struct nim_cursor *c);
+int session_move(struct nim_session *s, int row, int col);
+
+// Set up a client for the server's play port.
+void client_init(struct nim_client *client, int epfd, struct sockaddr_in *addr) {
+	memset(client, 0, sizeof(struct nim_client));
+	client->epfd = epfd;
+	client->addr = *addr;
+}
+
+// Tell the caller's hook about a step of a session.
+void session_report(struct nim_session *s, int what) {
+	if (s->client->hook != NULL) s->client->hook(s, what);
+}
+
+// Start a session's connection, with HELLO and JOIN queued to go out as
+// soon as it completes. Returns -1, having reported the failure, if it
+// could not be started.
+int session_connect(struct nim_client *client, struct nim_session *s, char *handle) {
+	s->client = client;
+	if (handle != s->handle) snprintf(s->handle, 20, "%s", handle);
+	s->node = client->cluster ? cluster_owner(client->cluster, s->handle, 0) : -1;
+	s->redirects = 0;
+	client->active += 1;
+	return session_dial(s);
+}
+
+// Connect a session to its node or the client's address.
+int session_dial(struct nim_session *s) {
+	struct nim_client *client = s->client;
+	struct sockaddr_in *addr = s->node >= 0 ? &client->cluster->node[s->node].addr : &client->addr;
+	struct nim_frame f;
+	unsigned char request[64];
+	int size;
+	s->state = SESSION_CONNECTING;
+	s->seat = s->turn = s->status = s->reason = 0;
+	s->boards = s->moves = s->moved = 0;
+	s->in.len = s->in.off = 0;
+	s->out.len = s->out.off = 0;
+	s->src.kind = SRC_PLAYER;
+	s->t_connect = now_us();
+	if ( (s->src.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ) {
+		s->src.kind = SRC_DEAD; // nothing to close
+		client->active -= 1;
+		s->state = SESSION_CLOSED;
+		session_report(s, SESSION_FAILED);
+		return -1;
+	}
+	set_nonblock(s->src.fd, 1);
+	set_nodelay(s->src.fd);
+	if ( (connect(s->src.fd, (struct sockaddr *) addr,
+			sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS)
+			|| ev_add(client->epfd, &s->src, EPOLLIN | EPOLLOUT) < 0 ) {
+		session_close(s, SESSION_FAILED);
+		return -1;
+	}
+	frame_begin(&f, request, sizeof(request), FRAME_HELLO);
+	frame_u8(&f, NIM_VERSION);
+	frame_str(&f, client->password);
+	size = frame_end(&f);
+	frame_begin(&f, request + size, sizeof(request) - size, FRAME_JOIN);
+	frame_str(&f, s->handle);
+	if (client->variant[0] != '\0') frame_str(&f, client->variant);
+	size += frame_end(&f);
+	nb_queue(&s->out, request, size);
+	return 0;
+}
+
+// Handle readiness on a session's socket.
+void session_event(struct nim_session *s, unsigned events) {
+	struct nim_cursor c;
+	int type, err = 0;
+	socklen_t len = sizeof(err);
+	if (s->src.kind == SRC_DEAD) return;
+	if (s->state == SESSION_CONNECTING) {
+		if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+		getsockopt(s->src.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0 && s->node >= 0 // a node down: try the next, which knows
+				&& session_redirect(s, (s->node + 1) % s->client->cluster->n) == 0)
+			return;
+		if (err != 0) { session_close(s, SESSION_FAILED); return; }
+		s->state = SESSION_JOINING;
+	}
+	if (events & EPOLLOUT) session_send(s, NULL, 0);
+	if (s->src.kind == SRC_DEAD || !(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
+	if (frame_read(s->src.fd, &s->in) < 0) { session_close(s, SESSION_FAILED); return; }
+	while ( (type = frame_next(&s->in, &c)) != 0 ) {
+		if (type < 0 || session_frame(s, type, &c) < 0) {
+			if (s->src.kind != SRC_DEAD) session_close(s, SESSION_FAILED);
+			return;
+		}
+		if (s->src.kind == SRC_DEAD) return; // game over
+		if (s->state == SESSION_CONNECTING) return; // redirected
+	}
+}
+
+// Act on one frame. Returns -1 if it was unexpected or malformed.
+int session_frame(struct nim_session *s, int type, struct nim_cursor *c) {
+	switch (type) {
+	case FRAME_WELCOME:
+		if (s->state != SESSION_JOINING) return -1;
+		s->t_welcome = now_us();
+		s->state = SESSION_QUEUED;
+		session_report(s, SESSION_WELCOME);
+		return 0;
+	case FRAME_REJECT:
+		s->reason = get_u8(c);
+		session_close(s, SESSION_REJECT);
+		return 0;
+	case FRAME_START:
+		if (s->state != SESSION_QUEUED) return -1;
+		s->t_start = now_us();
+		s->state = SESSION_PLAYING;
+		s->seat = get_u8(c);
+		get_str(c, s->player1);
+		get_str(c, s->player2);
+		get_str(c, s->variant.name);
+		s->variant.misere = get_u8(c);
+		if (c->bad) return -1;
+		session_report(s, SESSION_START);
+		return 0;
+	case FRAME_TURN:
+		if (s->state != SESSION_PLAYING) return -1;
+		session_turn(s, c);
+		return c->bad ? -1 : 0;
+	case FRAME_REDIRECT:
+		if (s->state != SESSION_QUEUED) return -1;
+		return session_redirect(s, get_u8(c));
+	default:
+		return -1;
+	}
+}
+
+// Reconnect to the node a server sent us to, or the next one on from a
+// node that could not be reached. Returns -1 if there is no such node or
+// the session has been sent on too often already.
+int session_redirect(struct nim_session *s, int node) {
+	struct nim_cluster *cl = s->client->cluster;
+	if (cl == NULL || node >= cl->n || s->redirects == NIM_REDIRECT_MAX) return -1;
+	s->redirects += 1;
+	s->node = node;
+	close(s->src.fd);
+	session_report(s, SESSION_REDIRECT);
+	session_dial(s);
+	return 0;
+}
+
+// Take in a board; end the game, or ask the strategy for a move if it is
+// this session's turn.
+void session_turn(struct nim_session *s, struct nim_cursor *c) {
+	struct nim_variant *v = &s->variant;
+	struct nim_packed_board packed;
+	int row, col;
+	s->turn = get_u16(c);
+	frame_get(c, &packed, sizeof(packed));
+	nim_bits b = board_unpack(&packed);
+	s->status = get_u8(c);
+	memset(&s->heaps, 0, sizeof(struct nim_heaps));
+	if (c->left > 0) { // a variant board, as row counts
+		v->rows = get_u8(c);
+		if (v->rows > NIM_MAX_ROWS) { c->bad = 1; return; }
+		frame_get(c, s->heaps.h, v->rows);
+	} else { // the classic board
+		*v = nim_variants[0];
+		for (row = 1; row <= NIM_ROWS; row++)
+			s->heaps.h[row - 1] = board_stones(b, row);
+	}
+	if (c->bad) return;
+	s->t_turn = now_us();
+	s->boards += 1;
+	session_report(s, SESSION_TURN);
+	s->moved = 0;
+	if (s->status == 'W' || s->status == 'L') {
+		session_close(s, SESSION_END);
+		return;
+	}
+	if (s->status == 'A' && s->client->move(s, &row, &col))
+		session_move(s, row, col);
+}
+
+// Send a move for the current turn. Returns -1 if it is not this
+// session's move.
+int session_move(struct nim_session *s, int row, int col) {
+	struct nim_frame f;
+	unsigned char move[16];
+	if (s->src.kind == SRC_DEAD || s->status != 'A' || s->moved) return -1;
+	frame_begin(&f, move, sizeof(move), FRAME_MOVE);
+	frame_u16(&f, s->turn);
+	frame_u8(&f, row);
+	frame_u8(&f, col);
+	s->t_move = now_us();
+	s->moved = 1;
+	s->moves += 1;
+	session_send(s, move, frame_end(&f));
+	return 0;
+}
+
+// Queue output, if any, and write what the socket takes.
+void session_send(struct nim_session *s, void *buffer, int size) {
+	int status;
+	if (size > 0 && nb_queue(&s->out, buffer, size) < 0) {
+		session_close(s, SESSION_FAILED);
+		return;
+	}
+	if ( (status = nb_flush(s->src.fd, &s->out)) < 0 ) {
+		session_close(s, SESSION_FAILED);
+		return;
+	}
+	ev_mod(s->client->epfd, &s->src, status ? EPOLLIN : EPOLLIN | EPOLLOUT);
+}
+
+// Close a session, reporting why.
+void session_close(struct nim_session *s, int what) {
+	if (s->src.kind == SRC_DEAD) return;
+	close(s->src.fd);
+	s->src.kind = SRC_DEAD;
+	s->state = SESSION_CLOSED;
+	s->client->active -= 1;
+	session_report(s, what);
+}
+
+#endif
@@ -0,0 +1,272 @@
+// CS415 Project #4: nim_cluster.h (lobby federation)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Several nim_servers, each a node of one lobby. The nodes are listed one
+// per line in the format of nim.conf, host:query_port:play_port, and every
+// node and client reads the same list. A handle belongs to the node that
+// owns it on a consistent hash ring, each node taking NIM_RING_POINTS
+// points, so adding or losing a node moves only its own share of handles;
+// clients connect to a handle's node to begin with, and a node redirects a
+// player it does not own. Nodes learn about each other by gossip over UDP
+// on their play port numbers: every round a node bumps its own heartbeat
+// and tells a few others at random everything it has heard that is still
+// fresh, its own lobby summary included, and each keeps the newest news of
+// every node. A node not heard of for NIM_GOSSIP_EXPIRE is taken to be
+// down, and its handles fall to the next node round the ring. Queries are
+// answered from this cache, without asking any other node.
+
+#ifndef NIM_CLUSTER_H
+#define NIM_CLUSTER_H
+
+#define NIM_MAX_NODES 16
+#define NIM_RING_POINTS 64 // points on the hash ring per node
+#define NIM_GOSSIP_INTERVAL 200 // ms between gossip rounds
+#define NIM_GOSSIP_FANOUT 2 // nodes told each round
+#define NIM_GOSSIP_EXPIRE 2000 // ms a node is live after its news last changed
+#define NIM_GOSSIP_MAX (NIM_FRAME_HEAD + 128 + LINE_MAX) // longest datagram
+#define NIM_REDIRECT_MAX 3 // redirects a client follows before giving up
+
+// One node: where it is, and the latest news of it.
+struct nim_node {
+	char host[HOST_NAME_MAX];
+	char query_port[NI_MAXSERV], play_port[NI_MAXSERV];
+	struct sockaddr_in addr; // play port, TCP for players, UDP for gossip
+	long long epoch; // start time in ms of the process the news is from
+	unsigned seq; // its heartbeat
+	long long heard; // ms the news last changed, 0 if the node is down
+	int inprog; // games in progress
+	int load; // players queued and games in progress
+	char waiting[20]; // player waiting longest, empty if none
+	char lone[20]; // lone player waiting for the default board, empty if none
+	char games[LINE_MAX]; // "player1:player2:" for each game
+};
+
+// Hash ring point.
+struct nim_point {
+	unsigned hash;
+	int node;
+};
+
+// The nodes, from a client's or one node's point of view.
+struct nim_cluster {
+	int n;
+	int self; // our node, -1 in a client
+	struct nim_node node[NIM_MAX_NODES];
+	struct nim_point ring[NIM_MAX_NODES * NIM_RING_POINTS]; // in hash order
+	unsigned version; // bumped whenever news changes or a node goes down
+};
+
+// FNV-1a with a final mix, so that similar names spread round the ring.
+unsigned ring_hash(char *s) {
+	unsigned h = 2166136261u;
+	for ( ; *s != '\0'; s++) h = (h ^ (unsigned char) *s) * 16777619u;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	return h ^ (h >> 16);
+}
+
+int ring_cmp(const void *a, const void *b) {
+	unsigned x = ((struct nim_point *) a)->hash, y = ((struct nim_point *) b)->hash;
+	return x < y ? -1 : x > y;
+}
+
+// Add a node at the end of the list. Returns its index, or -1 if the list
+// is full or the address does not resolve.
+int cluster_add(struct nim_cluster *cl, char *host, char *query_port, char *play_port) {
+	struct addrinfo hints, *addrlist;
+	struct nim_node *node;
+	if (cl->n == NIM_MAX_NODES) return -1;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if (getaddrinfo(host, play_port, &hints, &addrlist) != 0) return -1;
+	node = &cl->node[cl->n];
+	memset(node, 0, sizeof(struct nim_node));
+	memcpy(&node->addr, addrlist->ai_addr, sizeof(struct sockaddr_in));
+	freeaddrinfo(addrlist);
+	snprintf(node->host, sizeof(node->host), "%s", host);
+	snprintf(node->query_port, sizeof(node->query_port), "%s", query_port);
+	snprintf(node->play_port, sizeof(node->play_port), "%s", play_port);
+	return cl->n++;
+}
+
+// Place every node's points on the ring, once the list is complete.
+void cluster_ring(struct nim_cluster *cl) {
+	char name[HOST_NAME_MAX + NI_MAXSERV + 16];
+	int i, k, n = 0;
+	for (i = 0; i < cl->n; i++) {
+		for (k = 0; k < NIM_RING_POINTS; k++, n++) {
+			snprintf(name, sizeof(name), "%s:%s#%d", cl->node[i].host,
+					cl->node[i].play_port, k);
+			cl->ring[n].hash = ring_hash(name);
+			cl->ring[n].node = i;
+		}
+	}
+	qsort(cl->ring, n, sizeof(struct nim_point), ring_cmp);
+}
+
+// Read the node list from a file in nim.conf's format. Returns the number
+// of nodes, or -1 if the file cannot be read or a node does not resolve.
+int cluster_load(struct nim_cluster *cl, char *path) {
+	FILE *file;
+	char line[LINE_MAX];
+	int ret = 0;
+	memset(cl, 0, sizeof(struct nim_cluster));
+	cl->self = -1;
+	if ( (file = fopen(path, "r")) == NULL ) return -1;
+	while (fgets(line, LINE_MAX, file) != NULL) {
+		char *host = strtok(line, ":"), *query = strtok(NULL, ":"),
+				*play = strtok(NULL, ":\n");
+		if (host == NULL || query == NULL || play == NULL) continue;
+		if (cluster_add(cl, host, query, play) < 0) ret = -1;
+	}
+	fclose(file);
+	cluster_ring(cl);
+	return ret < 0 ? -1 : cl->n;
+}
+
+// Become node i, our news dated by the wall clock so that it outranks any
+// from an earlier run of the node.
+void cluster_join(struct nim_cluster *cl, int i) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	cl->self = i;
+	cl->node[i].epoch = (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Whether a node is up as far as we know: ourselves always, any other node
+// while its news is fresh. A client, knowing nothing, takes every node to
+// be up.
+int cluster_live(struct nim_cluster *cl, int i, long long now) {
+	if (cl->self < 0 || i == cl->self) return 1;
+	return cl->node[i].heard > 0 && now - cl->node[i].heard < NIM_GOSSIP_EXPIRE;
+}
+
+// The live node owning a handle: the first clockwise from its hash.
+int cluster_owner(struct nim_cluster *cl, char *handle, long long now) {
+	int npoints = cl->n * NIM_RING_POINTS, low = 0, high = npoints, k;
+	unsigned h = ring_hash(handle);
+	if (cl->n <= 1) return 0;
+	while (low < high) { // first point at or past the hash
+		int mid = (low + high) / 2;
+		if (cl->ring[mid].hash < h) low = mid + 1;
+		else high = mid;
+	}
+	for (k = 0; k < npoints; k++) {
+		struct nim_point *p = &cl->ring[(low + k) % npoints];
+		if (cluster_live(cl, p->node, now)) return p->node;
+	}
+	return cl->self;
+}
+
+// Set our own news for the next round, bumping our heartbeat.
+void cluster_publish(struct nim_cluster *cl, int inprog, int load, char *waiting,
+		char *lone, char *games, long long now) {
+	struct nim_node *self = &cl->node[cl->self];
+	char *in, *out;
+	self->seq += 1;
+	self->heard = now;
+	self->inprog = inprog;
+	self->load = load;
+	snprintf(self->waiting, 20, "%s", waiting);
+	snprintf(self->lone, 20, "%s", lone);
+	// runs of colons left by finished games need not travel
+	for (in = games, out = self->games; *in != '\0' && out < self->games + LINE_MAX - 1; in++)
+		if (*in != ':' || (out > self->games && out[-1] != ':')) *out++ = *in;
+	*out = '\0';
+}
+
+// Write the news of a node as a GOSSIP datagram. Returns its size.
+int gossip_encode(struct nim_cluster *cl, int i, char *password, unsigned char *buf) {
+	struct nim_node *node = &cl->node[i];
+	struct nim_frame f;
+	int len = strlen(node->games);
+	frame_begin(&f, buf, NIM_GOSSIP_MAX, FRAME_GOSSIP);
+	frame_str(&f, password);
+	frame_u8(&f, i);
+	frame_u32(&f, node->epoch >> 32);
+	frame_u32(&f, node->epoch & 0xFFFFFFFF);
+	frame_u32(&f, node->seq);
+	frame_u32(&f, node->inprog);
+	frame_u32(&f, node->load);
+	frame_str(&f, node->waiting);
+	frame_str(&f, node->lone);
+	frame_u16(&f, len);
+	frame_put(&f, node->games, len);
+	return frame_end(&f);
+}
+
+// Take in a GOSSIP datagram's payload, keeping it if it is newer than what
+// we have heard of its node. Returns 1 if it was.
+int gossip_merge(struct nim_cluster *cl, struct nim_cursor *c, char *password, long long now) {
+	struct nim_node *node, news;
+	char pass[20];
+	int i, len;
+	get_str(c, pass);
+	i = get_u8(c);
+	news.epoch = (long long) get_u32(c) << 32;
+	news.epoch |= get_u32(c);
+	news.seq = get_u32(c);
+	news.inprog = get_u32(c);
+	news.load = get_u32(c);
+	get_str(c, news.waiting);
+	get_str(c, news.lone);
+	if ( (len = get_u16(c)) >= LINE_MAX ) c->bad = 1;
+	frame_get(c, news.games, c->bad ? 0 : len);
+	if (c->bad || strcmp(pass, password) || i >= cl->n || i == cl->self) return 0;
+	news.games[len] = '\0';
+	node = &cl->node[i];
+	if (news.epoch < node->epoch || (news.epoch == node->epoch && news.seq <= node->seq))
+		return 0;
+	node->epoch = news.epoch;
+	node->seq = news.seq;
+	node->heard = now;
+	node->inprog = news.inprog;
+	node->load = news.load;
+	memcpy(node->waiting, news.waiting, 20);
+	memcpy(node->lone, news.lone, 20);
+	memcpy(node->games, news.games, len + 1);
+	cl->version += 1;
+	return 1;
+}
+
+// Mark nodes whose news has gone stale as down. Older news of them is
+// ignored from then on, so only a live node's heartbeat revives them.
+void cluster_expire(struct nim_cluster *cl, long long now) {
+	int i;
+	for (i = 0; i < cl->n; i++) {
+		if (i == cl->self || cl->node[i].heard == 0) continue;
+		if (now - cl->node[i].heard < NIM_GOSSIP_EXPIRE) continue;
+		cl->node[i].heard = 0;
+		cl->version += 1;
+	}
+}
+
+// Find another live node listing a game the player is in, -1 if none.
+int cluster_find(struct nim_cluster *cl, char *handle, long long now) {
+	char games[LINE_MAX], *name, *save;
+	int i;
+	for (i = 0; i < cl->n; i++) {
+		if (i == cl->self || !cluster_live(cl, i, now)) continue;
+		memcpy(games, cl->node[i].games, LINE_MAX);
+		for (name = strtok_r(games, ":", &save); name != NULL;
+				name = strtok_r(NULL, ":", &save))
+			if (strcmp(name, handle) == 0) return i;
+	}
+	return -1;
+}
+
+// The node a lone waiting player of ours should be relayed to: the lowest
+// live node below us with a lone player of its own, so that two nodes never
+// relay to each other at once. -1 if there is none.
+int cluster_partner(struct nim_cluster *cl, long long now) {
+	int i;
+	for (i = 0; i < cl->self; i++)
+		if (cl->node[i].lone[0] != '\0' && cluster_live(cl, i, now)) return i;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,171 @@
+// CS415 Project #4: nim_event.h (event loop helpers)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Non-blocking socket plumbing for the epoll driven servers. Every descriptor
+// registered with epoll carries a pointer to a struct beginning with a
+// nim_source, so the loop can dispatch on its kind.
+
+#ifndef NIM_EVENT_H
+#define NIM_EVENT_H
+
+#include "nim_alloc.h"
+
+#define NIM_MAX_EVENTS 64 // events handled per epoll_wait
+#define NIM_OUTBUF 256 // pending output per connection
+
+// Event source kinds.
+enum {
+	SRC_QUERY, // lobby query socket
+	SRC_PLAY, // lobby play socket
+	SRC_CONN, // client completing its lobby handshake
+	SRC_PLAYER, // player socket owned by a match
+	SRC_MAILBOX, // players handed over by another shard
+	SRC_WORKER, // lobby end of a match worker's control socket
+	SRC_CONTROL, // match worker end of its control socket
+	SRC_SIGNAL, // signalfd
+	SRC_WATCHER, // spectator socket owned by a match
+	SRC_CHILD, // pidfd of a process taken over in a hot restart
+	SRC_GOSSIP, // datagram socket other nodes gossip to
+	SRC_RELAY, // either end of a player relayed to another node
+	SRC_UPGRADE, // hot restart socket to the new server, until it is ready
+	SRC_DEAD // retired, ignore any remaining events
+};
+
+// Tagged event source.
+struct nim_source {
+	int kind;
+	int fd;
+};
+
+// Pending output for a non-blocking socket.
+struct nim_outbuf {
+	int len; // bytes queued
+	int off; // bytes already written
+	char data[NIM_OUTBUF];
+};
+
+// Writes issued by nb_flush(), for the hosts' statistics.
+long long ev_writes;
+
+// Objects retired while handling a batch of events, freed after the batch
+// since later events in the same batch may still point at them.
+struct nim_retired {
+	struct nim_slab *slab; // NULL if from malloc
+	void *obj;
+} *ev_retired;
+int ev_nretired, ev_maxretired;
+
+// Retire an object taken from a slab, or from malloc if slab is NULL; the
+// caller marks its sources SRC_DEAD first.
+void ev_retire(struct nim_slab *slab, void *obj) {
+	if (ev_nretired == ev_maxretired) {
+		ev_maxretired = ev_maxretired ? 2 * ev_maxretired : NIM_MAX_EVENTS;
+		ev_retired = realloc(ev_retired, ev_maxretired * sizeof(struct nim_retired));
+	}
+	ev_retired[ev_nretired].slab = slab;
+	ev_retired[ev_nretired++].obj = obj;
+}
+
+// Free everything retired during the last batch.
+void ev_reap() {
+	struct nim_retired *r;
+	while (ev_nretired > 0) {
+		r = &ev_retired[--ev_nretired];
+		if (r->slab != NULL) slab_free(r->slab, r->obj);
+		else free(r->obj);
+	}
+}
+
+// Monotonic clock in milliseconds.
+long long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Monotonic clock in microseconds.
+long long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Set or clear O_NONBLOCK on a descriptor.
+int set_nonblock(int fd, int on) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) return -1;
+	flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	return fcntl(fd, F_SETFL, flags);
+}
+
+// Disable Nagle's algorithm on a TCP socket, so each message queued as a
+// whole goes out at once instead of waiting on the previous one's ack.
+int set_nodelay(int fd) {
+	int on = 1;
+	return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// Register, modify or remove an event source.
+int ev_add(int epfd, struct nim_source *src, unsigned events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = src;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ev);
+}
+int ev_mod(int epfd, struct nim_source *src, unsigned events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = src;
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, src->fd, &ev);
+}
+int ev_del(int epfd, struct nim_source *src) {
+	return epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, NULL);
+}
+
+// Append a message to an output buffer, -1 if it does not fit.
+int nb_queue(struct nim_outbuf *out, void *buffer, int size) {
+	if (out->off > 0 && out->off == out->len) out->off = out->len = 0;
+	if (out->len + size > NIM_OUTBUF) return -1;
+	memcpy(out->data + out->len, buffer, size);
+	out->len += size;
+	return 0;
+}
+
+// Write as much pending output as the socket takes.
+// Returns 1 when drained, 0 when output remains, -1 on error.
+int nb_flush(int sock, struct nim_outbuf *out) {
+	int num;
+	while (out->off < out->len) {
+		num = write(sock, out->data + out->off, out->len - out->off);
+		ev_writes += 1;
+		if (num < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		out->off += num;
+	}
+	out->off = out->len = 0;
+	return 1;
+}
+
+// Read toward a fixed-size message, keeping count in *have.
+// Returns 1 when complete, 0 when more is needed, -1 on error or EOF.
+int nb_fill(int sock, void *buffer, int *have, int size) {
+	int num;
+	while (*have < size) {
+		num = read(sock, (char *) buffer + *have, size - *have);
+		if (num == 0) return -1; // peer closed
+		if (num < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		*have += num;
+	}
+	return 1;
+}
+
+#endif
@@ -0,0 +1,384 @@
+// CS415 Project #4: nim_loadgen.c (load generator)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Compile: gcc -o nim_loadgen nim_loadgen.c (use Makefile!)
+// Invoke: $ nim_loadgen {-c players} {-g games} {-d seconds} {-q rate}
+//           {-m script|bot} {-p password} {-v variant}
+//   -c  players connected at once (default 100); a player whose game ends
+//       reconnects and plays again
+//   -g  stop once this many games have ended, 0 for no limit (default 0)
+//   -d  stop after this many seconds (default 10)
+//   -q  lobby queries sent per second, 0 for none (default 0)
+//   -m  script: take one stone at a time from the first row left, so every
+//       game runs its full length; bot: play the bot's moves (default script)
+//   -p  server password
+//   -v  board variant to ask for, by name
+// Plays protocol v2 against the ports in nim.conf, all players driven from
+// one epoll loop as nim_client.h sessions, then reports throughput and
+// latency percentiles. Against a cluster each player connects to the node
+// owning its handle and queries go to the last node listed:
+//   connect  connect() to WELCOME, the lobby taking the player's handle
+//   pair     WELCOME to START, time spent waiting for an opponent
+//   board    START to the first TURN
+//   move     MOVE to the TURN answering it, a move's round trip
+//   query    QUERY to LOBBY; replies carry no id, so each query socket has
+//            one query out at a time, and a query is given up as lost after
+//            a second; a reply too long to take is counted as truncated
+
+// Exit Codes:
+// <0> Successful termination
+// <1> Argument error
+// <2> Problem locating server address file
+// <3> Problem resolving server address
+// <4> Problem with epoll or the query socket
+
+#include "nim.h"
+#include "nim_event.h"
+#include "nim_board.h"
+#include "nim_proto.h"
+#include "nim_variant.h"
+#include "nim_eval.h"
+#include "nim_bot.h"
+#include "nim_cluster.h"
+#include "nim_client.h"
+
+#define LG_QUERY_SOCKS 64 // query sockets, each with one query out at a time
+#define LG_QUERY_LOST 1000000 // microseconds before a query is given up
+
+// Query socket.
+struct lg_query {
+	struct nim_source src;
+	long long sent; // send time of the query out, 0 if none
+};
+
+// Latency samples in microseconds.
+struct lg_samples {
+	long long *v;
+	int n, max;
+};
+
+// Global variables and function prototypes.
+int players = 100;
+long long games = 0; // games to play, 0 for no limit
+int seconds = 10;
+int query_rate = 0;
+int bot_mode = 0;
+char password[20];
+char variant_name[20];
+char hostname[HOST_NAME_MAX];
+char query_port[NI_MAXSERV], play_port[NI_MAXSERV];
+struct sockaddr_in play_addr, query_addr;
+int epfd;
+struct lg_query query[LG_QUERY_SOCKS];
+int query_next; // socket to try first
+struct nim_client client;
+struct nim_cluster cluster; // every server in nim.conf
+struct nim_session *player;
+struct nim_session **restarts; // players to reconnect after the batch
+int nrestarts;
+int stopping;
+long long results, wins, moves, rejects, failures, redirects;
+long long queries, replies, lost, skipped, truncated;
+struct lg_samples s_connect, s_pair, s_board, s_move, s_query;
+
+void get_config(), resolve(char *port, int type, struct sockaddr_in *addr);
+void raise_fd_limit();
+void lg_connect(struct nim_session *p);
+int lg_move(struct nim_session *p, int *row, int *col);
+void lg_hook(struct nim_session *p, int what);
+void send_queries(long long now, long long *next, long long interval);
+void recv_replies(struct lg_query *q);
+void record(struct lg_samples *s, long long us);
+void report(double elapsed);
+void report_samples(char *name, struct lg_samples *s);
+void error(int code);
+
+int main(int argc, char *argv[]) { /////////////////////////////////////////////
+
+	// Process input arguments.
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (argv[i + 1] == NULL) error(1); // every option takes a value
+		if (strcmp(argv[i], "-c") == 0) {
+			if ( (players = atoi(argv[++i])) < 1 ) error(1);
+		} else if (strcmp(argv[i], "-g") == 0) {
+			if ( (games = atoll(argv[++i])) < 0 ) error(1);
+		} else if (strcmp(argv[i], "-d") == 0) {
+			if ( (seconds = atoi(argv[++i])) < 1 ) error(1);
+		} else if (strcmp(argv[i], "-q") == 0) {
+			if ( (query_rate = atoi(argv[++i])) < 0 ) error(1);
+		} else if (strcmp(argv[i], "-m") == 0) {
+			i += 1;
+			if (strcmp(argv[i], "bot") == 0) bot_mode = 1;
+			else if (strcmp(argv[i], "script") != 0) error(1);
+		} else if (strcmp(argv[i], "-p") == 0) {
+			snprintf(password, 20, "%s", argv[++i]);
+		} else if (strcmp(argv[i], "-v") == 0) {
+			snprintf(variant_name, 20, "%s", argv[++i]);
+		} else error(1);
+	}
+
+	// Get server information from config file.
+	get_config();
+	resolve(play_port, SOCK_STREAM, &play_addr);
+	resolve(query_port, SOCK_DGRAM, &query_addr);
+	raise_fd_limit();
+	signal(SIGPIPE, SIG_IGN);
+
+	if ( (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) error(4);
+	client_init(&client, epfd, &play_addr);
+	memcpy(client.password, password, 20);
+	memcpy(client.variant, variant_name, 20);
+	client.move = lg_move;
+	client.hook = lg_hook;
+	if (cluster_load(&cluster, "nim.conf") > 1) client.cluster = &cluster;
+	if (query_rate > 0) {
+		for (i = 0; i < LG_QUERY_SOCKS; i++) {
+			if ( (query[i].src.fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) error(4);
+			set_nonblock(query[i].src.fd, 1);
+			query[i].src.kind = SRC_QUERY;
+			if (ev_add(epfd, &query[i].src, EPOLLIN) < 0) error(4);
+		}
+	}
+	player = calloc(players, sizeof(struct nim_session));
+	restarts = malloc(players * sizeof(struct nim_session *));
+	for (i = 0; i < players; i++) {
+		player[i].id = i;
+		lg_connect(&player[i]);
+	}
+
+	// Run until the time or game limit is reached, or every player is idle.
+	struct epoll_event events[NIM_MAX_EVENTS];
+	long long start = now_us(), deadline = start + seconds * 1000000LL;
+	long long interval = query_rate > 0 ? 1000000LL / query_rate : 0;
+	long long next_query = start, now;
+	int n, timeout;
+	while (!stopping && client.active > 0) {
+		now = now_us();
+		timeout = (deadline - now) / 1000;
+		if (query_rate > 0 && (next_query - now) / 1000 < timeout)
+			timeout = (next_query - now) / 1000;
+		if ( (n = epoll_wait(epfd, events, NIM_MAX_EVENTS, timeout < 0 ? 0 : timeout)) < 0 ) {
+			if (errno == EINTR) continue;
+			error(4);
+		}
+		for (i = 0; i < n; i++) {
+			struct nim_source *src = events[i].data.ptr;
+			if (src->kind == SRC_QUERY) recv_replies((struct lg_query *) src);
+			else session_event((struct nim_session *) src, events[i].events);
+		}
+		now = now_us();
+		if (now >= deadline || (games > 0 && results >= games)) stopping = 1;
+		while (nrestarts > 0) {
+			struct nim_session *p = restarts[--nrestarts];
+			if (!stopping) lg_connect(p);
+		}
+		if (query_rate > 0 && !stopping) send_queries(now, &next_query, interval);
+	}
+	report((now_us() - start) / 1e6);
+
+	exit(0);
+
+} // end main //////////////////////////////////////////////////////////////////
+
+// Get server address information from config file.
+void get_config() {
+	FILE *config;
+	char line[LINE_MAX];
+	if ( (config = fopen("nim.conf", "r")) == NULL ) error(2);
+	while (fgets(line, LINE_MAX, config) != NULL) {
+		char *host = strtok(line, ":"), *query = strtok(NULL, ":"),
+				*play = strtok(NULL, ":\n");
+		if (host == NULL || query == NULL || play == NULL) continue;
+		snprintf(hostname, sizeof(hostname), "%s", host);
+		snprintf(query_port, sizeof(query_port), "%s", query);
+		snprintf(play_port, sizeof(play_port), "%s", play);
+	}
+	fclose(config);
+}
+
+// Look up one of the server's ports.
+void resolve(char *port, int type, struct sockaddr_in *addr) {
+	struct addrinfo hints, *addrlist;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = type;
+	hints.ai_flags = AI_NUMERICSERV;
+	if (getaddrinfo(hostname, port, &hints, &addrlist) != 0) error(3);
+	memcpy(addr, addrlist->ai_addr, sizeof(struct sockaddr_in));
+	freeaddrinfo(addrlist);
+}
+
+// Allow as many descriptors as the hard limit, one per player plus the
+// query sockets.
+void raise_fd_limit() {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) return;
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur != RLIM_INFINITY && players + LG_QUERY_SOCKS + 8 > rl.rlim_cur)
+		fprintf(stderr, "nim_loadgen: %d players exceed the descriptor limit %ld\n",
+				players, (long) rl.rlim_cur);
+}
+
+// Start a player's connection.
+void lg_connect(struct nim_session *p) {
+	char handle[20];
+	snprintf(handle, 20, "lg%d_%d", getpid() % 10000, p->id);
+	session_connect(&client, p, handle);
+}
+
+// Choose a player's move: the bot's, or the last stone of the first row
+// left.
+int lg_move(struct nim_session *p, int *row, int *col) {
+	if (bot_mode) bot_move(&p->heaps, &p->variant, row, col);
+	else {
+		for (*row = 1; p->heaps.h[*row - 1] == 0; *row += 1) ;
+		*col = p->heaps.h[*row - 1];
+	}
+	moves += 1;
+	return 1;
+}
+
+// Count and time each step of a player's session. A player whose game
+// ended plays again once the batch is done; one that failed is counted and
+// left idle.
+void lg_hook(struct nim_session *p, int what) {
+	switch (what) {
+	case SESSION_WELCOME:
+		record(&s_connect, p->t_welcome - p->t_connect);
+		break;
+	case SESSION_START:
+		record(&s_pair, p->t_start - p->t_welcome);
+		break;
+	case SESSION_TURN:
+		if (p->boards == 1) record(&s_board, p->t_turn - p->t_start);
+		if (p->moved) record(&s_move, p->t_turn - p->t_move);
+		break;
+	case SESSION_END:
+		results += 1;
+		if (p->status == 'W') wins += 1;
+		restarts[nrestarts++] = p;
+		break;
+	case SESSION_REJECT:
+		rejects += 1;
+		break;
+	case SESSION_FAILED:
+		failures += 1;
+		break;
+	case SESSION_REDIRECT:
+		redirects += 1;
+		break;
+	}
+}
+
+// Send the queries that have come due, each on a socket with no query
+// out. A query due while every socket has one out is skipped.
+void send_queries(long long now, long long *next, long long interval) {
+	struct nim_frame f;
+	unsigned char request[32];
+	int size, i;
+	frame_begin(&f, request, sizeof(request), FRAME_QUERY);
+	frame_str(&f, password);
+	size = frame_end(&f);
+	for (i = 0; i < LG_QUERY_SOCKS; i++)
+		if (query[i].sent > 0 && now - query[i].sent > LG_QUERY_LOST) {
+			query[i].sent = 0;
+			lost += 1;
+		}
+	while (*next <= now) {
+		struct lg_query *q = NULL;
+		*next += interval;
+		for (i = 0; i < LG_QUERY_SOCKS && q == NULL; i++)
+			if (query[(query_next + i) % LG_QUERY_SOCKS].sent == 0)
+				q = &query[(query_next + i) % LG_QUERY_SOCKS];
+		if (q == NULL) { skipped += 1; continue; }
+		query_next = (q - query + 1) % LG_QUERY_SOCKS;
+		if (sendto(q->src.fd, request, size, 0, (struct sockaddr *) &query_addr,
+				sizeof(query_addr)) != size) continue;
+		q->sent = now;
+		queries += 1;
+	}
+}
+
+// Take the reply waiting on a query socket, room enough for the largest
+// frame. One longer than that answers its query but is counted apart.
+void recv_replies(struct lg_query *q) {
+	static unsigned char reply[NIM_FRAME_HEAD + 0xFFFF];
+	struct nim_cursor c;
+	int num;
+	while ( (num = recv(q->src.fd, reply, sizeof(reply), MSG_TRUNC)) >= 0 ) {
+		if (num > sizeof(reply) && q->sent > 0) {
+			q->sent = 0;
+			truncated += 1;
+			continue;
+		}
+		if (frame_datagram(reply, num, &c) != FRAME_LOBBY || q->sent == 0) continue;
+		record(&s_query, now_us() - q->sent);
+		q->sent = 0;
+		replies += 1;
+	}
+}
+
+// Add a latency sample.
+void record(struct lg_samples *s, long long us) {
+	if (s->n == s->max) {
+		s->max = s->max ? 2 * s->max : 1024;
+		s->v = realloc(s->v, s->max * sizeof(long long));
+	}
+	s->v[s->n++] = us;
+}
+
+// Print the run's totals and latencies.
+void report(double elapsed) {
+	printf("%d players for %.1fs\n", players, elapsed);
+	printf("games    %lld ended (%.1f/s), %lld won\n", results,
+			results / elapsed, wins);
+	printf("moves    %lld (%.1f/s)\n", moves, moves / elapsed);
+	printf("queries  %lld sent, %lld answered (%.1f/s), %lld lost, %lld skipped, "
+			"%lld truncated\n", queries, replies, replies / elapsed, lost, skipped,
+			truncated);
+	printf("errors   %lld rejected, %lld failed, %lld redirected\n", rejects,
+			failures, redirects);
+	printf("\nlatency ms   samples      p50      p90      p99    p99.9      max\n");
+	report_samples("connect", &s_connect);
+	report_samples("pair", &s_pair);
+	report_samples("board", &s_board);
+	report_samples("move", &s_move);
+	report_samples("query", &s_query);
+}
+
+int compare_samples(const void *a, const void *b) {
+	long long x = *(long long *) a, y = *(long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+// Print one row of percentiles.
+void report_samples(char *name, struct lg_samples *s) {
+	double pct[4] = {0.5, 0.9, 0.99, 0.999};
+	int i;
+	printf("%-10s %9d", name, s->n);
+	if (s->n == 0) { printf("\n"); return; }
+	qsort(s->v, s->n, sizeof(long long), compare_samples);
+	for (i = 0; i < 4; i++)
+		printf(" %8.3f", s->v[(int) (pct[i] * (s->n - 1))] / 1000.0);
+	printf(" %8.3f\n", s->v[s->n - 1] / 1000.0);
+}
+
+// Print appropriate error message and exit.
+void error(int code) {
+	switch(code) {
+	case 1:
+		fprintf(stderr, "nim_loadgen: argument error: exit 1\n");
+		exit(1); break;
+	case 2:
+		fprintf(stderr, "nim_loadgen: unable to access server address file: exit 2\n");
+		exit(2); break;
+	case 3:
+		fprintf(stderr, "nim_loadgen: problem resolving server address: exit 3\n");
+		exit(3); break;
+	case 4:
+		fprintf(stderr, "nim_loadgen: problem with epoll or query socket: exit 4\n");
+		exit(4); break;
+	}
+}
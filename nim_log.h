@@ -0,0 +1,303 @@
+// CS415 Project #4: nim_log.h (game log)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Append-only log of finished games, kept in a directory of fixed size
+// segment files, games.000000.log and up, each mapped shared into every
+// process that writes to it. Any number of processes append at once: a
+// writer reserves space with an atomic add on the segment's reserved count,
+// fills it in place, and writes the record's checksum last. A reservation
+// that runs off the end of a segment moves the writer to the next one,
+// which whoever gets there first creates. Writers never sync; one
+// committer thread in the lobby flushes whatever has been appended since
+// its last pass with a single fdatasync, so a slow disk delays only the
+// durability of a batch of records, never a game.
+//
+// A record is a 4 byte CRC-32C, a 4 byte size (the record's, padded to 8),
+// then a frame in the form of nim_proto.h holding the game. A crash can
+// leave a record torn or a reservation never filled; readers skip a record
+// whose checksum fails, stop at the head of the log on one whose checksum
+// is not yet written, and recovery at startup cuts the last segment back
+// to its last whole record.
+
+#ifndef NIM_LOG_H
+#define NIM_LOG_H
+
+#define NIM_LOG_SEGMENT (4 << 20) // segment file size
+#define NIM_LOG_HEAD 64 // segment header size, records follow
+#define NIM_LOG_SYNC_MS 50 // committer pass interval
+#define NIM_LOG_MAGIC "NIMLOG1"
+
+// Segment header.
+struct nim_log_header {
+	char magic[8];
+	uint32_t seq;
+	uint32_t pad;
+	uint64_t reserved; // record bytes reserved, may run past the end
+	uint64_t synced; // record bytes known to be on disk
+};
+
+// Record header; the frame follows.
+struct nim_log_record {
+	uint32_t crc; // CRC-32C of the frame, written last
+	uint32_t size; // whole record, a multiple of 8
+};
+
+// Record frame types.
+enum {
+	LOG_GAME = 1 // u32 start (unix ms, high then low), u32 duration ms,
+		// u8 winner (1 or 2, 0 if undecided), u8 end, str handle1,
+		// str handle2, str variant, u16 moves, then u8 row, u8 col each
+};
+
+// How a game ended.
+enum {
+	LOG_EMPTIED = 1, // the board was cleared
+	LOG_RESIGNED,
+	LOG_DROPPED, // a player left
+	LOG_TIMED_OUT // a player ran out of time to move
+};
+
+// An open segment.
+struct nim_log {
+	char dir[PATH_MAX - 64]; // room left for a segment name
+	int seq;
+	int fd;
+	struct nim_log_header *seg; // mapping, NULL if none
+};
+
+uint32_t crc_table[256];
+
+// CRC-32C (Castagnoli), a byte at a time, 1 in place of 0, which marks a
+// record still being written.
+uint32_t log_crc(void *data, int size) {
+	unsigned char *p = data;
+	uint32_t crc = ~0u;
+	int i, bit;
+	if (crc_table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (bit = 0; bit < 8; bit++) c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+			crc_table[i] = c;
+		}
+	}
+	while (size-- > 0) crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc != 0 ? ~crc : 1;
+}
+
+// Path of a segment.
+void log_path(char *dir, int seq, char *path) { // path holds PATH_MAX
+	snprintf(path, PATH_MAX, "%s/games.%06d.log", dir, seq);
+}
+
+// Newest segment in a directory, -1 if there is none; the oldest is left
+// in *oldest if asked for.
+int log_newest(char *dir, int *oldest) {
+	DIR *d;
+	struct dirent *ent;
+	int seq, newest = -1, first = -1;
+	if ( (d = opendir(dir)) == NULL ) return -1;
+	while ( (ent = readdir(d)) != NULL ) {
+		if (sscanf(ent->d_name, "games.%d.log", &seq) != 1) continue;
+		if (seq > newest) newest = seq;
+		if (first < 0 || seq < first) first = seq;
+	}
+	closedir(d);
+	if (oldest != NULL) *oldest = first;
+	return newest;
+}
+
+// Map a segment in place of the one mapped, creating it if asked and it
+// does not exist. A new segment is built under a temporary name and linked
+// into place, so no other process sees it half made and only one of any
+// racing creators wins. Returns -1 on failure.
+int log_map(struct nim_log *log, int seq, int create) {
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct nim_log_header *seg;
+	int fd;
+	log_path(log->dir, seq, path);
+	if ( (fd = open(path, O_RDWR | O_CLOEXEC)) < 0 && create ) {
+		snprintf(tmp, PATH_MAX, "%s/.games.%06d.%d", log->dir, seq, getpid());
+		if ( (fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ) return -1;
+		if (ftruncate(fd, NIM_LOG_SEGMENT) < 0
+				|| (seg = mmap(NULL, NIM_LOG_HEAD, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, 0)) == MAP_FAILED) {
+			close(fd);
+			unlink(tmp);
+			return -1;
+		}
+		memcpy(seg->magic, NIM_LOG_MAGIC, 8);
+		seg->seq = seq;
+		munmap(seg, NIM_LOG_HEAD);
+		close(fd);
+		if (link(tmp, path) < 0 && errno != EEXIST) { unlink(tmp); return -1; }
+		unlink(tmp);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+	}
+	if (fd < 0) return -1;
+	seg = mmap(NULL, NIM_LOG_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED || memcmp(seg->magic, NIM_LOG_MAGIC, 8) != 0) {
+		if (seg != MAP_FAILED) munmap(seg, NIM_LOG_SEGMENT);
+		close(fd);
+		return -1;
+	}
+	if (log->seg != NULL) {
+		munmap(log->seg, NIM_LOG_SEGMENT);
+		close(log->fd);
+	}
+	log->seq = seq;
+	log->fd = fd;
+	log->seg = seg;
+	return 0;
+}
+
+// Open the log in a directory for appending, creating both as needed.
+int log_open(struct nim_log *log, char *dir) {
+	int seq;
+	memset(log, 0, sizeof(struct nim_log));
+	snprintf(log->dir, sizeof(log->dir), "%s", dir);
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+	seq = log_newest(dir, NULL);
+	return log_map(log, seq < 0 ? 0 : seq, 1);
+}
+
+// Append a record holding a frame. Returns -1 if the log cannot take it.
+int log_append(struct nim_log *log, void *frame, int len) {
+	struct nim_log_record *rec;
+	uint32_t size = (sizeof(struct nim_log_record) + len + 7) & ~7u;
+	uint64_t off;
+	if (log->seg == NULL || size > NIM_LOG_SEGMENT - NIM_LOG_HEAD) return -1;
+	for ( ; ; ) {
+		off = __atomic_fetch_add(&log->seg->reserved, size, __ATOMIC_RELAXED);
+		if (off + size <= NIM_LOG_SEGMENT - NIM_LOG_HEAD) break;
+		// full: move on to the next segment, creating it if nobody has
+		if (log_map(log, log->seq + 1, 1) < 0) return -1;
+	}
+	rec = (struct nim_log_record *) ((char *) log->seg + NIM_LOG_HEAD + off);
+	rec->size = size;
+	memcpy(rec + 1, frame, len);
+	__atomic_store_n(&rec->crc, log_crc(rec + 1, len), __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Check the record at an offset of a segment. Returns its size if it is
+// whole, 0 if nothing was ever written there, -1 if it is torn: its size
+// is sane but the checksum fails, so a reader can skip it, -2 if even its
+// size cannot be trusted, or -3 if its checksum is not written yet, so a
+// writer is still filling it in or died doing so. The checksum is read
+// first, so that once it is there the rest of the record is too.
+int log_check(struct nim_log_header *seg, uint64_t off) {
+	struct nim_log_record *rec = (struct nim_log_record *) ((char *) seg + NIM_LOG_HEAD + off);
+	unsigned char *frame = (unsigned char *) (rec + 1);
+	uint32_t crc, size, len;
+	if (off + sizeof(struct nim_log_record) > NIM_LOG_SEGMENT - NIM_LOG_HEAD) return 0;
+	crc = __atomic_load_n(&rec->crc, __ATOMIC_ACQUIRE);
+	size = rec->size;
+	if (size == 0) return 0;
+	if (size % 8 != 0 || size < sizeof(struct nim_log_record) + NIM_FRAME_HEAD
+			|| off + size > NIM_LOG_SEGMENT - NIM_LOG_HEAD) return -2;
+	if (crc == 0) return -3;
+	len = (frame[0] << 8 | frame[1]) + 2;
+	if (sizeof(struct nim_log_record) + len > size) return -1;
+	return crc == log_crc(frame, len) ? size : -1;
+}
+
+// Cut the newest segment back to its last whole record, before any
+// process appends; whatever follows a reservation never filled, or a
+// record too damaged to step over, is dropped. Returns the bytes dropped,
+// or -1 if there is no log.
+long log_recover(char *dir) {
+	struct nim_log log;
+	uint64_t off = 0, end, last = 0;
+	int size;
+	memset(&log, 0, sizeof(log));
+	snprintf(log.dir, sizeof(log.dir), "%s", dir);
+	if (log_map(&log, log_newest(dir, NULL), 0) < 0) return -1;
+	end = log.seg->reserved;
+	if (end > NIM_LOG_SEGMENT - NIM_LOG_HEAD) end = NIM_LOG_SEGMENT - NIM_LOG_HEAD;
+	while (off < end && (size = log_check(log.seg, off)) != 0 && size != -2) {
+		if (size > 0) last = off + size;
+		off += size > 0 ? size : ((struct nim_log_record *) ((char *) log.seg
+				+ NIM_LOG_HEAD + off))->size;
+	}
+	memset((char *) log.seg + NIM_LOG_HEAD + last, 0, end - last);
+	log.seg->reserved = log.seg->synced = last;
+	msync(log.seg, NIM_LOG_SEGMENT, MS_SYNC);
+	munmap(log.seg, NIM_LOG_SEGMENT);
+	close(log.fd);
+	return end - last;
+}
+
+// Committer: every NIM_LOG_SYNC_MS, flush what has been appended to the
+// newest segment since the last pass, and finish off any segment the
+// writers have moved past.
+void *log_committer(void *arg) {
+	struct nim_log *log = arg; // a mapping of its own
+	struct timespec pause = {0, NIM_LOG_SYNC_MS * 1000000L};
+	uint64_t reserved;
+	for ( ; ; ) {
+		nanosleep(&pause, NULL);
+		reserved = __atomic_load_n(&log->seg->reserved, __ATOMIC_ACQUIRE);
+		if (reserved > NIM_LOG_SEGMENT - NIM_LOG_HEAD)
+			reserved = NIM_LOG_SEGMENT - NIM_LOG_HEAD;
+		if (reserved != log->seg->synced && fdatasync(log->fd) == 0)
+			log->seg->synced = reserved;
+		if (reserved == NIM_LOG_SEGMENT - NIM_LOG_HEAD
+				|| log_newest(log->dir, NULL) > log->seq) {
+			fdatasync(log->fd); // anything filled in since
+			log_map(log, log->seq + 1, 1);
+		}
+	}
+	return NULL;
+}
+
+// Start the committer thread for a log directory.
+int log_start_committer(char *dir) {
+	static struct nim_log log;
+	pthread_t thread;
+	if (log_open(&log, dir) < 0) return -1;
+	if (pthread_create(&thread, NULL, log_committer, &log) != 0) return -1;
+	pthread_detach(thread);
+	return 0;
+}
+
+// Sequential reader over every segment.
+struct nim_log_reader {
+	struct nim_log log;
+	uint64_t off;
+	long torn; // records skipped
+};
+
+// Open a reader at the oldest segment.
+int log_reader_open(struct nim_log_reader *r, char *dir) {
+	int oldest;
+	memset(r, 0, sizeof(struct nim_log_reader));
+	snprintf(r->log.dir, sizeof(r->log.dir), "%s", dir);
+	if (log_newest(dir, &oldest) < 0) return -1;
+	return log_map(&r->log, oldest, 0);
+}
+
+// Point the cursor at the next whole record's frame. Returns its type, or
+// 0 at the end of the log.
+int log_next(struct nim_log_reader *r, struct nim_cursor *c) {
+	int size;
+	for ( ; ; ) {
+		size = log_check(r->log.seg, r->off);
+		// a record still being written at the head of the log is as far
+		// as it goes for now; behind it, its writer died
+		if (size == -3 && log_newest(r->log.dir, NULL) == r->log.seq) return 0;
+		if (size > 0 || size == -1 || size == -3) {
+			struct nim_log_record *rec = (struct nim_log_record *)
+					((char *) r->log.seg + NIM_LOG_HEAD + r->off);
+			r->off += rec->size;
+			if (size < 0) { r->torn += 1; continue; }
+			unsigned char *frame = (unsigned char *) (rec + 1);
+			return frame_datagram(frame, (frame[0] << 8 | frame[1]) + 2, c);
+		}
+		// end of this segment's records
+		if (size == -2) r->torn += 1;
+		if (log_map(&r->log, r->log.seq + 1, 0) < 0) return 0;
+		r->off = 0;
+	}
+}
+
+#endif
@@ -0,0 +1,88 @@
+// CS415 Project #4: nim_logdump.c (game log reader)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Compile: gcc -o nim_logdump nim_logdump.c (use Makefile!)
+// Invoke: $ nim_logdump {-m} {dir}
+//   -m  list each game's moves as row.col, 0.0 for a resignation or a
+//       turn run out of time
+//   dir the game log directory given to nim_server -l (default games)
+// Prints every game in the log, oldest first, one line each: start time,
+// players, variant, number of moves, duration, winner and how the game
+// ended, then a count of the records skipped as torn. Safe to run against
+// a log nim_server is appending to.
+
+// Exit Codes:
+// <0> Successful termination
+// <1> Argument error
+// <2> No game log in the directory
+
+#include "nim.h"
+#include "nim_proto.h"
+#include "nim_log.h"
+
+char *end_names[] = {"?", "board emptied", "resigned", "dropped", "out of time"};
+
+void error(int code);
+
+int main(int argc, char *argv[]) { /////////////////////////////////////////////
+
+	// Process input arguments.
+	int i, show_moves = 0;
+	char *dir = NULL;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-m") == 0) show_moves = 1;
+		else if (argv[i][0] != '-' && dir == NULL) dir = argv[i];
+		else error(1);
+	}
+	if (dir == NULL) dir = "games";
+
+	struct nim_log_reader r;
+	struct nim_cursor c;
+	long games = 0;
+	int type;
+	if (log_reader_open(&r, dir) < 0) error(2);
+	while ( (type = log_next(&r, &c)) != 0 ) {
+		if (type != LOG_GAME) continue;
+		char handle[2][20], variant[20], when[32];
+		long long start = (long long) get_u32(&c) << 32;
+		start |= get_u32(&c);
+		unsigned duration = get_u32(&c);
+		unsigned winner = get_u8(&c), end = get_u8(&c), moves;
+		get_str(&c, handle[0]);
+		get_str(&c, handle[1]);
+		get_str(&c, variant);
+		moves = get_u16(&c);
+		time_t secs = start / 1000;
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+		printf("%s.%03lld  %s vs %s  %s  %u moves  %u.%03us  ", when,
+				start % 1000, handle[0], handle[1], variant, moves,
+				duration / 1000, duration % 1000);
+		if (winner == 1 || winner == 2) printf("%s won", handle[winner - 1]);
+		else printf("no winner");
+		printf(" (%s)\n", end_names[end < 5 ? end : 0]);
+		if (show_moves) {
+			printf("   ");
+			for ( ; moves > 0 && !c.bad; moves--) {
+				unsigned row = get_u8(&c);
+				printf(" %u.%u", row, get_u8(&c));
+			}
+			printf("\n");
+		}
+		games += 1;
+	}
+	printf("%ld games, %ld torn records skipped\n", games, r.torn);
+	exit(0);
+
+} // end main //////////////////////////////////////////////////////////////////
+
+// Error function, exits with the given code.
+void error(int code) {
+	switch(code) {
+	case 1:
+		fprintf(stderr, "nim_logdump: argument error: exit 1\n");
+		exit(1); break;
+	case 2:
+		fprintf(stderr, "nim_logdump: no game log found: exit 2\n");
+		exit(2); break;
+	}
+}
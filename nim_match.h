@@ -0,0 +1,591 @@
+// CS415 Project #4: nim_match.h (match engine)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Turn logic for a match, plus an event driven engine that runs a match as a
+// state object on an epoll loop so one process can host many games. The
+// engine speaks the same message sequence as the original match server:
+// <R> handles, then per turn the board followed by <A>/<Z>, and finally the
+// board followed by <L>/<W>. Everything a player is sent for one turn is
+// queued first and goes out in a single write. A player speaking protocol
+// v2 gets the same sequence as START and TURN frames instead. Either player
+// may be the bot, which has no socket and moves as soon as it is its turn.
+// A match plays one board variant, kept as row counts; old clients only
+// ever play the classic board, sent to them as 28 bytes. Games, moves and
+// their timings are counted in the host's metrics slot, if it has one, and
+// each finished game with all its moves is appended to the game log, if the
+// host has opened it. Any number of v2 spectators may watch a match (see
+// nim_watch.h): they are sent START with seat 0 and then every TURN as
+// player 1 sees it, encoded once for all of them. If the host sets a move
+// clock, a player who has not moved within it once their turn is written
+// forfeits: the turn is played as a resignation, so both players get the
+// usual board and <W>/<L>. A match can be saved, down to the bytes in its
+// players' buffers, and restored in the server replacing its host in a hot
+// restart (see nim_upgrade.h). Hosts take matches from match_slab, and a
+// match keeps its moves and builds its log record in its own arena, freed
+// as the match ends (see nim_alloc.h).
+
+#ifndef NIM_MATCH_H
+#define NIM_MATCH_H
+
+#include "nim_board.h"
+#include "nim_proto.h"
+#include "nim_variant.h"
+#include "nim_eval.h"
+#include "nim_bot.h"
+#include "nim_metrics.h"
+#include "nim_log.h"
+#include "nim_watch.h"
+#include "nim_timer.h"
+
+// Turn statistics, kept when NIM_TURN_STATS is set in the environment:
+// how long a mover took to answer once their turn was written (a round trip
+// through the client, including any delay in either kernel), how long the
+// match then took to write the next turn to both players, and in how many
+// writes.
+struct nim_turn_stats {
+	long long turns;
+	long long rtt_us, rtt_max;
+	long long service_us, service_max;
+	long long writes;
+} turn_stats;
+int turn_stats_on = -1; // -1 until the environment is checked
+
+struct nim_log game_log; // finished games go here once opened
+int move_clock = 0; // ms a player has to move, 0 for no limit
+
+// Match states.
+enum {
+	MATCH_MOVE, // waiting on the current player's move
+	MATCH_OVER, // result queued, closing once flushed
+	MATCH_DONE // both players closed, handed back to the host
+};
+
+struct nim_match;
+
+// One side of a match.
+struct nim_player {
+	struct nim_source src; // kind SRC_PLAYER, fd -1 once closed
+	struct nim_match *match;
+	int bot; // played by the bot, fd always -1
+	int version; // protocol version, 1 for the old structs
+	unsigned events; // current epoll interest
+	int have; // bytes of move received so far
+	struct nim_move move;
+	int row, col; // move received
+	struct nim_inbuf in; // v2 frames received
+	struct nim_outbuf out;
+	char handle[20];
+};
+
+// Match state object.
+struct nim_match {
+	struct nim_player p[2];
+	struct nim_variant *variant; // NULL taken as the classic board
+	struct nim_heaps heaps; // position
+	int turn; // if odd, p1's turn; if even: p2's turn
+	int resigned; // last player to move resigned
+	int winner; // 0 or 1 once decided, -1 before
+	int state;
+	void (*done)(struct nim_match *); // called once both players are closed
+	void *owner; // for the host's bookkeeping
+	long long turn_us; // when the current turn was written
+	long long start_us; // when the match started
+	long long start_ms; // the same, as unix time for the game log
+	unsigned char *moves; // row and col of every move made, in the arena
+	int nmoves, maxmoves;
+	struct nim_arena arena; // freed once both players are closed
+	struct nim_watch_list watchers; // spectators
+	struct nim_timer clock; // the mover's move clock, on the host's wheel
+	int timed_out; // the last player to move ran out of time
+	int epfd; // the host's, for the move clock
+};
+
+void match_send_turn(int epfd, struct nim_match *m);
+void match_queue_turn(struct nim_match *m, struct nim_player *p, int status);
+int match_encode_turn(struct nim_match *m, int status, unsigned char *buf, int cap);
+void match_broadcast(int epfd, struct nim_match *m);
+void match_play(int epfd, struct nim_match *m, int row, int col);
+int match_read_move(int epfd, struct nim_player *p);
+void match_update(int epfd, struct nim_player *p);
+void match_drop(int epfd, struct nim_player *p);
+void match_close(int epfd, struct nim_player *p);
+void match_log(struct nim_match *m);
+void match_timeout(struct nim_timer *t);
+
+struct nim_slab match_slab = {"match", sizeof(struct nim_match)};
+
+// Begin a match between two connected, non-blocking player sockets. The
+// caller fills in the handles, protocol versions (0 taken as 1), variant,
+// done and owner before starting, and marks a bot player, whose socket is
+// -1. Once done has been called the host retires the match with
+// ev_retire() to match_slab.
+int match_start(int epfd, struct nim_match *m, int sock1, int sock2) {
+	struct timespec ts;
+	int i;
+	if (m->variant == NULL) m->variant = &nim_variants[0];
+	heaps_init(&m->heaps, m->variant);
+	m->turn = 1;
+	m->resigned = 0;
+	m->winner = -1;
+	m->state = MATCH_MOVE;
+	m->start_us = now_us();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	m->start_ms = (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	m->moves = NULL;
+	m->nmoves = m->maxmoves = 0;
+	m->timed_out = 0;
+	m->epfd = epfd;
+	metrics_count(M_GAMES_STARTED);
+	if (turn_stats_on < 0) turn_stats_on = (getenv("NIM_TURN_STATS") != NULL);
+	m->p[0].src.fd = sock1;
+	m->p[1].src.fd = sock2;
+	for (i = 0; i < 2; i++) {
+		m->p[i].src.kind = SRC_PLAYER;
+		m->p[i].match = m;
+		m->p[i].have = 0;
+		m->p[i].in.len = m->p[i].in.off = 0;
+		if (m->p[i].version < 1) m->p[i].version = 1;
+		m->p[i].events = EPOLLRDHUP;
+		m->p[i].out.len = m->p[i].out.off = 0;
+		if (m->p[i].bot) continue;
+		if (ev_add(epfd, &m->p[i].src, EPOLLRDHUP) < 0) return -1;
+	}
+
+	// Send handles to players to indicate the match has begun.
+	struct nim_msg handle_msg1, handle_msg2;
+	memset(&handle_msg1, 0, sizeof(struct nim_msg));
+	memset(&handle_msg2, 0, sizeof(struct nim_msg));
+	handle_msg1.type = handle_msg2.type = 'R';
+	strcpy(handle_msg1.data, m->p[0].handle);
+	strcpy(handle_msg2.data, m->p[1].handle);
+	for (i = 0; i < 2; i++) {
+		if (m->p[i].bot) continue;
+		if (m->p[i].version >= 2) {
+			struct nim_frame f;
+			unsigned char buf[80];
+			frame_begin(&f, buf, sizeof(buf), FRAME_START);
+			frame_u8(&f, i + 1);
+			frame_str(&f, m->p[0].handle);
+			frame_str(&f, m->p[1].handle);
+			frame_str(&f, m->variant->name);
+			frame_u8(&f, m->variant->misere);
+			nb_queue(&m->p[i].out, buf, frame_end(&f));
+			continue;
+		}
+		nb_queue(&m->p[i].out, &handle_msg1, sizeof(struct nim_msg));
+		nb_queue(&m->p[i].out, &handle_msg2, sizeof(struct nim_msg));
+	}
+	match_send_turn(epfd, m);
+	return 0;
+}
+
+// Send the board to both players, then either the result or the move
+// request and dummy message.
+void match_send_turn(int epfd, struct nim_match *m) {
+	struct nim_eval e;
+	int i, mover;
+	eval_position(&m->heaps, &e);
+	if (e.empty || m->resigned) {
+		// last player to move is loser (winner under normal play), other
+		// player is winner
+		int loser = (m->turn % 2 == 1) ? 1 : 0;
+		if (!m->resigned && !m->variant->misere) loser = 1 - loser;
+		match_queue_turn(m, &m->p[loser], 'L');
+		match_queue_turn(m, &m->p[1 - loser], 'W');
+		m->winner = 1 - loser;
+		timer_cancel(&timers, &m->clock);
+		m->state = MATCH_OVER;
+		match_broadcast(epfd, m);
+	} else {
+		mover = (m->turn % 2 == 1) ? 0 : 1;
+		match_queue_turn(m, &m->p[mover], 'A');
+		match_queue_turn(m, &m->p[1 - mover], 'Z');
+		match_broadcast(epfd, m);
+		if (m->p[mover].bot) { // the bot answers at once, in the same write
+			int row, col;
+			bot_move(&m->heaps, m->variant, &row, &col);
+			match_play(epfd, m, row, col);
+			return;
+		}
+		if (move_clock > 0) timer_arm(&timers, &m->clock, move_clock, match_timeout);
+	}
+	for (i = 0; i < 2; i++) match_update(epfd, &m->p[i]);
+	m->turn_us = now_us();
+}
+
+// Queue the board and a status message for one player: a TURN frame in v2,
+// otherwise the 28 byte board and a nim_msg.
+void match_queue_turn(struct nim_match *m, struct nim_player *p, int status) {
+	if (p->bot) return;
+	if (p->version >= 2) {
+		unsigned char buf[16 + NIM_MAX_ROWS];
+		nb_queue(&p->out, buf, match_encode_turn(m, status, buf, sizeof(buf)));
+		return;
+	}
+	struct nim_board board;
+	struct nim_msg message;
+	board_to_ascii(heaps_bits(&m->heaps), &board);
+	memset(&message, 0, sizeof(struct nim_msg));
+	message.type = status;
+	nb_queue(&p->out, &board, sizeof(struct nim_board));
+	nb_queue(&p->out, &message, sizeof(struct nim_msg));
+}
+
+// Encode the board and a status as a TURN frame, returning its length.
+int match_encode_turn(struct nim_match *m, int status, unsigned char *buf, int cap) {
+	struct nim_frame f;
+	struct nim_packed_board packed;
+	int classic = (m->variant == &nim_variants[0]);
+	frame_begin(&f, buf, cap, FRAME_TURN);
+	frame_u16(&f, m->turn);
+	board_pack(classic ? heaps_bits(&m->heaps) : 0, &packed);
+	frame_put(&f, &packed, sizeof(packed));
+	frame_u8(&f, status);
+	if (!classic) {
+		frame_u8(&f, m->variant->rows);
+		frame_put(&f, m->heaps.h, m->variant->rows);
+	}
+	return frame_end(&f);
+}
+
+// Status of the board as player 1 sees it, which is what spectators get.
+int match_watch_status(struct nim_match *m) {
+	if (m->state != MATCH_MOVE) return m->winner == 0 ? 'W' : 'L';
+	return m->turn % 2 == 1 ? 'A' : 'Z';
+}
+
+// Send the board to every spectator.
+void match_broadcast(int epfd, struct nim_match *m) {
+	unsigned char buf[16 + NIM_MAX_ROWS];
+	if (m->watchers.first == NULL) return;
+	watch_broadcast(epfd, &m->watchers, buf,
+			match_encode_turn(m, match_watch_status(m), buf, sizeof(buf)));
+}
+
+// Add a spectator, sending it START and the board as it stands. Returns -1
+// if it could not be added; the caller still owns the socket then.
+int match_watch(int epfd, struct nim_match *m, int sock) {
+	struct nim_frame f;
+	struct nim_shared_frame *first;
+	unsigned char buf[80 + 16 + NIM_MAX_ROWS];
+	int size, ret;
+	frame_begin(&f, buf, sizeof(buf), FRAME_START);
+	frame_u8(&f, 0); // seat 0: spectating
+	frame_str(&f, m->p[0].handle);
+	frame_str(&f, m->p[1].handle);
+	frame_str(&f, m->variant->name);
+	frame_u8(&f, m->variant->misere);
+	if ( (size = frame_end(&f)) < 0 ) return -1;
+	size += match_encode_turn(m, match_watch_status(m), buf + size, sizeof(buf) - size);
+	if ( (first = shared_frame(buf, size)) == NULL ) return -1;
+	ret = watch_add(epfd, &m->watchers, sock, first);
+	shared_frame_drop(first);
+	return ret;
+}
+
+// Flush a player's output and refresh its epoll interest. Only the player
+// to move is read from; the other is watched for hangup alone.
+void match_update(int epfd, struct nim_player *p) {
+	struct nim_match *m = p->match;
+	unsigned events = EPOLLRDHUP;
+	int mover = (m->turn % 2 == 1) ? 0 : 1;
+	if (p->src.fd < 0) return;
+	int done = nb_flush(p->src.fd, &p->out);
+	if (done < 0) { match_drop(epfd, p); return; }
+	if (m->state == MATCH_OVER && done) { // result delivered
+		match_close(epfd, p);
+		return;
+	}
+	if (!done) events |= EPOLLOUT;
+	if (m->state == MATCH_MOVE && p == &m->p[mover]) events |= EPOLLIN;
+	if (events != p->events) {
+		ev_mod(epfd, &p->src, events);
+		p->events = events;
+	}
+}
+
+// React to readiness on a player socket.
+void match_event(int epfd, struct nim_player *p, unsigned events) {
+	struct nim_match *m = p->match;
+	int mover = (m->turn % 2 == 1) ? 0 : 1;
+	if (events & EPOLLOUT) match_update(epfd, p);
+	if (m->state != MATCH_MOVE || p->src.fd < 0) return;
+	if (p != &m->p[mover]) { // only a hangup wakes the waiting player
+		if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) match_drop(epfd, p);
+		return;
+	}
+	if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) return;
+
+	// Receive move and update the board with it. An old client checks its
+	// own moves and an illegal one passes, as it always has; a v2 client is
+	// asked again.
+	int done = match_read_move(epfd, p);
+	if (done <= 0) return;
+	if (p->version >= 2 && !(p->row == 0 && p->col == 0)
+			&& !heaps_legal(&m->heaps, m->variant, p->row, p->col)) {
+		match_queue_turn(m, p, 'A');
+		match_update(epfd, p);
+		return;
+	}
+	long long start = now_us(), writes = ev_writes;
+	metrics_record(H_TURNAROUND, start - m->turn_us);
+	if (turn_stats_on) {
+		turn_stats.turns += 1;
+		turn_stats.rtt_us += start - m->turn_us;
+		if (start - m->turn_us > turn_stats.rtt_max)
+			turn_stats.rtt_max = start - m->turn_us;
+	}
+	match_play(epfd, m, p->row, p->col);
+	if (turn_stats_on) {
+		turn_stats.service_us += m->turn_us - start;
+		if (m->turn_us - start > turn_stats.service_max)
+			turn_stats.service_max = m->turn_us - start;
+		turn_stats.writes += ev_writes - writes;
+	}
+}
+
+// Make the mover's move and start the next turn; 0 0 resigns.
+void match_play(int epfd, struct nim_match *m, int row, int col) {
+	unsigned char *moves;
+	if (m->nmoves == m->maxmoves) { // the old list stays in the arena till the end
+		int max = m->maxmoves ? 2 * m->maxmoves : 32;
+		if ( (moves = arena_alloc(&m->arena, 2 * max)) != NULL ) {
+			if (m->nmoves > 0) memcpy(moves, m->moves, 2 * m->nmoves);
+			m->moves = moves;
+			m->maxmoves = max;
+		}
+	}
+	if (m->nmoves < m->maxmoves) { // else played but not logged
+		m->moves[2 * m->nmoves] = row;
+		m->moves[2 * m->nmoves++ + 1] = col;
+	}
+	heaps_move(&m->heaps, m->variant, row, col);
+	if (row == 0 && col == 0) m->resigned = 1;
+	else metrics_count(M_MOVES);
+	m->turn += 1;
+	match_send_turn(epfd, m);
+}
+
+// Read toward the mover's move, leaving it in p->row and p->col. Returns 1
+// once a move for this turn has arrived, 0 if more is needed, -1 if the
+// player was dropped. A v2 move naming another turn is ignored.
+int match_read_move(int epfd, struct nim_player *p) {
+	struct nim_match *m = p->match;
+	if (p->version < 2) {
+		int done = nb_fill(p->src.fd, &p->move, &p->have, sizeof(struct nim_move));
+		if (done < 0) { match_drop(epfd, p); return -1; }
+		if (done == 0) return 0;
+		p->have = 0;
+		p->row = p->move.row - '0';
+		p->col = p->move.col - '0';
+		return 1;
+	}
+	struct nim_cursor c;
+	int type;
+	if (frame_read(p->src.fd, &p->in) < 0) { match_drop(epfd, p); return -1; }
+	while ( (type = frame_next(&p->in, &c)) != 0 ) {
+		unsigned turn = get_u16(&c);
+		int row = get_u8(&c), col = get_u8(&c);
+		if (type != FRAME_MOVE || c.bad) { match_drop(epfd, p); return -1; }
+		if (turn != (m->turn & 0xFFFF)) continue; // stale
+		p->row = row;
+		p->col = col;
+		return 1;
+	}
+	return 0;
+}
+
+// Report turn statistics, if kept.
+void match_print_stats(char *who) {
+	long long n = turn_stats.turns;
+	if (!turn_stats_on || n == 0) return;
+	fprintf(stderr, "%s: %lld turns, round trip avg %lld us max %lld us, "
+			"service avg %lld us max %lld us, %.2f writes per turn\n", who, n,
+			turn_stats.rtt_us / n, turn_stats.rtt_max, turn_stats.service_us / n,
+			turn_stats.service_max, (double) turn_stats.writes / n);
+}
+
+// A player left or failed: the opponent is sent the board and a win.
+void match_drop(int epfd, struct nim_player *p) {
+	struct nim_match *m = p->match;
+	struct nim_player *other = &m->p[p == &m->p[0] ? 1 : 0];
+	int was_over = (m->state != MATCH_MOVE);
+	if (m->state == MATCH_DONE) return;
+	m->state = MATCH_OVER;
+	if (!was_over) m->winner = (other == &m->p[0]) ? 0 : 1;
+	timer_cancel(&timers, &m->clock);
+	if (!was_over) match_broadcast(epfd, m);
+	if (!was_over && other->src.fd >= 0) match_queue_turn(m, other, 'W');
+	match_close(epfd, p);
+	match_update(epfd, other);
+}
+
+// Close one player; once both are closed hand the match back to its host.
+void match_close(int epfd, struct nim_player *p) {
+	struct nim_match *m = p->match;
+	if (p->src.fd >= 0) {
+		ev_del(epfd, &p->src);
+		close(p->src.fd);
+		p->src.fd = -1;
+	}
+	if (m->state == MATCH_DONE) return;
+	if (m->p[0].src.fd >= 0 || m->p[1].src.fd >= 0) return;
+	m->state = MATCH_DONE;
+	m->p[0].src.kind = m->p[1].src.kind = SRC_DEAD;
+	metrics_count(M_GAMES_FINISHED);
+	metrics_record(H_GAME, now_us() - m->start_us);
+	match_log(m);
+	arena_free(&m->arena);
+	m->moves = NULL;
+	watch_end(epfd, &m->watchers);
+	if (m->done != NULL) m->done(m);
+}
+
+// Write a match into a hot restart record, but for its spectators, and put
+// the player sockets still open in fds. Returns the number of sockets.
+int match_save(struct nim_match *m, struct nim_frame *f, int *fds) {
+	char spec[NIM_SPEC_MAX];
+	long long left = -1;
+	int i, n = 0;
+	variant_spec(m->variant, spec);
+	frame_u16(f, strlen(spec));
+	frame_put(f, spec, strlen(spec));
+	frame_put(f, m->heaps.h, NIM_MAX_ROWS);
+	frame_u32(f, m->turn);
+	frame_u8(f, m->resigned);
+	frame_u8(f, m->winner + 1);
+	frame_u8(f, m->state);
+	frame_u8(f, m->timed_out);
+	frame_u32(f, m->turn_us >> 32);
+	frame_u32(f, m->turn_us & 0xFFFFFFFF);
+	frame_u32(f, m->start_us >> 32);
+	frame_u32(f, m->start_us & 0xFFFFFFFF);
+	frame_u32(f, m->start_ms >> 32);
+	frame_u32(f, m->start_ms & 0xFFFFFFFF);
+	if (m->clock.pprev != NULL && (left = m->clock.expires - now_ms()) < 0) left = 0;
+	frame_u32(f, left < 0 ? 0xFFFFFFFF : left); // move clock left, if running
+	frame_u16(f, m->nmoves);
+	frame_put(f, m->moves, 2 * m->nmoves);
+	for (i = 0; i < 2; i++) {
+		struct nim_player *p = &m->p[i];
+		frame_str(f, p->handle);
+		frame_u8(f, p->bot);
+		frame_u8(f, p->version);
+		frame_u8(f, p->src.fd >= 0);
+		frame_u8(f, p->have);
+		frame_put(f, &p->move, sizeof(struct nim_move));
+		frame_u16(f, p->in.len - p->in.off);
+		frame_put(f, p->in.data + p->in.off, p->in.len - p->in.off);
+		frame_u16(f, p->out.len - p->out.off);
+		frame_put(f, p->out.data + p->out.off, p->out.len - p->out.off);
+		if (p->src.fd >= 0) fds[n++] = p->src.fd;
+	}
+	return n;
+}
+
+// Rebuild a match from a hot restart record and put it on the event loop
+// with the sockets it was sent. Nothing is written until the loop finds the
+// sockets writable. The caller sets done and owner, and closes the
+// sockets if NULL is returned.
+struct nim_match *match_restore(int epfd, struct nim_cursor *c, int *fds, int nfds) {
+	struct nim_match *m = slab_alloc(&match_slab);
+	char spec[NIM_SPEC_MAX];
+	unsigned left, len;
+	int i, n = 0, variant, mover;
+	if (m == NULL) return NULL;
+	if ( (len = get_u16(c)) >= NIM_SPEC_MAX ) c->bad = 1;
+	frame_get(c, spec, len < NIM_SPEC_MAX ? len : 0);
+	spec[len < NIM_SPEC_MAX ? len : 0] = '\0';
+	variant = variant_parse(spec);
+	m->variant = &nim_variants[variant < 0 ? 0 : variant];
+	frame_get(c, m->heaps.h, NIM_MAX_ROWS);
+	m->turn = get_u32(c);
+	m->resigned = get_u8(c);
+	m->winner = (int) get_u8(c) - 1;
+	m->state = get_u8(c);
+	m->timed_out = get_u8(c);
+	m->turn_us = (long long) get_u32(c) << 32;
+	m->turn_us |= get_u32(c);
+	m->start_us = (long long) get_u32(c) << 32;
+	m->start_us |= get_u32(c);
+	m->start_ms = (long long) get_u32(c) << 32;
+	m->start_ms |= get_u32(c);
+	left = get_u32(c);
+	m->nmoves = m->maxmoves = get_u16(c);
+	m->moves = arena_alloc(&m->arena, 2 * m->nmoves + 2);
+	frame_get(c, m->moves, m->moves ? 2 * m->nmoves : 0);
+	for (i = 0; i < 2; i++) {
+		struct nim_player *p = &m->p[i];
+		get_str(c, p->handle);
+		p->bot = get_u8(c);
+		p->version = get_u8(c);
+		p->src.fd = -1;
+		if (get_u8(c) && n < nfds) p->src.fd = fds[n++]; // still open
+		p->have = get_u8(c);
+		frame_get(c, &p->move, sizeof(struct nim_move));
+		if ( (p->in.len = get_u16(c)) > NIM_INBUF ) c->bad = 1;
+		frame_get(c, p->in.data, c->bad ? 0 : p->in.len);
+		if ( (p->out.len = get_u16(c)) > NIM_OUTBUF ) c->bad = 1;
+		frame_get(c, p->out.data, c->bad ? 0 : p->out.len);
+		p->src.kind = SRC_PLAYER;
+		p->match = m;
+	}
+	if (c->bad || m->moves == NULL || n != nfds
+			|| (m->state != MATCH_MOVE && m->state != MATCH_OVER)) {
+		arena_free(&m->arena);
+		slab_free(&match_slab, m);
+		return NULL;
+	}
+	m->epfd = epfd;
+	mover = (m->turn % 2 == 1) ? 0 : 1;
+	for (i = 0; i < 2; i++) {
+		struct nim_player *p = &m->p[i];
+		if (p->src.fd < 0) continue;
+		p->events = EPOLLRDHUP;
+		if (p->out.len > 0) p->events |= EPOLLOUT;
+		if (m->state == MATCH_MOVE && i == mover) p->events |= EPOLLIN;
+		if (ev_add(epfd, &p->src, p->events) < 0) {
+			if (i == 1 && m->p[0].src.fd >= 0) ev_del(epfd, &m->p[0].src);
+			arena_free(&m->arena);
+			slab_free(&match_slab, m);
+			return NULL;
+		}
+	}
+	if (m->state == MATCH_MOVE && left != 0xFFFFFFFF)
+		timer_arm(&timers, &m->clock, left, match_timeout);
+	return m;
+}
+
+// Append a finished game to the game log, if it is open.
+void match_log(struct nim_match *m) {
+	struct nim_frame f;
+	struct nim_eval e;
+	int size = 80 + 2 * m->nmoves;
+	unsigned char *buf;
+	if (game_log.seg == NULL || (buf = arena_alloc(&m->arena, size)) == NULL) return;
+	eval_position(&m->heaps, &e);
+	frame_begin(&f, buf, size, LOG_GAME);
+	frame_u32(&f, m->start_ms >> 32);
+	frame_u32(&f, m->start_ms & 0xFFFFFFFF);
+	frame_u32(&f, (now_us() - m->start_us) / 1000);
+	frame_u8(&f, m->winner + 1);
+	frame_u8(&f, m->timed_out ? LOG_TIMED_OUT : m->resigned ? LOG_RESIGNED
+			: e.empty ? LOG_EMPTIED : LOG_DROPPED);
+	frame_str(&f, m->p[0].handle);
+	frame_str(&f, m->p[1].handle);
+	frame_str(&f, m->variant->name);
+	frame_u16(&f, m->nmoves);
+	frame_put(&f, m->moves, 2 * m->nmoves);
+	if ( (size = frame_end(&f)) > 0 ) log_append(&game_log, buf, size);
+}
+
+// The mover's clock ran out: they forfeit as though they had resigned.
+void match_timeout(struct nim_timer *t) {
+	struct nim_match *m = TIMER_OWNER(t, struct nim_match, clock);
+	if (m->state != MATCH_MOVE) return;
+	metrics_count(M_MOVE_TIMEOUTS);
+	m->timed_out = 1;
+	match_play(m->epfd, m, 0, 0);
+}
+
+#endif
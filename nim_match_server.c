@@ -1,170 +1,244 @@
-// CS415 Project #4: nim_match_server.c
-// Gavin Cabbage - gavincabbage@gmail.com
-
-// Compile: gcc -o nim_match_server nim_match_server.c (use Makefile!)
-// Invoke: $ nim_match_server (intended to be initialized by nim_server only!)
-
-// Exit Codes:
-// <0> Successful termination
-// <1> Argument error, expects none
-// <2> Environment not found
-// <3> Problem sending handles to client
-// <4> Problem communicating with client
-
-#include "nim.h"
-
-// Global variables and function prototypes.
-char handle1[20];
-char handle2[20];
-char init[] = {'O','X','X','X','X','X','X',
-               'O','O','O','X','X','X','X',
-			   'O','O','O','O','O','X','X',
-			   'O','O','O','O','O','O','O'};
-int sock1;
-int sock2;
-struct nim_board *board;
-
-void update_board(int row, int col);
-int game_over();
-void error(int code);
-
-int main(int argc, char *argv[]) { /////////////////////////////////////////////
-
-	// Check for erroneous input arguments and get environment variables.
-	if (argc != 1) error(1);
-	char *env;
-	if ( (env = getenv("H1")) == NULL ) error(2);
-	else strcpy(handle1, env);
-	if ( (env = getenv("H2")) == NULL ) error(2);
-	else strcpy(handle2, env);
-	sock1 = MATCH_SOCK_1;
-	sock2 = MATCH_SOCK_2;
-
-	// Send handles to players to indicate the match has begun.
-	struct nim_msg *handle_msg1 = malloc(sizeof(struct nim_msg));
-	struct nim_msg *handle_msg2 = malloc(sizeof(struct nim_msg));
-	handle_msg1->type = handle_msg2->type = 'R';
-	strcpy(handle_msg1->data, handle1);
-	strcpy(handle_msg2->data, handle2);
-	// send to first player
-	if (s_send(sock1, (void *) handle_msg1, sizeof(struct nim_msg)) < 0)
-		error(3);
-	if (s_send(sock1, (void *) handle_msg2, sizeof(struct nim_msg)) < 0)
-		error(3);
-	// send to second player
-	if (s_send(sock2, (void *) handle_msg1, sizeof(struct nim_msg)) < 0)
-		error(3);
-	if (s_send(sock2, (void *) handle_msg2, sizeof(struct nim_msg)) < 0)
-		error(3);
-
-	// Enter game loop.
-	board = malloc(sizeof(struct nim_board));
-	strcpy(board->board, init); // set board to initial config
-	struct nim_msg *message = malloc(sizeof(struct nim_msg));
-	struct nim_move *move = malloc(sizeof(struct nim_move));
-	int turn = 1; // if odd, p1's turn; if even: p2's turn
-	int resigned = 0; // indicate last player to move resigned
-	for ( ; ; ) {
-
-		// Send the current board to both players.
-		if (s_send(sock1, (void *) board, sizeof(struct nim_board)) < 0)
-			error(4);
-		if (s_send(sock2, (void *) board, sizeof(struct nim_board)) < 0)
-			error(4);
-		
-		// Check for a winner, notify clients and break if so.
-		if ( (game_over()) || (resigned) ) {
-			int winner, loser;
-			if (turn % 2 == 1) { loser = sock2; winner = sock1; }
-			else { loser = sock1; winner = sock2; }
-			// last player to move is loser
-			memset(message, 0, sizeof(struct nim_msg));
-			message->type = 'L';
-			if (s_send(loser, (void *) message, sizeof(struct nim_msg)) < 0)
-				error(4);
-			// other player is winner
-			memset(message, 0, sizeof(struct nim_msg));
-			message->type = 'W';
-			if (s_send(winner, (void *) message, sizeof(struct nim_msg)) < 0)
-				error(4);
-			break;
-		}
-		
-		// Request and receive move from appropriate player.
-		memset(message, 0, sizeof(struct nim_msg));
-		if (turn % 2 == 1) { // player1's turn
-			// request move
-			message->type = 'A';
-			if (s_send(sock1, (void *) message, sizeof(struct nim_msg)) < 0)
-				error(4);
-			// dummy send to other player
-			message->type = 'Z';
-			if (s_send(sock2, (void *) message, sizeof(struct nim_msg)) < 0)
-				error(4);
-			// receive move
-			memset(move, 0, sizeof(struct nim_move));
-			if (s_recv(sock1, (void *) move, sizeof(struct nim_move)) < 0)
-				error(4);
-		} else { // player2's turn
-			// request move
-			message->type = 'A';
-			if (s_send(sock2, (void *) message, sizeof(struct nim_msg)) < 0)
-				error(4);
-			// dummy send to other player
-			message->type = 'Z';
-			if (s_send(sock1, (void *) message, sizeof(struct nim_msg)) < 0)
-				error(4);
-			// receive move
-			memset(move, 0, sizeof(struct nim_move));
-			if (s_recv(sock2, (void *) move, sizeof(struct nim_move)) < 0)
-				error(4);
-		}
-
-		// Update the board with the given move.
-		update_board(move->row - '0', move->col - '0');
-		if (move->row == '0' && move->col == '0') resigned = 1;
-		turn += 1;
-	} // end game loop
-	
-	close(sock1); close(sock2);
-	exit(0);
-
-} // end main //////////////////////////////////////////////////////////////////
-
-// Update the board with given move.
-// Note: assumes a valid move, checked by client.
-void update_board(int row, int col) {
-	int start = (7 * (row - 1)) + col - 1;
-	int end = 7 * row;
-	int i;
-	for (i = start; i < end; i++) {
-		board->board[i] = 'X';
-	}
-}
-
-// Check for a winner, i.e. all stones removed.
-int game_over() {
-	int i;
-	for (i = 0; i < 28; i++) {
-		if (board->board[i] == 'O') return 0;
-	}
-	return 1;
-}
-
-// Print appropriate error message and exit.
-void error(int code) {
-	switch(code) {
-	case 1:
-		fprintf(stderr, "nim_match_server: argument error: exit 1\n");
-		exit(1); break;
-	case 2:
-		fprintf(stderr, "nim_match_server: environment not found: exit 2\n");
-		exit(2); break;
-	case 3:
-		fprintf(stderr, "nim_match_server: problem sending handles to client: exit 3\n");
-		exit(3); break;
-	case 4:
-		fprintf(stderr, "nim_match_server: problem communicating with client: exit 4\n");
-		exit(4); break;
-	}
-}
+// CS415 Project #4: nim_match_server.c
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Compile: gcc -o nim_match_server nim_match_server.c (use Makefile!)
+// Invoke: $ nim_match_server {-w} (intended to be initialized by nim_server only!)
+//   no arguments: play one game between the sockets on MATCH_SOCK_1 and
+//       MATCH_SOCK_2, with handles from the H1 and H2 environment variables
+//       and protocol versions from V1 and V2 (default 1), on the board
+//       variant whose spec is in VARIANT (default classic)
+//   -w  run as a pool worker: receive player sockets over the control
+//       socket on MATCH_SOCK_1 and play any number of games, one after
+//       another or at the same time
+// Either way spectators arrive over the control socket, which for a single
+// game is on MATCH_SOCK_3, and each game's result goes back over it. Games
+// are counted in the metrics region whose descriptor is in NIM_METRICS, if
+// set, and logged to the game log in the directory named by NIM_LOG, if
+// set. A player who takes longer than NIM_MOVE_CLOCK ms, if set, to move
+// forfeits.
+
+// Exit Codes:
+// <0> Successful termination
+// <1> Argument error, expects none or -w
+// <2> Environment not found
+// <3> Problem sending handles to client
+// <4> Problem communicating with client
+// <5> Problem with epoll
+
+#include "nim.h"
+#include "nim_event.h"
+#include "nim_match.h"
+
+// Global variables and function prototypes.
+char handle1[20];
+char handle2[20];
+int sock1;
+int sock2;
+int epfd; // epoll instance
+int worker_mode = 0; // pool worker taking games over the control socket
+int control_sock = -1; // control socket to nim_server, -1 once closed
+int live = 0; // games in progress
+struct nim_match **games; // games in progress, for spectators to find
+int maxgames;
+struct nim_source control_src;
+
+void start_game(char *h1, char *h2, int v1, int v2, char *spec, int s1,
+		int s2, unsigned id);
+void game_done(struct nim_match *m);
+void handle_control();
+void watch_match(struct nim_match_assign *assign, int sock);
+void error(int code);
+
+int main(int argc, char *argv[]) { /////////////////////////////////////////////
+
+	// Check for erroneous input arguments and get environment variables.
+	if (argc == 2 && strcmp(argv[1], "-w") == 0) worker_mode = 1;
+	else if (argc != 1) error(1);
+	if ( (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) error(5);
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) error(4);
+	char *metrics_env = getenv("NIM_METRICS");
+	if (metrics_env != NULL && metrics_attach(atoi(metrics_env)) == 0) {
+		fcntl(metrics_fd, F_SETFD, FD_CLOEXEC);
+		metrics_claim();
+	}
+	char *log_env = getenv("NIM_LOG");
+	if (log_env != NULL && log_open(&game_log, log_env) < 0)
+		fprintf(stderr, "nim_match_server: game log unavailable\n");
+	char *clock_env = getenv("NIM_MOVE_CLOCK");
+	if (clock_env != NULL) move_clock = atoi(clock_env);
+	timer_init(&timers);
+
+	control_sock = worker_mode ? MATCH_SOCK_1 : MATCH_SOCK_3;
+	if (fcntl(control_sock, F_SETFD, FD_CLOEXEC) < 0) control_sock = -1;
+	else { // take games or spectators from nim_server
+		set_nonblock(control_sock, 1);
+		control_src.kind = SRC_CONTROL;
+		control_src.fd = control_sock;
+		if (ev_add(epfd, &control_src, EPOLLIN) < 0) error(5);
+	}
+	if (worker_mode && control_sock < 0) error(2);
+	if (!worker_mode) { // play the one game we were exec'd for
+		char *env;
+		if ( (env = getenv("H1")) == NULL ) error(2);
+		else strcpy(handle1, env);
+		if ( (env = getenv("H2")) == NULL ) error(2);
+		else strcpy(handle2, env);
+		int version1 = (env = getenv("V1")) ? atoi(env) : 1;
+		int version2 = (env = getenv("V2")) ? atoi(env) : 1;
+		sock1 = MATCH_SOCK_1;
+		sock2 = MATCH_SOCK_2;
+		start_game(handle1, handle2, version1, version2, getenv("VARIANT"),
+				sock1, sock2, 0);
+	}
+
+	// Enter event loop, running every game until the last one ends and no
+	// more can arrive, then giving slow spectators a while to catch up.
+	struct epoll_event events[NIM_MAX_EVENTS];
+	int active, i, timeout;
+	long long linger = 0; // when to stop waiting on spectators
+	for ( ; ; ) {
+		if (live == 0 && (!worker_mode || control_sock < 0)) {
+			if (linger == 0) linger = now_ms() + NIM_WATCH_LINGER;
+			if (watch_live == 0 || now_ms() >= linger) break;
+		}
+		timeout = timer_timeout(&timers, now_ms());
+		if (live == 0 && (timeout < 0 || timeout > 100)) timeout = 100;
+		active = epoll_wait(epfd, events, NIM_MAX_EVENTS, timeout);
+		if (active < 0) {
+			if (errno == EINTR) continue;
+			error(5);
+		}
+		for (i = 0; i < active; i++) {
+			struct nim_source *src = events[i].data.ptr;
+			switch (src->kind) {
+			case SRC_CONTROL: handle_control(); break;
+			case SRC_PLAYER:
+				match_event(epfd, (struct nim_player *) src, events[i].events);
+				break;
+			case SRC_WATCHER:
+				watch_event(epfd, (struct nim_watcher *) src, events[i].events);
+				break;
+			}
+		}
+		timer_advance(&timers, now_ms());
+		ev_reap();
+	} // end event loop
+
+	match_print_stats("nim_match_server");
+	alloc_print_stats("nim_match_server");
+	metrics_release(getpid());
+	exit(0);
+
+} // end main //////////////////////////////////////////////////////////////////
+
+// Start a game between two player sockets, on the variant with the given
+// spec or else the classic board.
+void start_game(char *h1, char *h2, int v1, int v2, char *spec, int s1,
+		int s2, unsigned id) {
+	int variant = (spec != NULL && spec[0] != '\0') ? variant_parse(spec) : 0;
+	struct nim_match *m = slab_alloc(&match_slab);
+	if (m == NULL) { // turn the game away
+		close(s1); close(s2);
+		if (!worker_mode) error(3);
+		return;
+	}
+	strncpy(m->p[0].handle, h1, 19);
+	strncpy(m->p[1].handle, h2, 19);
+	m->p[0].version = v1;
+	m->p[1].version = v2;
+	m->variant = &nim_variants[variant < 0 ? 0 : variant];
+	m->done = game_done;
+	m->owner = (void *) (unsigned long) id;
+	set_nonblock(s1, 1);
+	set_nonblock(s2, 1);
+	if (live == maxgames) {
+		maxgames = maxgames ? 2 * maxgames : 16;
+		games = realloc(games, maxgames * sizeof(struct nim_match *));
+	}
+	games[live++] = m;
+	if (match_start(epfd, m, s1, s2) < 0) {
+		if (worker_mode) { // drop this game, keep serving others
+			close(s1); close(s2);
+			m->p[0].src.fd = m->p[1].src.fd = -1;
+			game_done(m);
+		} else error(3);
+	}
+}
+
+// Report a finished game to nim_server, for its registry and its ratings,
+// and free it.
+void game_done(struct nim_match *m) {
+	int i;
+	for (i = 0; i < live && games[i] != m; i++) ;
+	if (i < live) games[i] = games[--live];
+	if (control_sock >= 0) {
+		struct nim_match_result result;
+		memset(&result, 0, sizeof(result));
+		result.id = (unsigned) (unsigned long) m->owner;
+		result.winner = m->winner + 1;
+		send(control_sock, &result, sizeof(result), MSG_NOSIGNAL);
+	}
+	ev_retire(&match_slab, m);
+}
+
+// Receive games and spectators from nim_server; stop taking games once it
+// is gone.
+void handle_control() {
+	struct nim_match_assign assign;
+	int fds[8], nfds, num, i;
+	for ( ; ; ) {
+		num = recv_fds(control_sock, &assign, sizeof(assign), fds, &nfds);
+		if (num < 0 && (errno == EAGAIN || errno == EINTR)) return;
+		if (num <= 0) { // nim_server closed the pool, finish live games
+			ev_del(epfd, &control_src);
+			close(control_sock);
+			control_sock = -1;
+			return;
+		}
+		if (num == sizeof(assign) && assign.watch && nfds == 1) {
+			watch_match(&assign, fds[0]);
+			continue;
+		}
+		if (num != sizeof(assign) || nfds != 2 || !worker_mode) {
+			for (i = 0; i < nfds; i++) close(fds[i]);
+			continue;
+		}
+		assign.handle1[19] = assign.handle2[19] = '\0';
+		assign.variant[NIM_SPEC_MAX - 1] = '\0';
+		start_game(assign.handle1, assign.handle2, assign.version1,
+				assign.version2, assign.variant, fds[0], fds[1], assign.id);
+	}
+}
+
+// Add a spectator to the game it was sent for: the game with its id, or
+// the one game of a match server playing a single game.
+void watch_match(struct nim_match_assign *assign, int sock) {
+	int i;
+	for (i = 0; i < live; i++)
+		if (!worker_mode || (unsigned) (unsigned long) games[i]->owner == assign->id) break;
+	set_nonblock(sock, 1);
+	if (i == live || games[i]->state == MATCH_DONE
+			|| match_watch(epfd, games[i], sock) < 0)
+		close(sock);
+}
+
+// Print appropriate error message and exit.
+void error(int code) {
+	switch(code) {
+	case 1:
+		fprintf(stderr, "nim_match_server: argument error: exit 1\n");
+		exit(1); break;
+	case 2:
+		fprintf(stderr, "nim_match_server: environment not found: exit 2\n");
+		exit(2); break;
+	case 3:
+		fprintf(stderr, "nim_match_server: problem sending handles to client: exit 3\n");
+		exit(3); break;
+	case 4:
+		fprintf(stderr, "nim_match_server: problem communicating with client: exit 4\n");
+		exit(4); break;
+	case 5:
+		fprintf(stderr, "nim_match_server: problem with epoll: exit 5\n");
+		exit(5); break;
+	}
+}
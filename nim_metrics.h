@@ -0,0 +1,216 @@
+// CS415 Project #4: nim_metrics.h (live metrics)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Counters and latency histograms kept in shared memory, so every process
+// of the server counts into one place and any lobby reports the totals. The
+// region is a memfd that nim_server creates before forking anything; an
+// exec'd match server finds it through NIM_METRICS=fd in its environment.
+// Each process claims a slot of its own, cache line aligned and written by
+// no other process, so counting is an uncontended atomic add that never
+// waits on a lock. Should every slot be taken, processes share one by pid,
+// which the atomic adds keep correct. Histograms are HDR style: a value in
+// microseconds falls in one of 8 linear sub-buckets of its power of two, so
+// it is known to within 12.5%. Reports are in the Prometheus text format,
+// summed over every slot.
+
+#ifndef NIM_METRICS_H
+#define NIM_METRICS_H
+
+#define NIM_METRICS_SLOTS 64
+#define NIM_HIST_SUB 8 // linear sub-buckets per power of two
+#define NIM_HIST_BUCKETS 320 // up to 2^41 us, about 25 days
+#define NIM_METRICS_TEXT 16384 // longest report
+#define NIM_METRICS_FD_MIN 10 // lowest descriptor for the region
+
+// Counters.
+enum {
+	M_ACCEPTS, // play connections accepted
+	M_BAD_PASSWORDS, // handshakes refused with <X> or REJECT_PASSWORD
+	M_QUERIES, // query datagrams received
+	M_GAMES_STARTED,
+	M_GAMES_FINISHED,
+	M_MOVES,
+	M_WATCHERS, // spectators attached to a match
+	M_WATCH_DROPPED, // board updates a slow spectator never got
+	M_HANDSHAKE_TIMEOUTS, // connections closed mid-handshake
+	M_IDLE_EVICTIONS, // queued players closed unpaired
+	M_MOVE_TIMEOUTS, // games forfeited on the move clock
+	M_REDIRECTS, // players sent to the node owning their handle
+	M_RELAYS, // lone players relayed to pair on another node
+	M_ALLOC_MALLOCS, // chunks the slab and arena allocators took from malloc
+	M_COUNTERS
+};
+
+// Histograms.
+enum {
+	H_HANDSHAKE, // accept to queued for pairing
+	H_PAIRING, // queued to paired
+	H_TURNAROUND, // turn written to the mover's move read
+	H_GAME, // game start to both players closed
+	H_HISTOGRAMS
+};
+
+struct nim_hist {
+	unsigned long long sum; // microseconds
+	unsigned long long bucket[NIM_HIST_BUCKETS];
+};
+
+// One process's counts.
+struct nim_metrics {
+	int owner; // pid counting into this slot, 0 if free
+	unsigned long long counter[M_COUNTERS];
+	struct nim_hist hist[H_HISTOGRAMS];
+} __attribute__((aligned(64)));
+
+struct nim_metrics_region {
+	struct nim_metrics slot[NIM_METRICS_SLOTS];
+};
+
+char *metrics_names[M_COUNTERS][2] = {
+	{"nim_accepts_total", "Play connections accepted."},
+	{"nim_bad_passwords_total", "Handshakes refused for a bad password."},
+	{"nim_queries_total", "Query datagrams received."},
+	{"nim_games_started_total", "Games started."},
+	{"nim_games_finished_total", "Games finished, including abandoned ones."},
+	{"nim_moves_total", "Moves played, including the bot's."},
+	{"nim_spectators_total", "Spectators attached to a match."},
+	{"nim_spectator_dropped_total", "Board updates skipped for slow spectators."},
+	{"nim_handshake_timeouts_total", "Connections closed for not finishing the handshake in time."},
+	{"nim_idle_evictions_total", "Queued players closed for waiting too long unpaired."},
+	{"nim_move_timeouts_total", "Games forfeited by a player out of time to move."},
+	{"nim_redirects_total", "Players redirected to the node owning their handle."},
+	{"nim_relays_total", "Lone players relayed to pair with a player on another node."},
+	{"nim_alloc_mallocs_total", "Chunks the slab and arena allocators took from malloc."}
+};
+char *hist_names[H_HISTOGRAMS][2] = {
+	{"nim_handshake_seconds", "Time from accept to being queued for pairing."},
+	{"nim_pairing_wait_seconds", "Time spent queued before pairing."},
+	{"nim_move_turnaround_seconds", "Time from writing a turn to reading the move."},
+	{"nim_game_duration_seconds", "Time from a game's start to its end."}
+};
+
+struct nim_metrics_region *metrics_region; // NULL if there is none
+struct nim_metrics *metrics; // this process's slot, NULL if not counting
+int metrics_fd = -1;
+
+// Map the region created by nim_server.
+int metrics_attach(int fd) {
+	void *region = mmap(NULL, sizeof(struct nim_metrics_region),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (region == MAP_FAILED) return -1;
+	metrics_region = region;
+	metrics_fd = fd;
+	return 0;
+}
+
+// Create the shared region; exec'd children inherit its descriptor, which
+// is kept clear of the well known ones a match server is handed.
+int metrics_create() {
+	int fd, high;
+	if ( (fd = memfd_create("nim_metrics", 0)) < 0 ) return -1;
+	if (ftruncate(fd, sizeof(struct nim_metrics_region)) < 0) return -1;
+	if ( (high = fcntl(fd, F_DUPFD, NIM_METRICS_FD_MIN)) < 0 ) return -1;
+	close(fd);
+	return metrics_attach(high);
+}
+
+// Claim a free slot for this process, or share one if none is free.
+void metrics_claim() {
+	int i, none, pid = getpid();
+	if (metrics_region == NULL) return;
+	for (i = 0; i < NIM_METRICS_SLOTS; i++) {
+		none = 0;
+		if (__atomic_compare_exchange_n(&metrics_region->slot[i].owner, &none,
+				pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+	}
+	metrics = &metrics_region->slot[i < NIM_METRICS_SLOTS ? i : pid % NIM_METRICS_SLOTS];
+}
+
+// Give up the slot held by a process, which has exited or is about to. Its
+// counts stay and the next owner adds to them.
+void metrics_release(int pid) {
+	int i;
+	if (metrics_region == NULL) return;
+	for (i = 0; i < NIM_METRICS_SLOTS; i++) {
+		int owner = pid;
+		__atomic_compare_exchange_n(&metrics_region->slot[i].owner, &owner, 0,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	}
+}
+
+// Count events.
+void metrics_add(int counter, long long n) {
+	if (metrics != NULL)
+		__atomic_fetch_add(&metrics->counter[counter], n, __ATOMIC_RELAXED);
+}
+void metrics_count(int counter) {
+	metrics_add(counter, 1);
+}
+
+// Histogram bucket of a value, and the smallest value in a bucket.
+int hist_bucket(unsigned long long us) {
+	int power;
+	if (us < NIM_HIST_SUB) return us;
+	power = 63 - __builtin_clzll(us); // at least 3
+	if (power > NIM_HIST_BUCKETS / NIM_HIST_SUB + 1) return NIM_HIST_BUCKETS - 1;
+	return NIM_HIST_SUB * (power - 2) + ((us >> (power - 3)) & (NIM_HIST_SUB - 1));
+}
+unsigned long long hist_low(int bucket) {
+	int power = bucket / NIM_HIST_SUB + 2;
+	if (bucket < NIM_HIST_SUB) return bucket;
+	return (unsigned long long) (NIM_HIST_SUB + bucket % NIM_HIST_SUB) << (power - 3);
+}
+
+// Record a latency.
+void metrics_record(int hist, long long us) {
+	struct nim_hist *h;
+	if (metrics == NULL) return;
+	if (us < 0) us = 0;
+	h = &metrics->hist[hist];
+	__atomic_fetch_add(&h->bucket[hist_bucket(us)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+}
+
+// Write the totals of every slot as Prometheus text, returning its length.
+// Histogram buckets are reported at powers of two, from the first holding
+// a value to the first holding them all.
+int metrics_report(char *text, int cap) {
+	struct nim_hist total;
+	unsigned long long count, seen, all;
+	int len = 0, i, j, b;
+	if (metrics_region == NULL) return 0;
+	for (i = 0; i < M_COUNTERS; i++) {
+		for (count = 0, j = 0; j < NIM_METRICS_SLOTS; j++)
+			count += __atomic_load_n(&metrics_region->slot[j].counter[i], __ATOMIC_RELAXED);
+		len += snprintf(text + len, len < cap ? cap - len : 0,
+				"# HELP %s %s\n# TYPE %s counter\n%s %llu\n", metrics_names[i][0],
+				metrics_names[i][1], metrics_names[i][0], metrics_names[i][0], count);
+	}
+	for (i = 0; i < H_HISTOGRAMS; i++) {
+		char *name = hist_names[i][0];
+		memset(&total, 0, sizeof(total));
+		for (j = 0; j < NIM_METRICS_SLOTS; j++) {
+			struct nim_hist *h = &metrics_region->slot[j].hist[i];
+			for (b = 0; b < NIM_HIST_BUCKETS; b++)
+				total.bucket[b] += __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+			total.sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+		}
+		for (all = 0, b = 0; b < NIM_HIST_BUCKETS; b++) all += total.bucket[b];
+		len += snprintf(text + len, len < cap ? cap - len : 0,
+				"# HELP %s %s\n# TYPE %s histogram\n", name, hist_names[i][1], name);
+		for (seen = 0, b = 0; b < NIM_HIST_BUCKETS && seen < all; b++) {
+			seen += total.bucket[b];
+			while (b < NIM_HIST_BUCKETS - 1 && (b + 1) % NIM_HIST_SUB != 0)
+				seen += total.bucket[++b]; // to the end of its power of two
+			if (seen == 0) continue;
+			len += snprintf(text + len, len < cap ? cap - len : 0,
+					"%s_bucket{le=\"%g\"} %llu\n", name, hist_low(b + 1) / 1e6, seen);
+		}
+		len += snprintf(text + len, len < cap ? cap - len : 0,
+				"%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n", name,
+				all, name, total.sum / 1e6, name, all);
+	}
+	return len < cap ? len : cap - 1;
+}
+
+#endif
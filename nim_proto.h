@@ -0,0 +1,239 @@
+// CS415 Project #4: nim_proto.h (protocol v2)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Protocol v2: every message is a frame, a 16 bit length in network byte
+// order counting the bytes after it, then a one byte type and the payload.
+// Integers are in network byte order and strings are a length byte and at
+// most 19 characters; the board travels in its packed 4 byte form.
+//
+// A v2 client opens with HELLO, whose first byte is 0 since frames are
+// short, while an old client opens with a <P> nim_msg, so the lobby tells
+// them apart by the first byte and keeps speaking the fixed size structs of
+// nim.h to old clients. Frames are buffered and taken off as they complete,
+// so either side may send several in one write: a client sends HELLO and
+// JOIN together without waiting for WELCOME, and a match sends START with
+// the first TURN. A MOVE names the turn it answers, so a late or repeated
+// move is recognized and ignored. A query is a single QUERY frame in a
+// datagram, answered by a LOBBY frame; a METRICS frame is answered the same
+// way by a REPORT frame, a STANDINGS frame for the tournament by a TABLE
+// frame, and RANK and TOP frames for the ratings by RATING and LEADERS
+// frames.
+
+#ifndef NIM_PROTO_H
+#define NIM_PROTO_H
+
+#define NIM_VERSION 2 // highest protocol version spoken
+#define NIM_FRAME_HEAD 3 // length and type
+#define NIM_INBUF 256 // buffered input per stream, the largest frame taken
+
+// Frame types.
+enum {
+	FRAME_HELLO = 1, // nim -> server: u8 version, str password
+	FRAME_WELCOME, // server -> nim: u8 version agreed
+	FRAME_REJECT, // server -> nim: u8 reason, then the server closes
+	FRAME_JOIN, // nim -> server: str handle, optional str variant
+	FRAME_START, // match -> nim: u8 seat (1 or 2), str handle1, str handle2,
+		// str variant, u8 misere (1 if taking the last stone loses, 0
+		// if it wins)
+	FRAME_TURN, // match -> nim: u16 turn, u32 board, u8 status, then for
+		// any variant but the classic one u8 rows and a count for each row
+	FRAME_MOVE, // nim -> match: u16 turn, u8 row, u8 col (0 0 resigns)
+	FRAME_QUERY, // nim -> server datagram: str password
+	FRAME_LOBBY, // server -> nim datagram: u32 inprog, str waiting, u16 games,
+		// then str handle1, str handle2 for each game
+	FRAME_METRICS, // nim -> server datagram: str password
+	FRAME_REPORT, // server -> nim datagram: the server's metrics as Prometheus
+		// text, filling the rest of the frame
+	FRAME_WATCH, // nim -> server: str handle, in place of JOIN, to spectate
+		// the game that player is in; answered with START for seat 0
+		// and then TURN frames as player 1 sees them
+	FRAME_REDIRECT, // server -> nim: u8 node, in place of START, naming
+		// the node in nim.conf to JOIN or WATCH on instead; the server
+		// closes (see nim_cluster.h)
+	FRAME_RELAY, // node -> node: str handle, in place of JOIN, for a player
+		// waiting on one node and relayed to pair on another
+	FRAME_GOSSIP, // node -> node datagram: str password, u8 node, u32 epoch
+		// high, u32 epoch low, u32 heartbeat, u32 inprog, u32 load, str
+		// waiting, str lone, u16 length and the games string
+	FRAME_STANDINGS, // nim -> server datagram: str password, optional u32
+		// first rank wanted, counted from 0
+	FRAME_TABLE, // server -> nim datagram: u8 format, u8 finished, u32
+		// entrants, u32 played, u32 playing, u32 first, u16 rows, then
+		// str handle, u16 wins, u16 losses, u8 status for each entrant
+		// in standings order (see nim_tourney.h)
+	FRAME_RANK, // nim -> server datagram: str password, str handle
+	FRAME_RATING, // server -> nim datagram: str handle, u32 rating, u32 rank
+		// counted from 1 or 0 if not rated, u32 players rated, u32
+		// games, u32 wins
+	FRAME_TOP, // nim -> server datagram: str password, optional u32 first
+		// rank wanted, counted from 0
+	FRAME_LEADERS // server -> nim datagram: u32 players rated, u32 first,
+		// u16 rows, then str handle, u32 rating, u32 games, u32 wins for
+		// each player in rating order (see nim_rating.h)
+};
+
+// TURN status: <A> your move, <Z> opponent's move, <W> win, <L> loss.
+
+// REJECT reasons.
+enum {
+	REJECT_PASSWORD = 1, // incorrect password
+	REJECT_VERSION, // no common protocol version
+	REJECT_PROTOCOL, // unexpected or malformed frame
+	REJECT_VARIANT, // unknown board variant
+	REJECT_WATCH // no game in progress for the handle to watch
+};
+
+// TABLE entrant statuses.
+enum {
+	TABLE_ABSENT, // not connected, next match to come
+	TABLE_WAITING, // connected, waiting for its next match
+	TABLE_PLAYING,
+	TABLE_OUT, // eliminated or withdrawn
+	TABLE_DONE // played every match, or won the bracket
+};
+
+// Frame under construction in a caller's buffer.
+struct nim_frame {
+	unsigned char *data;
+	int len; // bytes so far, past cap once overflowed
+	int cap;
+};
+
+// Buffered input of a frame stream.
+struct nim_inbuf {
+	int len; // bytes buffered
+	int off; // bytes already taken
+	unsigned char data[NIM_INBUF];
+};
+
+// Read position within one frame's payload.
+struct nim_cursor {
+	unsigned char *p;
+	int left;
+	int bad; // set once a read ran past the payload
+};
+
+// Build a frame: begin, append fields, then end to fill in its length.
+void frame_begin(struct nim_frame *f, void *buffer, int cap, int type) {
+	f->data = buffer;
+	f->cap = cap;
+	f->len = NIM_FRAME_HEAD;
+	if (cap >= NIM_FRAME_HEAD) f->data[2] = type;
+}
+void frame_put(struct nim_frame *f, void *src, int size) {
+	if (f->len + size <= f->cap) memcpy(f->data + f->len, src, size);
+	f->len += size;
+}
+void frame_u8(struct nim_frame *f, unsigned v) {
+	unsigned char c = v;
+	frame_put(f, &c, 1);
+}
+void frame_u16(struct nim_frame *f, unsigned v) {
+	uint16_t n = htons(v);
+	frame_put(f, &n, 2);
+}
+void frame_u32(struct nim_frame *f, uint32_t v) {
+	uint32_t n = htonl(v);
+	frame_put(f, &n, 4);
+}
+void frame_str(struct nim_frame *f, char *s) {
+	int n = strnlen(s, 19);
+	frame_u8(f, n);
+	frame_put(f, s, n);
+}
+
+// Finish a frame, returning its total size or -1 if it overflowed.
+int frame_end(struct nim_frame *f) {
+	if (f->len > f->cap || f->len - 2 > 0xFFFF) return -1;
+	f->data[0] = (f->len - 2) >> 8;
+	f->data[1] = (f->len - 2) & 0xFF;
+	return f->len;
+}
+
+// Read whatever the socket has into the buffer, first dropping frames
+// already taken. Returns bytes read, 0 if none were ready or the buffer is
+// full, -1 on error or end of stream.
+int frame_read(int sock, struct nim_inbuf *in) {
+	int num;
+	if (in->off > 0) {
+		memmove(in->data, in->data + in->off, in->len - in->off);
+		in->len -= in->off;
+		in->off = 0;
+	}
+	if (in->len == NIM_INBUF) return 0;
+	for ( ; ; ) {
+		num = read(sock, in->data + in->len, NIM_INBUF - in->len);
+		if (num == 0) return -1; // peer closed
+		if (num < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		in->len += num;
+		return num;
+	}
+}
+
+// Take the next complete frame off the buffer, pointing the cursor at its
+// payload. Returns its type, 0 if no complete frame is buffered, or -1 if
+// the next frame is malformed or larger than the buffer.
+int frame_next(struct nim_inbuf *in, struct nim_cursor *c) {
+	int avail = in->len - in->off, size, type;
+	if (avail < NIM_FRAME_HEAD) return 0;
+	size = (in->data[in->off] << 8 | in->data[in->off + 1]) + 2;
+	if (size < NIM_FRAME_HEAD || size > NIM_INBUF) return -1;
+	if (avail < size) return 0;
+	type = in->data[in->off + 2];
+	c->p = in->data + in->off + NIM_FRAME_HEAD;
+	c->left = size - NIM_FRAME_HEAD;
+	c->bad = 0;
+	in->off += size;
+	return type;
+}
+
+// Take the single frame making up a datagram. Returns its type, or -1 if
+// the datagram is not exactly one frame.
+int frame_datagram(void *buffer, int size, struct nim_cursor *c) {
+	unsigned char *d = buffer;
+	if (size < NIM_FRAME_HEAD || (d[0] << 8 | d[1]) + 2 != size) return -1;
+	c->p = d + NIM_FRAME_HEAD;
+	c->left = size - NIM_FRAME_HEAD;
+	c->bad = 0;
+	return d[2];
+}
+
+// Read payload fields; past the end of the payload they read as zero and
+// the cursor is marked bad.
+void frame_get(struct nim_cursor *c, void *dst, int size) {
+	if (c->bad || c->left < size) {
+		memset(dst, 0, size);
+		c->bad = 1;
+		return;
+	}
+	memcpy(dst, c->p, size);
+	c->p += size;
+	c->left -= size;
+}
+unsigned get_u8(struct nim_cursor *c) {
+	unsigned char v;
+	frame_get(c, &v, 1);
+	return v;
+}
+unsigned get_u16(struct nim_cursor *c) {
+	uint16_t v;
+	frame_get(c, &v, 2);
+	return ntohs(v);
+}
+uint32_t get_u32(struct nim_cursor *c) {
+	uint32_t v;
+	frame_get(c, &v, 4);
+	return ntohl(v);
+}
+void get_str(struct nim_cursor *c, char *s) { // s holds 20
+	int n = get_u8(c);
+	if (n > 19) { c->bad = 1; n = 0; }
+	frame_get(c, s, n);
+	s[n] = '\0';
+}
+
+#endif
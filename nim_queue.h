@@ -0,0 +1,153 @@
+// CS415 Project #4: nim_queue.h (matchmaking queue)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Matchmaking queue for waiting players. Players wait in FIFO order in a
+// bucket chosen by a pairing key (rating band, requested variant, ...), and
+// every waiting player is also on one lobby-wide FIFO so the longest wait is
+// always at its head. Entries are embedded in the caller's own structs, so
+// queueing allocates nothing and a player who leaves is unlinked in O(1).
+// Pairing is done in batches: buckets holding two or more players are kept
+// on a ready list and drained by queue_pair() once per loop pass.
+
+#ifndef NIM_QUEUE_H
+#define NIM_QUEUE_H
+
+#define NIM_QUEUE_HASH 256 // bucket hash table size
+
+struct nim_bucket;
+
+// Queue links, embedded in each waiting player.
+struct nim_qentry {
+	struct nim_qentry *prev, *next; // within the bucket
+	struct nim_qentry *older, *newer; // lobby-wide arrival order
+	struct nim_bucket *bucket; // NULL when not queued
+	long long since; // arrival time in ms
+};
+
+// Players waiting under one pairing key.
+struct nim_bucket {
+	int key;
+	int count;
+	int ready; // on the ready list
+	struct nim_qentry head; // sentinel of the bucket FIFO
+	struct nim_bucket *hnext; // hash chain
+	struct nim_bucket *rnext; // ready list
+};
+
+struct nim_queue {
+	int count; // players waiting in all buckets
+	struct nim_qentry order; // sentinel of the lobby-wide FIFO
+	struct nim_bucket *table[NIM_QUEUE_HASH];
+	struct nim_bucket *ready; // buckets with at least two waiting
+};
+
+void queue_init(struct nim_queue *q) {
+	memset(q, 0, sizeof(struct nim_queue));
+	q->order.older = q->order.newer = &q->order;
+}
+
+// Find or create the bucket for a key. Returns NULL if there is no memory.
+struct nim_bucket *queue_bucket(struct nim_queue *q, int key) {
+	unsigned h = (unsigned) key % NIM_QUEUE_HASH;
+	struct nim_bucket *b;
+	for (b = q->table[h]; b != NULL; b = b->hnext)
+		if (b->key == key) return b;
+	if ( (b = malloc(sizeof(struct nim_bucket))) == NULL ) return NULL;
+	memset(b, 0, sizeof(struct nim_bucket));
+	b->key = key;
+	b->head.prev = b->head.next = &b->head;
+	b->hnext = q->table[h];
+	q->table[h] = b;
+	return b;
+}
+
+// Add a player to the back of its bucket and of the lobby. Returns -1,
+// leaving it unqueued, if there is no memory for a new bucket.
+int queue_push(struct nim_queue *q, struct nim_qentry *e, int key, long long now) {
+	struct nim_bucket *b = queue_bucket(q, key);
+	if (b == NULL) return -1;
+	e->bucket = b;
+	e->since = now;
+	e->prev = b->head.prev; e->next = &b->head;
+	b->head.prev->next = e; b->head.prev = e;
+	e->older = q->order.older; e->newer = &q->order;
+	q->order.older->newer = e; q->order.older = e;
+	b->count += 1;
+	q->count += 1;
+	if (b->count >= 2 && !b->ready) {
+		b->ready = 1;
+		b->rnext = q->ready;
+		q->ready = b;
+	}
+	return 0;
+}
+
+// Unlink a player from the queue in O(1); a no-op if it is not queued.
+void queue_remove(struct nim_queue *q, struct nim_qentry *e) {
+	if (e->bucket == NULL) return;
+	e->prev->next = e->next; e->next->prev = e->prev;
+	e->older->newer = e->newer; e->newer->older = e->older;
+	e->bucket->count -= 1;
+	e->bucket = NULL;
+	q->count -= 1;
+}
+
+// The player who has waited longest, NULL if none.
+struct nim_qentry *queue_oldest(struct nim_queue *q) {
+	return q->order.newer == &q->order ? NULL : q->order.newer;
+}
+
+// The player who arrived next after another, NULL if none.
+struct nim_qentry *queue_newer(struct nim_queue *q, struct nim_qentry *e) {
+	return e->newer == &q->order ? NULL : e->newer;
+}
+
+// Move a player to the back of another key's bucket, keeping its place in
+// the lobby and its arrival time. Returns -1, leaving it where it was, if
+// there is no memory for a new bucket.
+int queue_rekey(struct nim_queue *q, struct nim_qentry *e, int key) {
+	struct nim_bucket *b = queue_bucket(q, key);
+	if (b == NULL) return -1;
+	e->prev->next = e->next; e->next->prev = e->prev;
+	e->bucket->count -= 1;
+	e->bucket = b;
+	e->prev = b->head.prev; e->next = &b->head;
+	b->head.prev->next = e; b->head.prev = e;
+	b->count += 1;
+	if (b->count >= 2 && !b->ready) {
+		b->ready = 1;
+		b->rnext = q->ready;
+		q->ready = b;
+	}
+	return 0;
+}
+
+// The only player waiting under a key, NULL unless exactly one is.
+struct nim_qentry *queue_lone(struct nim_queue *q, int key) {
+	struct nim_bucket *b = queue_bucket(q, key);
+	return b != NULL && b->count == 1 ? b->head.next : NULL;
+}
+
+// Pair off waiting players two at a time in arrival order, in every bucket
+// holding at least two. Returns the number of pairs made.
+int queue_pair(struct nim_queue *q,
+		void (*pair)(struct nim_qentry *, struct nim_qentry *)) {
+	struct nim_bucket *b;
+	struct nim_qentry *e1, *e2;
+	int pairs = 0;
+	while ( (b = q->ready) != NULL ) {
+		q->ready = b->rnext;
+		b->ready = 0;
+		while (b->count >= 2) {
+			e1 = b->head.next;
+			e2 = e1->next;
+			queue_remove(q, e1);
+			queue_remove(q, e2);
+			pair(e1, e2);
+			pairs += 1;
+		}
+	}
+	return pairs;
+}
+
+#endif
@@ -0,0 +1,359 @@
+// CS415 Project #4: nim_rating.h (player ratings)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Elo ratings by handle, updated as each game ends and kept in a file that
+// the server maps into memory and works on in place, so a restart reads
+// nothing: every player's record lives in the file, linked into a skip
+// list in rating order whose links are record numbers, not pointers, and
+// carry the number of ranks they pass over. That makes a player's rank,
+// the player at a rank, and an update, which takes the record out and puts
+// it back where its new rating belongs, all O(log n); a table of the top
+// players walks on from there. An open addressed hash, also in the file,
+// finds a handle's record. Every process of the server maps the same file
+// and takes an flock around each use of it; an update marks the file dirty
+// until it is done, so should a process die part way through, the next to
+// lock the file rebuilds the links and the hash from the records, which
+// are always whole. The file grows by doubling. A new player starts at
+// NIM_RATING_START.
+
+#ifndef NIM_RATING_H
+#define NIM_RATING_H
+
+#define NIM_RATING_START 1500
+#define NIM_RATING_K 32 // most a game moves a rating
+#define NIM_RATING_LEVELS 16 // skip list levels, enough for 4^16 players
+#define NIM_RATING_MIN 1024 // records in a new file
+#define NIM_RATING_MAGIC 0x4E494D52 // "NIMR"
+#define NIM_LEADERS_ROWS 1000 // players in a LEADERS datagram
+
+// Player record. Record 0 is the head of the list, and a link of 0 is the
+// end of it.
+struct nim_rated {
+	char handle[20];
+	int rating;
+	int games, wins;
+	int level; // links in use
+	int next[NIM_RATING_LEVELS]; // next record at each level
+	int span[NIM_RATING_LEVELS]; // ranks each link moves on
+};
+
+// Start of the file, followed by the records and then the hash.
+struct nim_rating_head {
+	unsigned magic;
+	int cap; // records the file holds, the head included
+	int count; // players
+	int length; // players linked into the list
+	int level; // levels in use
+	int dirty; // an update is under way
+	long long pad[5];
+};
+
+// A process's view of the file.
+struct nim_ratings {
+	int fd;
+	struct nim_rating_head *head; // the file, mapped
+	struct nim_rated *rec;
+	int *hash; // 2 * cap slots, a record number or 0 if empty
+	int cap; // records mapped
+};
+
+size_t rating_size(int cap) {
+	return sizeof(struct nim_rating_head) + (size_t) cap * sizeof(struct nim_rated)
+			+ (size_t) 2 * cap * sizeof(int);
+}
+
+// Map the file at the size it says it is. Returns -1 on failure.
+int rating_map(struct nim_ratings *r, int cap) {
+	void *file = mmap(NULL, rating_size(cap), PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if (file == MAP_FAILED) return -1;
+	if (r->head != NULL) munmap(r->head, rating_size(r->cap));
+	r->head = file;
+	r->rec = (struct nim_rated *) (r->head + 1);
+	r->hash = (int *) (r->rec + cap);
+	r->cap = cap;
+	return 0;
+}
+
+// Whether record a ranks ahead of record b: a higher rating, or the same
+// and a handle sorting first.
+int rating_before(struct nim_ratings *r, int a, int b) {
+	if (r->rec[a].rating != r->rec[b].rating) return r->rec[a].rating > r->rec[b].rating;
+	return strcmp(r->rec[a].handle, r->rec[b].handle) < 0;
+}
+
+unsigned rating_hash(char *s) {
+	unsigned h = 2166136261u;
+	for ( ; *s != '\0'; s++) h = (h ^ (unsigned char) *s) * 16777619u;
+	return h;
+}
+
+// Hash slot for a handle: where it is, or the empty slot ending its probe.
+int rating_slot(struct nim_ratings *r, char *handle) {
+	unsigned mask = 2 * r->cap - 1, i = rating_hash(handle) & mask;
+	while (r->hash[i] != 0 && strcmp(r->rec[r->hash[i]].handle, handle) != 0)
+		i = (i + 1) & mask;
+	return i;
+}
+
+// Link a record into the list where its rating puts it.
+void rating_link(struct nim_ratings *r, int i) {
+	struct nim_rating_head *h = r->head;
+	int update[NIM_RATING_LEVELS], rank[NIM_RATING_LEVELS], x = 0, l, level = 1;
+	for (l = h->level - 1; l >= 0; l--) {
+		rank[l] = l == h->level - 1 ? 0 : rank[l + 1];
+		while (r->rec[x].next[l] != 0 && rating_before(r, r->rec[x].next[l], i)) {
+			rank[l] += r->rec[x].span[l];
+			x = r->rec[x].next[l];
+		}
+		update[l] = x;
+	}
+	while (level < NIM_RATING_LEVELS && (rand() & 3) == 0) level += 1;
+	for ( ; h->level < level; h->level++) {
+		rank[h->level] = 0;
+		update[h->level] = 0;
+		r->rec[0].next[h->level] = 0;
+		r->rec[0].span[h->level] = h->length;
+	}
+	r->rec[i].level = level;
+	for (l = 0; l < level; l++) {
+		x = update[l];
+		r->rec[i].next[l] = r->rec[x].next[l];
+		r->rec[x].next[l] = i;
+		r->rec[i].span[l] = r->rec[x].span[l] - (rank[0] - rank[l]);
+		r->rec[x].span[l] = rank[0] - rank[l] + 1;
+	}
+	for ( ; l < h->level; l++) r->rec[update[l]].span[l] += 1;
+	h->length += 1;
+}
+
+// Take a record out of the list.
+void rating_unlink(struct nim_ratings *r, int i) {
+	struct nim_rating_head *h = r->head;
+	int x = 0, l;
+	for (l = h->level - 1; l >= 0; l--) {
+		while (r->rec[x].next[l] != 0 && r->rec[x].next[l] != i
+				&& rating_before(r, r->rec[x].next[l], i))
+			x = r->rec[x].next[l];
+		if (r->rec[x].next[l] == i) {
+			r->rec[x].span[l] += r->rec[i].span[l] - 1;
+			r->rec[x].next[l] = r->rec[i].next[l];
+		} else r->rec[x].span[l] -= 1;
+	}
+	while (h->level > 1 && r->rec[0].next[h->level - 1] == 0) h->level -= 1;
+	h->length -= 1;
+}
+
+// Relink every record and rehash every handle from scratch.
+void rating_rebuild(struct nim_ratings *r) {
+	int i;
+	memset(r->hash, 0, 2 * r->cap * sizeof(int));
+	memset(&r->rec[0], 0, sizeof(struct nim_rated));
+	r->head->level = 1;
+	r->head->length = 0;
+	for (i = 1; i <= r->head->count; i++) {
+		r->hash[rating_slot(r, r->rec[i].handle)] = i;
+		rating_link(r, i);
+	}
+	r->head->dirty = 0;
+}
+
+// Whether the bottom of the list holds every player in order, as it must
+// unless the machine went down with the file half written.
+int rating_intact(struct nim_ratings *r) {
+	int n = 0, x;
+	if (r->head->level < 1 || r->head->level > NIM_RATING_LEVELS) return 0;
+	for (x = r->rec[0].next[0]; x != 0 && n < r->head->count; x = r->rec[x].next[0]) {
+		if (x > r->head->count) return 0;
+		if (r->rec[x].next[0] != 0 && !rating_before(r, x, r->rec[x].next[0])) return 0;
+		n += 1;
+	}
+	return x == 0 && n == r->head->count && r->head->length == n;
+}
+
+// Lock the file for our use, catching up first with growth by another
+// process and with an update another process died during.
+void rating_lock(struct nim_ratings *r) {
+	while (flock(r->fd, LOCK_EX) < 0 && errno == EINTR) ;
+	if (r->head->cap != r->cap) rating_map(r, r->head->cap);
+	if (r->head->dirty) rating_rebuild(r);
+}
+
+void rating_unlock(struct nim_ratings *r) {
+	flock(r->fd, LOCK_UN);
+}
+
+// Open the ratings file, creating it if need be. Returns -1 if it cannot
+// be opened or is not a ratings file.
+int rating_open(struct nim_ratings *r, char *path) {
+	struct stat st;
+	int ret = 0;
+	memset(r, 0, sizeof(struct nim_ratings));
+	if ( (r->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 ) return -1;
+	while (flock(r->fd, LOCK_EX) < 0 && errno == EINTR) ;
+	if (fstat(r->fd, &st) < 0) ret = -1;
+	else if (st.st_size == 0) { // new
+		if (ftruncate(r->fd, rating_size(NIM_RATING_MIN)) < 0
+				|| rating_map(r, NIM_RATING_MIN) < 0) ret = -1;
+		else {
+			r->head->magic = NIM_RATING_MAGIC;
+			r->head->cap = NIM_RATING_MIN;
+			r->head->level = 1;
+		}
+	} else if (st.st_size < sizeof(struct nim_rating_head) || rating_map(r, 0) < 0
+			|| r->head->magic != NIM_RATING_MAGIC || r->head->cap < NIM_RATING_MIN
+			|| (r->head->cap & (r->head->cap - 1)) != 0
+			|| r->head->count < 0 || r->head->count >= r->head->cap
+			|| st.st_size < rating_size(r->head->cap)
+			|| rating_map(r, r->head->cap) < 0) ret = -1;
+	else if (r->head->dirty || !rating_intact(r)) rating_rebuild(r);
+	rating_unlock(r);
+	if (ret < 0) close(r->fd);
+	return ret;
+}
+
+// Record number of a player, 0 if not rated, with the file locked.
+int rating_find(struct nim_ratings *r, char *handle) {
+	return r->hash[rating_slot(r, handle)];
+}
+
+// Record number of a player, adding it if new, with the file locked.
+// Returns 0 if the file could not grow.
+int rating_player(struct nim_ratings *r, char *handle) {
+	struct nim_rated *p;
+	int i = rating_find(r, handle);
+	if (i != 0) return i;
+	if (r->head->count + 1 == r->cap) { // double, rehashing
+		if (ftruncate(r->fd, rating_size(2 * r->cap)) < 0 || rating_map(r, 2 * r->cap) < 0)
+			return 0;
+		r->head->cap = r->cap;
+		r->head->dirty = 1;
+		rating_rebuild(r);
+		r->head->dirty = 1;
+	}
+	i = r->head->count += 1;
+	p = &r->rec[i];
+	memset(p, 0, sizeof(struct nim_rated));
+	snprintf(p->handle, 20, "%s", handle);
+	p->rating = NIM_RATING_START;
+	r->hash[rating_slot(r, handle)] = i;
+	rating_link(r, i);
+	return i;
+}
+
+// Rank of a player, counted from 1, with the file locked.
+int rating_rank(struct nim_ratings *r, int i) {
+	int x = 0, l, rank = 0;
+	for (l = r->head->level - 1; l >= 0; l--) {
+		while (r->rec[x].next[l] != 0 && (r->rec[x].next[l] == i
+				|| rating_before(r, r->rec[x].next[l], i))) {
+			rank += r->rec[x].span[l];
+			x = r->rec[x].next[l];
+		}
+		if (x == i) return rank;
+	}
+	return 0;
+}
+
+// Record at a rank, counted from 1, 0 if none, with the file locked.
+int rating_at(struct nim_ratings *r, int rank) {
+	int x = 0, l, passed = 0;
+	for (l = r->head->level - 1; l >= 0; l--) {
+		while (r->rec[x].next[l] != 0 && passed + r->rec[x].span[l] <= rank) {
+			passed += r->rec[x].span[l];
+			x = r->rec[x].next[l];
+		}
+		if (passed == rank) return x;
+	}
+	return 0;
+}
+
+// A player's rating, NIM_RATING_START if not yet rated.
+int rating_of(struct nim_ratings *r, char *handle) {
+	int i, rating;
+	rating_lock(r);
+	rating = (i = rating_find(r, handle)) ? r->rec[i].rating : NIM_RATING_START;
+	rating_unlock(r);
+	return rating;
+}
+
+// Rate a game between two players, won by the first if winner is 0, the
+// second if 1.
+void rating_game(struct nim_ratings *r, char *handle1, char *handle2, int winner) {
+	int a, b, ra, rb;
+	double expect;
+	if (strcmp(handle1, handle2) == 0) return;
+	rating_lock(r);
+	r->head->dirty = 1;
+	if ( (a = rating_player(r, handle1)) != 0 && (b = rating_player(r, handle2)) != 0 ) {
+		ra = r->rec[a].rating;
+		rb = r->rec[b].rating;
+		expect = 1 / (1 + pow(10, (rb - ra) / 400.0)); // of the first winning
+		rating_unlink(r, a);
+		rating_unlink(r, b);
+		r->rec[a].rating = ra + (int) floor(NIM_RATING_K * ((winner == 0) - expect) + 0.5);
+		r->rec[b].rating = rb - (r->rec[a].rating - ra);
+		r->rec[a].games += 1;
+		r->rec[b].games += 1;
+		r->rec[winner == 0 ? a : b].wins += 1;
+		rating_link(r, a);
+		rating_link(r, b);
+	}
+	r->head->dirty = 0;
+	rating_unlock(r);
+}
+
+// Write a RATING datagram for a player, unrated if no file is open.
+// Returns its size.
+int rating_encode(struct nim_ratings *r, char *handle, unsigned char *buf, int cap) {
+	struct nim_frame f;
+	int i = 0;
+	frame_begin(&f, buf, cap, FRAME_RATING);
+	frame_str(&f, handle);
+	if (r->head != NULL) {
+		rating_lock(r);
+		i = rating_find(r, handle);
+	}
+	frame_u32(&f, i ? r->rec[i].rating : NIM_RATING_START);
+	frame_u32(&f, i ? rating_rank(r, i) : 0);
+	frame_u32(&f, r->head != NULL ? r->head->count : 0);
+	frame_u32(&f, i ? r->rec[i].games : 0);
+	frame_u32(&f, i ? r->rec[i].wins : 0);
+	if (r->head != NULL) rating_unlock(r);
+	return frame_end(&f);
+}
+
+// Write a LEADERS datagram of the players from a rank, counted from 0, as
+// many as NIM_LEADERS_ROWS allows, none if no file is open. Returns its
+// size, -1 if it does not fit.
+int rating_leaders(struct nim_ratings *r, unsigned first, unsigned char *buf, int cap) {
+	struct nim_frame f;
+	int i, rows, count_at;
+	frame_begin(&f, buf, cap, FRAME_LEADERS);
+	if (r->head == NULL) {
+		frame_u32(&f, 0);
+		frame_u32(&f, 0);
+		frame_u16(&f, 0);
+		return frame_end(&f);
+	}
+	rating_lock(r);
+	if (first > r->head->count) first = r->head->count;
+	frame_u32(&f, r->head->count);
+	frame_u32(&f, first);
+	count_at = f.len;
+	frame_u16(&f, 0);
+	for (rows = 0, i = rating_at(r, first + 1); i != 0 && rows < NIM_LEADERS_ROWS;
+			rows++, i = r->rec[i].next[0]) {
+		frame_str(&f, r->rec[i].handle);
+		frame_u32(&f, r->rec[i].rating);
+		frame_u32(&f, r->rec[i].games);
+		frame_u32(&f, r->rec[i].wins);
+	}
+	rating_unlock(r);
+	if (count_at + 2 <= cap) {
+		buf[count_at] = rows >> 8;
+		buf[count_at + 1] = rows & 0xFF;
+	}
+	return frame_end(&f);
+}
+
+#endif
@@ -0,0 +1,203 @@
+// CS415 Project #4: nim_registry.h (games in progress)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Registry of games in progress: a slot map handing out stable handles
+// (slot index plus a generation that changes whenever the slot is reused),
+// with a pid index for games run by a forked match server. Slots live in
+// fixed chunks so records never move, live games are kept on a list for
+// iteration, and add, lookup and remove are all O(1).
+
+#ifndef NIM_REGISTRY_H
+#define NIM_REGISTRY_H
+
+#define NIM_REG_CHUNK 1024 // slots per chunk
+#define NIM_REG_CHUNKS 1024 // chunks, so at most a million games
+#define NIM_REG_INDEX_BITS 20 // handle = generation << 20 | slot
+
+struct nim_registry {
+	struct nim_game *chunk[NIM_REG_CHUNKS];
+	int nslots; // slots ever handed out
+	int free_slot; // head of the free slot list, -1 if empty
+	int count; // live games
+	struct nim_game *live; // live games, newest first
+	int *pids; // open addressed pid index holding slot numbers, -1 empty
+	int pid_cap; // power of two
+	int pid_count;
+};
+
+void registry_link(struct nim_registry *r, struct nim_game *g, int pid,
+		char *handle1, char *handle2);
+
+void registry_init(struct nim_registry *r) {
+	memset(r, 0, sizeof(struct nim_registry));
+	r->free_slot = -1;
+}
+
+struct nim_game *registry_slot(struct nim_registry *r, int slot) {
+	return &r->chunk[slot / NIM_REG_CHUNK][slot % NIM_REG_CHUNK];
+}
+
+// Look up a game by handle, NULL if it has ended.
+struct nim_game *registry_get(struct nim_registry *r, unsigned handle) {
+	int slot = handle & ((1 << NIM_REG_INDEX_BITS) - 1);
+	if (slot >= r->nslots) return NULL;
+	struct nim_game *g = registry_slot(r, slot);
+	return (g->id == handle && g->live) ? g : NULL;
+}
+
+// Pid index slot for a pid: either where it is or the empty slot ending
+// its probe sequence.
+int registry_probe(struct nim_registry *r, int pid) {
+	unsigned mask = r->pid_cap - 1;
+	unsigned i = ((unsigned) pid * 2654435761u) & mask;
+	while (r->pids[i] >= 0 && registry_slot(r, r->pids[i])->match_pid != pid)
+		i = (i + 1) & mask;
+	return i;
+}
+
+// Look up a forked match server's game by pid, NULL if not found.
+struct nim_game *registry_pid(struct nim_registry *r, int pid) {
+	if (r->pid_count == 0) return NULL;
+	int i = registry_probe(r, pid);
+	return r->pids[i] >= 0 ? registry_slot(r, r->pids[i]) : NULL;
+}
+
+void registry_index_pid(struct nim_registry *r, int slot) {
+	int i;
+	if (2 * (r->pid_count + 1) > r->pid_cap) { // grow and rehash
+		int *old = r->pids, old_cap = r->pid_cap;
+		r->pid_cap = old_cap ? 2 * old_cap : 64;
+		r->pids = malloc(r->pid_cap * sizeof(int));
+		for (i = 0; i < r->pid_cap; i++) r->pids[i] = -1;
+		for (i = 0; i < old_cap; i++) {
+			if (old[i] < 0) continue;
+			r->pids[registry_probe(r, registry_slot(r, old[i])->match_pid)] = old[i];
+		}
+		free(old);
+	}
+	r->pids[registry_probe(r, registry_slot(r, slot)->match_pid)] = slot;
+	r->pid_count += 1;
+}
+
+// Remove a pid from the index, shifting back later entries of its probe
+// sequence so no tombstones are needed.
+void registry_unindex_pid(struct nim_registry *r, int pid) {
+	unsigned mask = r->pid_cap - 1;
+	unsigned i = registry_probe(r, pid), j = i, home;
+	if (r->pids[i] < 0) return;
+	for ( ; ; ) {
+		r->pids[i] = -1;
+		for ( ; ; ) {
+			j = (j + 1) & mask;
+			if (r->pids[j] < 0) { r->pid_count -= 1; return; }
+			home = ((unsigned) registry_slot(r, r->pids[j])->match_pid
+					* 2654435761u) & mask;
+			// move j back to i unless its home lies cyclically in (i, j]
+			if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+				continue;
+			break;
+		}
+		r->pids[i] = r->pids[j];
+		i = j;
+	}
+}
+
+// Add a game, returning its record with a fresh handle in id. Returns NULL
+// if the registry is full.
+struct nim_game *registry_add(struct nim_registry *r, int pid,
+		char *handle1, char *handle2) {
+	int slot;
+	struct nim_game *g;
+	if (r->free_slot >= 0) {
+		slot = r->free_slot;
+		g = registry_slot(r, slot);
+		r->free_slot = g->free_next;
+	} else {
+		if (r->nslots == NIM_REG_CHUNK * NIM_REG_CHUNKS) return NULL;
+		slot = r->nslots++;
+		if (r->chunk[slot / NIM_REG_CHUNK] == NULL)
+			r->chunk[slot / NIM_REG_CHUNK] =
+					calloc(NIM_REG_CHUNK, sizeof(struct nim_game));
+		g = registry_slot(r, slot);
+	}
+	g->gen = (g->gen + 1) & ((1 << (32 - NIM_REG_INDEX_BITS)) - 1);
+	g->id = (g->gen << NIM_REG_INDEX_BITS) | slot;
+	registry_link(r, g, pid, handle1, handle2);
+	return g;
+}
+
+// Fill in a new game's record and put it on the live list.
+void registry_link(struct nim_registry *r, struct nim_game *g, int pid,
+		char *handle1, char *handle2) {
+	g->live = 1;
+	g->match_pid = pid;
+	g->worker = -1;
+	g->control = -1;
+	g->match = NULL;
+	strcpy(g->player1, handle1);
+	strcpy(g->player2, handle2);
+	g->prev = NULL;
+	g->next = r->live;
+	if (r->live != NULL) r->live->prev = g;
+	r->live = g;
+	r->count += 1;
+	if (pid > 0) registry_index_pid(r, g->id & ((1 << NIM_REG_INDEX_BITS) - 1));
+}
+
+// Add a game under the handle it had in the server this one replaced (see
+// nim_upgrade.h). Every such game is restored before any game is added,
+// and registry_reclaim() called once they all are. Returns NULL if the
+// handle's slot is taken or out of range.
+struct nim_game *registry_restore(struct nim_registry *r, unsigned id, int pid,
+		char *handle1, char *handle2) {
+	int slot = id & ((1 << NIM_REG_INDEX_BITS) - 1);
+	struct nim_game *g;
+	if (slot >= NIM_REG_CHUNK * NIM_REG_CHUNKS) return NULL;
+	for ( ; r->nslots <= slot; r->nslots++)
+		if (r->chunk[r->nslots / NIM_REG_CHUNK] == NULL)
+			r->chunk[r->nslots / NIM_REG_CHUNK] =
+					calloc(NIM_REG_CHUNK, sizeof(struct nim_game));
+	g = registry_slot(r, slot);
+	if (g->live) return NULL;
+	g->gen = id >> NIM_REG_INDEX_BITS;
+	g->id = id;
+	registry_link(r, g, pid, handle1, handle2);
+	return g;
+}
+
+// Put every slot the restored games skipped over on the free list.
+void registry_reclaim(struct nim_registry *r) {
+	int slot;
+	r->free_slot = -1;
+	for (slot = r->nslots - 1; slot >= 0; slot--) {
+		struct nim_game *g = registry_slot(r, slot);
+		if (g->live) continue;
+		g->free_next = r->free_slot;
+		r->free_slot = slot;
+	}
+}
+
+// Remove a game; its handle is no longer valid.
+void registry_remove(struct nim_registry *r, struct nim_game *g) {
+	if (!g->live) return;
+	if (g->match_pid > 0) registry_unindex_pid(r, g->match_pid);
+	if (g->prev != NULL) g->prev->next = g->next;
+	else r->live = g->next;
+	if (g->next != NULL) g->next->prev = g->prev;
+	g->live = 0;
+	g->free_next = r->free_slot;
+	r->free_slot = g->id & ((1 << NIM_REG_INDEX_BITS) - 1);
+	r->count -= 1;
+}
+
+// Find the newest game a player is in, NULL if none. Only spectators
+// look games up by handle, so this is a scan of the live games.
+struct nim_game *registry_find(struct nim_registry *r, char *handle) {
+	struct nim_game *g;
+	for (g = r->live; g != NULL; g = g->next)
+		if (strcmp(g->player1, handle) == 0 || strcmp(g->player2, handle) == 0)
+			return g;
+	return NULL;
+}
+
+#endif
@@ -1,347 +1,2448 @@
-// CS415 Project #4: nim_server.c
-// Gavin Cabbage - gavincabbage@gmail.com
-
-// Compile: gcc -o nim_server nim_server.c (use Makefile!)
-// Invoke: $ nim_server {password}
-
-// Exit Codes:
-// <0> Successful termination
-// <1> Argument error
-// <2> Problem with getaddrinfo, report details with gai_strerror()
-// <3> Problem initializing query socket
-// <4> Problem initializing play socket
-// <5> Problem with select
-// <6> Error processing client query
-// <7> Error processing client play request
-// <8> Error creating server address file
-
-#include "nim.h"
-
-// Global variables and function prototypes.
-char *password;
-int err_code;
-int query_sock, play_sock; // socket descriptors
-struct addrinfo hints, *addrlist;
-struct sockaddr_in *q_in, q_from; // for init_query_sock()
-struct sockaddr_in *p_in, p_from; // for init_play_sock()
-FILE *config; // address file
-char waiting[20]; // waiting client's handle
-int wait_sock; // waiting client's socket descriptor
-int inprog = 0; // number of games in progress
-struct nim_game *game_list;
-char games[LINE_MAX];
-
-void init_query_sock(), init_play_sock();
-void init_addr_file();
-void usr1handler();
-void usr2handler(); // SIGUSR2 handler
-void build_games_string();
-void error(int code); // error/exit function
-
-int main(int argc, char *argv[]) { /////////////////////////////////////////////
-
-	// Process input arguments.
-	if (argc == 1) ; // no password
-	else if (argc == 2) password = argv[1];
-	else error(1);
-	memset(waiting, 0, 20);
-	
-	// Initialize query and play sockets, create address file.
-	init_query_sock();
-	init_play_sock();
-	init_addr_file();
-
-	// Main server loop listens and reacts to client requests on both sockets.
-	int max_sock, active;
-	struct timeval timeout;
-	// embed signal handlers
-	if (signal(SIGUSR1, usr1handler) == SIG_ERR) error(9);
-	if (signal(SIGUSR2, usr2handler) == SIG_ERR) error(9);
-	for ( ; ; ) { 
-	
-		// Update list of games in progress.
-		struct nim_game *cur = game_list;
-		struct nim_game *prev;
-		while (cur != NULL) {
-			int status;
-			waitpid(cur->match_pid, &status, WNOHANG);
-			if (WIFEXITED(status)) {
-				if (cur == game_list) game_list = NULL;
-				else {
-					prev->next = cur->next;
-					cur = cur->next;
-				} 
-				inprog -= 1;
-			} else {
-				prev = cur;
-				cur = cur->next;
-			}
-		} if (inprog < 0) inprog = 0;
-
-		// Build select list, find max socket descriptor, set timeout.
-		fd_set socks;
-		FD_ZERO(&socks);
-		FD_SET(query_sock, &socks);
-		FD_SET(play_sock, &socks);
-		max_sock = query_sock > play_sock ? query_sock : play_sock;
-		timeout.tv_sec = 1; timeout.tv_usec = 0;
-		
-		// Hang select and process client requests.
-		active = select(max_sock+1, &socks, (fd_set*) 0, (fd_set*) 0, &timeout);
-		if (active < 0) error(5);
-		else if (active == 0) continue;
-		else { // got a client request
-		
-			// Handle client query request.
-			if (FD_ISSET(query_sock, &socks)) {
-				
-				// Receive client query.
-				socklen_t q_size = sizeof(q_from);
-				struct nim_query *query = malloc(sizeof(struct nim_query));
-				int rec = recvfrom(query_sock, query, sizeof(query), 0,
-						(struct sockaddr*) &q_from, &q_size);
-				if (rec < sizeof(query)) error(6);
-				
-				// If password enabled, check password before responding.
-				if ( (password == NULL) || (!strcmp(password, query->password)) ) {
-				
-					// Respond to client query.
-					struct nim_query_response *response = 
-							malloc(sizeof(struct nim_query_response));
-					response->inprog = htonl(inprog);
-					strcpy(response->waiting, waiting);
-					build_games_string();
-					strcpy(response->games, games);
-					int sent = sendto(query_sock, response, sizeof(*response), 0,
-							(struct sockaddr*) &q_from,
-							sizeof(struct sockaddr_in));
-					if (sent < sizeof(*response)) error(6);		
-					free(response);
-				}
-				free(query);
-			} // end query handling
-			
-			// Handle client play request.
-			if (FD_ISSET(play_sock, &socks)) {
-
-				// Accept client connection.
-				char handle[20];
-				int new_sock;
-				socklen_t p_size = sizeof(p_from);
-				new_sock = accept(play_sock,(struct sockaddr*) &p_from, &p_size);
-				if (new_sock < 0) error(7);
-
-				// Accept and check password if enabled, process client handle.
-				struct nim_msg *request = malloc(sizeof(struct nim_msg));
-				if (s_recv(new_sock, (void *) request, sizeof(struct nim_msg)) < 0)
-					error(7);
-				char rec_pass[20];
-				strcpy(rec_pass, request->data);
-
-				if ( (password == NULL) || (!strcmp(password, rec_pass)) ) {
-					// correct password, get client handle
-					memset(request, 0, sizeof(struct nim_msg));
-					request->type = 'H';
-					if (s_send(new_sock, (void *) request, sizeof(struct nim_msg)) < 0)
-						error(7);
-					memset(request, 0, sizeof(struct nim_msg));
-					if (s_recv(new_sock, (void *) request, sizeof(struct nim_msg)) < 0)
-						error(7);
-					strcpy(handle, request->data);
-				} else { // incorrect password, notify client and close socket
-					memset(request, 0, sizeof(struct nim_msg));
-					request->type = 'X';
-					if (s_send(new_sock, (void *) request, sizeof(struct nim_msg)) < 0)
-						error(7);
-					close(new_sock);
-				}
-				free(request);
-				
-				// Set client to wait or spawn a new game.
-				if (waiting[0] == 0) { // no client waiting
-					wait_sock = new_sock;
-					strcpy(waiting, handle);
-				} else { // another client already waiting
-					char handle1[20]; char handle2[20];
-					strcpy(handle1, waiting);
-					strcpy(handle2, handle);
-					int child;
-					if ( (child = fork()) < 0 ) error(10);
-					else if (child == 0) { // child
-						// close server sockets
-						close(play_sock);
-						close(query_sock);
-						// dup socket descriptors to well known values
-						if (wait_sock != MATCH_SOCK_1) {
-							dup2(wait_sock, MATCH_SOCK_1);
-							close(wait_sock);
-						}
-						if (new_sock != MATCH_SOCK_2) {
-							dup2(new_sock, MATCH_SOCK_2);
-							close(new_sock);
-						}
-						// spawn a match server for the game
-						char *env[3];
-						char envbuf1[23]; char envbuf2[23];
-						sprintf(envbuf1, "H1=%s", handle1);
-						sprintf(envbuf2, "H2=%s", handle2);
-						env[0] = envbuf1;
-						env[1] = envbuf2;
-						env[2] = NULL;
-						char *args[2];
-						args[0] = "./nim_match_server";
-						args[1] = NULL;
-						execve("./nim_match_server", args, env);		
-					} else { // parent
-						// close player sockets and clear buffers
-						close(wait_sock);
-						close(new_sock);
-						memset(waiting, 0, sizeof(waiting));
-						memset(handle, 0, sizeof(handle));
-						// add match to games list
-						struct nim_game *new = malloc(sizeof(struct nim_game));
-						new->match_pid = child;
-						strcpy(new->player1, handle1);
-						strcpy(new->player2, handle2);
-						new->next = game_list;
-						game_list = new;
-						inprog += 1;
-					}
-				}
-			} // end play handling
-		}
-	} // end server loop
-
-	exit(0);
-
-} // end main //////////////////////////////////////////////////////////////////
-
-// Initialize datagram socket to listen and respond to client quaries.
-void init_query_sock() {
-
-	// Set hints struct and get address info.
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_flags = AI_NUMERICSERV | AI_PASSIVE;
-	hints.ai_protocol = 0;
-	hints.ai_canonname = NULL;
-	hints.ai_addr = NULL;
-	hints.ai_next = NULL;
-	if ( (err_code = getaddrinfo(NULL, "4201", &hints, &addrlist)) != 0 ) 
-		error(2);
-	q_in = (struct sockaddr_in*) addrlist->ai_addr;
-
-	// Initialize socket and bind to port.
-	query_sock = socket(addrlist->ai_family, addrlist->ai_socktype, 0);
-	if (query_sock < 0) error(3);
-	if ( bind(query_sock, (struct sockaddr*) q_in, sizeof(struct sockaddr_in)) < 0 )
-		error(3);
-}
-
-// Initialize stream socket to listen and repond to client play requests.
-void init_play_sock() {
-
-	// Set hints struct and get address info.
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_NUMERICSERV | AI_PASSIVE;
-	hints.ai_protocol = 0;
-	hints.ai_canonname = NULL;
-	hints.ai_addr = NULL;
-	hints.ai_next = NULL;
-	if ( (err_code = getaddrinfo(NULL, "4202", &hints, &addrlist) ) != 0 )
-		error(2);
-	p_in = (struct sockaddr_in*) addrlist->ai_addr;
-	
-	// Initialize socket, bind to port and set to listen.
-	play_sock = socket(addrlist->ai_family, addrlist->ai_socktype, 0);
-	if (play_sock < 0) error(4);
-	if ( bind(play_sock, (struct sockaddr*) p_in, sizeof(struct sockaddr_in)) < 0 )
-		error(4);
-	if ( listen(play_sock, 5) < 0 )
-		error(4);
-}
-
-// Create address file with local symbolic host and port numbers of
-// query and play sockets, seperated with colons.
-void init_addr_file() {
-
-	// Get local hostname.
-	char hostname[HOST_NAME_MAX];
-	hostname[HOST_NAME_MAX-1] = '\0';
-	gethostname(hostname, HOST_NAME_MAX);
-	
-	// Write to address file: hostname:query_port:play_port
-	config = fopen("nim.conf", "w");
-	if (config == NULL) error(8);
-	fprintf(config, "%s:%d:%d", hostname, 4201, 4202); 
-	fclose(config);
-}
-
-// Signal handler for SIGUSR2 induced clean termination.
-// NOTE: Games in progress allowed to finish, per preliminary grading rubric.
-void usr2handler() {
-
-	// remove config file
-	remove("nim.conf");
-	// terminate normally
-	exit(0);
-}
-
-// Signal handler for SIGUSR1 updates games in progress list.
-void usr1handler() {
-
-}
-
-// Build string of games in progress from games list.
-void build_games_string() {
-
-	// Iterate through list of games and append to a string, handles seperated
-	// by colons to be parsed by client.
-	memset(games, 0, LINE_MAX);
-	struct nim_game *cur = game_list;
-	while(cur != NULL) {
-		char cur_game[41];
-		sprintf(cur_game, "%s:%s:", cur->player1, cur->player2);
-		strcat(games, cur_game);
-		cur = cur->next;
-	}
-}
-
-// Print appropriate error message and exit.
-void error(int code) {
-	switch(code) {
-	case 1:
-		fprintf(stderr, "nim_server: argument error: exit 1\n");
-		exit(1); break;
-	case 2:
-		fprintf(stderr, "nim_server: getaddrinfo: %s: exit 2\n", gai_strerror(err_code));
-		exit(2); break;
-	case 3:
-		fprintf(stderr, "nim_server: problem initializing query socket: exit 3\n");
-		exit(3); break;
-	case 4:
-		fprintf(stderr, "nim_server: problem initializing play socket: exit 4\n");
-		exit(4); break;
-	case 5:
-		fprintf(stderr, "nim_server: problem with select: exit 5\n");
-		exit(5); break;
-	case 6:
-		fprintf(stderr, "nim_server: error processing client query: exit 6\n");
-		exit(6); break;
-	case 7:
-		fprintf(stderr, "nim_server: error processing client play request: exit 7\n");
-		exit(7); break;
-	case 8:
-		fprintf(stderr, "nim_server: error creating server address file: exit 8\n");
-		exit(8); break;
-	case 9:
-		fprintf(stderr, "nim_server: signal error: exit 9\n");
-		exit(9); break;
-	case 10:
-		fprintf(stderr, "nim_server: fork error: exit 10\n");
-		exit(10); break;
-	}
-}
+// CS415 Project #4: nim_server.c
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Compile: gcc -o nim_server nim_server.c (use Makefile!)
+// Invoke: $ nim_server {-e} {-s shards} {-w workers} {-W games}
+//           {-b seconds} {-r percent} {-v variant} {-l dir}
+//           {-t seconds} {-i seconds} {-m seconds} {-c file {-n node}}
+//           {-T format:file {-F seconds}} {-R file {-P width}} {password}
+//   -e  run matches in-process on the event loop instead of forking a
+//       nim_match_server for each game
+//   -s  run this many reactor processes sharing the ports through
+//       SO_REUSEPORT, 0 for one per core (default 1)
+//   -w  hand matches to a pool of this many pre-spawned nim_match_server
+//       workers over SCM_RIGHTS instead of forking one per game
+//   -W  games a pool worker runs at once before the pool grows (default 64)
+//   -b  pair a player who has waited this many seconds with the bot, which
+//       plays in-process with no socket (default never)
+//   -r  percent of the bot's moves played at random instead of perfectly
+//       (default 0)
+//   -v  offer a board variant, name=len,len,...[:normal|:misere], which v2
+//       clients may ask for by name; may be given more than once
+//   -l  append every finished game to a log in this directory, which is
+//       created if need be (see nim_log.h; nim_logdump reads it)
+//   -t  close a connection that has not finished its handshake this many
+//       seconds after connecting, 0 for never (default 30)
+//   -i  close a player left unpaired this many seconds after queueing,
+//       0 for never (default)
+//   -m  forfeit a player who has not moved this many seconds after their
+//       turn is sent, 0 for never (default)
+//   -c  run as one node of the cluster listed in this file, a line
+//       host:query_port:play_port per node as in nim.conf; a node runs a
+//       single reactor
+//   -n  this node's line in the -c file, counting from 0 (default 0)
+//   -T  run a tournament, rr (round robin), single or double (elimination),
+//       among the handles listed one per line in the file in seed order;
+//       its matches are hosted in-process whatever the match mode, and it
+//       needs a single reactor outside a cluster
+//   -F  forfeit a tournament match to whoever has come for it this many
+//       seconds after it could start (default 60)
+//   -R  rate players by their games, keeping the ratings in this file,
+//       which is created if need be (see nim_rating.h)
+//   -P  pair players by rating, first with those whose rating is in the
+//       same band of this width, then after a few seconds with anyone
+// Player sockets are set TCP_NODELAY unless NIM_NODELAY=0 is set in the
+// environment; with NIM_TURN_STATS set, match turn latency is reported on
+// exit, and with NIM_ALLOC_STATS set, the counts of the slabs connections,
+// matches and spectators are allocated from (see nim_alloc.h). A METRICS
+// datagram on the query port is answered with the counters and latency
+// histograms of every server process as Prometheus text (see nim_metrics.h;
+// nim -m prints them). SIGUSR1 writes each reactor's recent
+// lobby events to nim_trace.<pid>.json (see nim_trace.h). A v2 client may
+// send WATCH in place of JOIN to spectate the game a player is in, however
+// and on whichever shard it is hosted (nim -w; see nim_watch.h). Every
+// deadline is a timer on the process's timer wheel (see nim_timer.h).
+// SIGHUP restarts a single reactor server in place: ./nim_server is run
+// again with the same arguments and takes over the listening sockets, the
+// lobby and every game in progress (see nim_upgrade.h).
+// In a cluster each node listens on the ports of its own line and node 0
+// writes the whole list to nim.conf. A v2 player joining a node other than
+// the one owning its handle is redirected there, and so is a spectator of a
+// game on another node; a player left waiting alone is relayed to pair with
+// one waiting alone on another node. Any node answers a query for the whole
+// cluster, from what the nodes gossip (see nim_cluster.h).
+// In a tournament an entrant joins as usual and waits for its next match,
+// reconnecting for each; once it has none left it joins the lobby like any
+// player. A STANDINGS datagram is answered with the standings (nim -t; see
+// nim_tourney.h). A server run with -T does not restart on SIGHUP, even
+// once the tournament has finished, since its results are held only in the
+// process and a new server would play the roster again.
+// With ratings kept, every game between players is rated as it ends, the
+// bot's aside; a RANK datagram is answered with a player's rating and rank
+// and a TOP datagram with the best rated players (nim -R and nim -r). In a
+// cluster each node rates the games it hosts in a file of its own.
+
+// Exit Codes:
+// <0> Successful termination
+// <1> Argument error
+// <2> Problem with getaddrinfo, report details with gai_strerror()
+// <3> Problem initializing query socket
+// <4> Problem initializing play socket
+// <5> Problem with epoll
+// <6> Error processing client query
+// <7> Error processing client play request
+// <8> Error creating server address file
+// <9> Signal error
+// <10> Fork error
+// <11> Problem starting shards
+// <12> Problem opening game log
+// <13> Problem taking over from the old server in a hot restart
+// <14> Problem joining the cluster
+// <15> Problem reading the tournament roster
+// <16> Problem opening the ratings file
+
+#include "nim.h"
+#include "nim_event.h"
+#include "nim_match.h"
+#include "nim_proto.h"
+#include "nim_shard.h"
+#include "nim_queue.h"
+#include "nim_registry.h"
+#include "nim_snapshot.h"
+#include "nim_metrics.h"
+#include "nim_trace.h"
+#include "nim_timer.h"
+#include "nim_upgrade.h"
+#include "nim_cluster.h"
+#include "nim_tourney.h"
+#include "nim_rating.h"
+
+// Global variables and function prototypes.
+char *password;
+int engine_mode = 0; // host matches in-process
+int pool_size = 0; // initial match workers, 0 for no pool
+int worker_games = 64; // games per worker before the pool grows
+int nodelay = 1; // set TCP_NODELAY on player sockets
+int bot_wait = -1; // ms a lone player waits before playing the bot, -1 never
+char *log_dir; // game log directory, NULL if not logging
+int handshake_ms = 30000; // ms to finish the handshake, 0 for no limit
+int idle_ms = 0; // ms a queued player may wait unpaired, 0 for no limit
+char **server_argv; // to run again in a hot restart
+char *query_port = "4201", *play_port = "4202"; // ports listened on
+char *cluster_file; // node list, NULL if not in a cluster
+int node_id = 0; // our line in it
+struct nim_cluster cluster; // the nodes and the news of them
+int gossip_sock = -1; // datagrams from other nodes, -1 if not in a cluster
+char *tourney_file; // tournament roster, NULL if no tournament
+int tourney_format;
+int forfeit_ms = 60000; // ms a ready tournament match waits on its players
+char *rating_file; // player ratings, NULL if not rating
+struct nim_ratings ratings;
+int rating_band = 0; // width of the rating bands players pair within, 0 for none
+#define NIM_BAND_WAIT 5000 // ms a player waits for an opponent in its band
+unsigned char gossip_buf[NIM_GOSSIP_MAX];
+struct nim_timer gossip_timer; // next gossip round
+int upgrade_sock = -1; // to the server we are replacing, while taking over
+unsigned char upgrade_buf[NIM_UPGRADE_MAX]; // hot restart record
+struct nim_source upgrade_src; // to the new server, until it is ready
+int upgrade_child; // the new server's pid, 0 if none is starting
+struct nim_timer upgrade_timer; // deadline for its READY
+int err_code;
+int query_sock, play_sock; // socket descriptors
+int spare_fd = -1; // held in reserve to shed connections when out of descriptors
+int epfd; // epoll instance
+struct addrinfo hints, *addrlist;
+struct sockaddr_in *q_in; // for init_query_sock()
+struct sockaddr_in *p_in, p_from; // for init_play_sock()
+FILE *config; // address file
+struct nim_queue lobby; // clients waiting for an opponent
+struct nim_registry registry; // games in progress
+int sigfd; // signalfd delivering SIGCHLD
+struct nim_snapshot snapshot; // encoded query response for this shard
+unsigned published; // snapshot version last published to other shards
+struct nim_query_response merged; // all shards' or nodes' response
+unsigned merged_seq[NIM_MAX_SHARDS]; // shard versions merged into it
+unsigned merged_news = -1, merged_snap = -1; // cluster news and snapshot merged
+int nshards = 1; // reactor processes
+int shard_id = 0; // this process's shard
+struct nim_shared *shared; // state shared between shards, NULL if one
+int mailbox[NIM_MAX_SHARDS][2]; // per shard handoff socket pairs
+pid_t shard_pids[NIM_MAX_SHARDS];
+
+// Client connection handshake states. A v2 client sends HELLO and JOIN
+// frames in place of <P> and <R>.
+enum {
+	CONN_PASSWORD, // awaiting <P> password submit
+	CONN_HANDLE, // <H> sent, awaiting <R> handle response
+	CONN_JOINING, // v2 handle received, queued once replies are flushed
+	CONN_WATCHING, // v2 spectator, sent to its game once replies are flushed
+	CONN_QUEUED, // handshake complete, waiting for an opponent
+	CONN_RELAYING, // queued, and being relayed to another node
+	CONN_CLOSING // <X> queued, close once flushed
+};
+
+// Client play connection, owned by the event loop until paired.
+struct nim_conn {
+	struct nim_source src;
+	int state;
+	int version; // protocol version, 0 until the first byte arrives
+	int variant; // board variant asked for
+	int have; // bytes of msg received so far
+	struct nim_msg msg;
+	struct nim_inbuf in; // v2 frames received
+	struct nim_outbuf out;
+	char handle[20]; // a spectator's is the handle of the player watched
+	int bucket; // pairing key: the variant
+	struct nim_qentry q; // queue links while waiting
+	long long accept_us, queued_us; // for the handshake and pairing metrics
+	struct nim_timer timer; // handshake deadline, then idle deadline
+	struct nim_conn *prev, *next; // all connections, for a hot restart
+	struct nim_relay *relay; // relaying it to another node, NULL if not
+	struct nim_entrant *entrant; // waiting for its tournament match, NULL if not
+};
+struct nim_conn *conns;
+struct nim_slab conn_slab = {"conn", sizeof(struct nim_conn)};
+#define CONN_OF(e) ((struct nim_conn *) ((char *) (e) - offsetof(struct nim_conn, q)))
+// Query datagrams are drained in batches with recvmmsg and answered with a
+// single sendmmsg, using vectors set up once in init_query_batch().
+#define NIM_QUERY_BATCH 64
+#define NIM_QUERY_MIN 8 // legacy clients send sizeof(struct nim_query *) bytes
+#define NIM_QUERY_MAX 64 // longest query datagram read, v2 or legacy
+struct mmsghdr q_msgs[NIM_QUERY_BATCH], r_msgs[NIM_QUERY_BATCH];
+struct iovec q_iov[NIM_QUERY_BATCH], r_iov[NIM_QUERY_BATCH];
+struct sockaddr_in q_from[NIM_QUERY_BATCH];
+char q_buf[NIM_QUERY_BATCH][NIM_QUERY_MAX + 1];
+unsigned char report_frame[NIM_FRAME_HEAD + NIM_METRICS_TEXT]; // REPORT reply
+int report_len; // size of report_frame, -1 until built for this batch
+// TABLE frame answering a STANDINGS query, sent on its own.
+unsigned char table_frame[NIM_FRAME_HEAD + 20 + NIM_TABLE_ROWS * 25];
+// RATING or LEADERS frame answering a RANK or TOP query, sent on its own.
+unsigned char leaders_frame[NIM_FRAME_HEAD + 10 + NIM_LEADERS_ROWS * 32];
+// LOBBY frame answering v2 queries, encoded at most once per batch.
+unsigned char lobby_frame[LINE_MAX + 64];
+int lobby_len;
+// Batch statistics: batch sizes are counted in power of two buckets,
+// 1, 2-3, 4-7, ... 64.
+long long q_wakeups, q_batches, q_packets, q_replies;
+long long q_sizes[8];
+
+struct nim_source query_src, play_src, mailbox_src, signal_src, gossip_src;
+
+// Pre-spawned match worker, fd -1 when its slot is free.
+#define NIM_MAX_WORKERS 256
+struct nim_worker {
+	struct nim_source src; // kind SRC_WORKER
+	int pid;
+	int active; // games assigned and not yet finished
+};
+struct nim_worker workers[NIM_MAX_WORKERS];
+int nworkers = 0; // slots in use, live or not
+
+// Player relayed from our lobby to another node's to be paired and play
+// there. We connect to the node's play port in the player's place and send
+// RELAY with its handle, and once the node welcomes it splice the player's
+// socket to that connection until either side closes. Each end holds the
+// bytes read from the other that it has yet to be sent.
+#define NIM_RELAY_BUF 4096
+#define NIM_RELAY_WAIT 500 // ms a lone player waits before being relayed
+#define NIM_RELAY_DEADLINE 2000 // ms the node has to welcome a relayed player
+struct nim_relay_end {
+	struct nim_source src; // kind SRC_RELAY, fd -1 until open
+	struct nim_relay *relay;
+	unsigned events; // current epoll interest
+	int len, off; // bytes waiting to be written to this end
+	unsigned char buf[NIM_RELAY_BUF];
+};
+struct nim_relay {
+	struct nim_relay_end player, node;
+	struct nim_conn *conn; // the player, until the node welcomes it
+	int target; // node relayed to
+	int closing; // an end has closed, finish writing to the other
+	struct nim_timer timer; // deadline for the welcome
+	struct nim_relay *prev, *next; // all relays, for a hot restart
+};
+struct nim_relay *relays;
+struct nim_slab relay_slab = {"relay", sizeof(struct nim_relay)};
+
+// Match server or worker taken over in a hot restart, which being the old
+// server's child is watched through a pidfd instead of SIGCHLD.
+struct nim_child {
+	struct nim_source src; // kind SRC_CHILD
+	int pid;
+};
+
+void init_query_sock(), init_play_sock();
+void init_addr_file();
+int owns_addr_file();
+void init_gossip_sock();
+void init_event_loop();
+void run_master();
+void start_shard(int i);
+void serve();
+void publish_lobby();
+void handle_mailbox();
+int handoff_player(struct nim_conn *conn, int shard);
+void handle_signals();
+void reap_games();
+void init_signal_fd();
+void init_query_batch();
+void handle_query();
+int encode_lobby(struct nim_query_response *response);
+int encode_report();
+void print_query_stats();
+void accept_players();
+void conn_event(struct nim_conn *conn, unsigned events);
+void conn_frames(struct nim_conn *conn);
+void conn_reply(struct nim_conn *conn);
+void watch_game(struct nim_conn *conn, int handed);
+void queue_player(struct nim_conn *conn);
+void entrant_start(void *conn1, void *conn2);
+void entrant_release(void *conn);
+void pair_waiting();
+int rating_bucket(struct nim_conn *conn);
+void widen_bands(long long now);
+void rate_game(char *handle1, char *handle2, int winner);
+void reap_result(struct nim_game *game);
+void pair_players(struct nim_qentry *e1, struct nim_qentry *e2);
+void spawn_match(struct nim_conn *c1, struct nim_conn *c2);
+void start_match(struct nim_conn *c1, struct nim_conn *c2);
+void start_bot_match(struct nim_conn *conn);
+void match_done(struct nim_match *m);
+void init_pool();
+int spawn_worker();
+int assign_match(struct nim_conn *c1, struct nim_conn *c2);
+void worker_event(struct nim_worker *w, unsigned events);
+struct nim_game *add_game(int pid, char *handle1, char *handle2);
+void remove_game(struct nim_game *game);
+void close_conn(struct nim_conn *conn);
+void retire_conn(struct nim_conn *conn);
+void conn_timeout(struct nim_timer *t);
+void link_conn(struct nim_conn *conn);
+void hot_restart();
+void upgrade_event();
+void upgrade_abort(char *why);
+void upgrade_timeout(struct nim_timer *t);
+int send_state(int sock);
+int save_conn(int sock, struct nim_conn *conn);
+void upgrade_listeners();
+void upgrade_adopt();
+void adopt_worker(struct nim_cursor *c, int *fds, int nfds);
+void adopt_game(struct nim_cursor *c, int *fds, int nfds);
+struct nim_match *adopt_match(struct nim_cursor *c, int *fds, int nfds);
+void restore_conn(struct nim_cursor *c, int *fds, int nfds);
+struct nim_game *restore_game(unsigned id, int pid, char *handle1, char *handle2);
+void adopt_child(int pidfd, int pid);
+void child_event(struct nim_child *child);
+void master_huphandler();
+void usr1handler();
+void master_usr1handler();
+void usr2handler(); // SIGUSR2 handler
+void master_usr2handler();
+void merge_shards();
+void merge_nodes();
+void handle_gossip();
+void gossip_round(struct nim_timer *t);
+void redirect_conn(struct nim_conn *conn, int node);
+void relay_player(struct nim_conn *conn, int node);
+void relay_event(struct nim_relay_end *end, unsigned events);
+void relay_join(struct nim_relay *r, unsigned events);
+int relay_flush(struct nim_relay_end *end);
+void relay_interest(struct nim_relay *r);
+void relay_abort(struct nim_relay *r);
+void relay_close(struct nim_relay *r);
+void relay_timeout(struct nim_timer *t);
+void link_relay(struct nim_relay *r);
+int save_relay(int sock, struct nim_relay *r);
+void restore_relay(struct nim_cursor *c, int *fds, int nfds);
+void error(int code); // error/exit function
+
+int main(int argc, char *argv[]) { /////////////////////////////////////////////
+
+	// Process input arguments.
+	int i;
+	server_argv = argv;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-e") == 0) engine_mode = 1;
+		else if (strcmp(argv[i], "-s") == 0) {
+			i += 1; // next argument is the shard count
+			if (argv[i] == NULL) error(1);
+			nshards = atoi(argv[i]);
+			if (nshards <= 0) nshards = sysconf(_SC_NPROCESSORS_ONLN);
+			if (nshards > NIM_MAX_SHARDS) nshards = NIM_MAX_SHARDS;
+		} else if (strcmp(argv[i], "-w") == 0) {
+			i += 1; // next argument is the pool size
+			if (argv[i] == NULL) error(1);
+			pool_size = atoi(argv[i]);
+			if (pool_size < 0 || pool_size > NIM_MAX_WORKERS) error(1);
+		} else if (strcmp(argv[i], "-W") == 0) {
+			i += 1; // next argument is games per worker
+			if (argv[i] == NULL || (worker_games = atoi(argv[i])) < 1) error(1);
+		} else if (strcmp(argv[i], "-b") == 0) {
+			i += 1; // next argument is the bot timeout
+			if (argv[i] == NULL || atoi(argv[i]) < 0) error(1);
+			bot_wait = 1000 * atoi(argv[i]);
+		} else if (strcmp(argv[i], "-r") == 0) {
+			i += 1; // next argument is the bot's random move percentage
+			if (argv[i] == NULL) error(1);
+			bot_random = atoi(argv[i]);
+			if (bot_random < 0 || bot_random > 100) error(1);
+		} else if (strcmp(argv[i], "-v") == 0) {
+			i += 1; // next argument is a variant spec
+			if (argv[i] == NULL || variant_parse(argv[i]) < 0) error(1);
+		} else if (strcmp(argv[i], "-l") == 0) {
+			i += 1; // next argument is the log directory
+			if ( (log_dir = argv[i]) == NULL ) error(1);
+		} else if (strcmp(argv[i], "-t") == 0) {
+			i += 1; // next argument is the handshake deadline
+			if (argv[i] == NULL || atoi(argv[i]) < 0) error(1);
+			handshake_ms = 1000 * atoi(argv[i]);
+		} else if (strcmp(argv[i], "-i") == 0) {
+			i += 1; // next argument is the idle deadline
+			if (argv[i] == NULL || atoi(argv[i]) < 0) error(1);
+			idle_ms = 1000 * atoi(argv[i]);
+		} else if (strcmp(argv[i], "-m") == 0) {
+			i += 1; // next argument is the move clock
+			if (argv[i] == NULL || atoi(argv[i]) < 0) error(1);
+			move_clock = 1000 * atoi(argv[i]);
+		} else if (strcmp(argv[i], "-c") == 0) {
+			i += 1; // next argument is the cluster's node list
+			if ( (cluster_file = argv[i]) == NULL ) error(1);
+		} else if (strcmp(argv[i], "-n") == 0) {
+			i += 1; // next argument is our node
+			if (argv[i] == NULL || (node_id = atoi(argv[i])) < 0) error(1);
+		} else if (strcmp(argv[i], "-T") == 0) {
+			i += 1; // next argument is the tournament format and roster
+			if (argv[i] == NULL || (tourney_file = strchr(argv[i], ':')) == NULL) error(1);
+			char format[8]; // argv is left whole, to run again in a hot restart
+			snprintf(format, sizeof(format), "%.*s", (int) (tourney_file++ - argv[i]), argv[i]);
+			if (strcmp(format, "rr") == 0) tourney_format = TOURNEY_ROUND_ROBIN;
+			else if (strcmp(format, "single") == 0) tourney_format = TOURNEY_SINGLE;
+			else if (strcmp(format, "double") == 0) tourney_format = TOURNEY_DOUBLE;
+			else error(1);
+		} else if (strcmp(argv[i], "-F") == 0) {
+			i += 1; // next argument is the tournament forfeit time
+			if (argv[i] == NULL || atoi(argv[i]) < 1) error(1);
+			forfeit_ms = 1000 * atoi(argv[i]);
+		} else if (strcmp(argv[i], "-R") == 0) {
+			i += 1; // next argument is the ratings file
+			if ( (rating_file = argv[i]) == NULL ) error(1);
+		} else if (strcmp(argv[i], "-P") == 0) {
+			i += 1; // next argument is the rating band width
+			if (argv[i] == NULL || (rating_band = atoi(argv[i])) < 1) error(1);
+		}
+		else if (argv[i][0] != '-' && password == NULL) password = argv[i];
+		else error(1);
+	}
+	char *env = getenv("NIM_NODELAY");
+	if (env != NULL && strcmp(env, "0") == 0) nodelay = 0;
+	if ( (env = getenv("NIM_UPGRADE")) != NULL ) { // a hot restart
+		upgrade_sock = atoi(env);
+		fcntl(upgrade_sock, F_SETFD, FD_CLOEXEC);
+		unsetenv("NIM_UPGRADE");
+	}
+	if (cluster_file != NULL) { // listen on our node's ports
+		if (nshards > 1) error(1);
+		if (cluster_load(&cluster, cluster_file) < 0 || node_id >= cluster.n) error(14);
+		cluster_join(&cluster, node_id);
+		query_port = cluster.node[node_id].query_port;
+		play_port = cluster.node[node_id].play_port;
+	}
+	if (rating_band > 0 && rating_file == NULL) error(1);
+	if (tourney_file != NULL) { // entrants must all come to one reactor
+		if (nshards > 1 || cluster_file != NULL) error(1);
+		if (tourney_load(&tourney, tourney_format, tourney_file) < 0) error(15);
+		tourney.forfeit_ms = forfeit_ms;
+		tourney.start = entrant_start;
+		tourney.release = entrant_release;
+	}
+	srand(time(NULL) ^ getpid());
+	snapshot_init(&snapshot);
+	queue_init(&lobby);
+	registry_init(&registry);
+	if (upgrade_sock >= 0 && (env = getenv("NIM_METRICS")) != NULL) {
+		// carry on counting where the old server did
+		if (metrics_attach(atoi(env)) < 0) fprintf(stderr, "nim_server: no metrics\n");
+	} else if (metrics_create() < 0) fprintf(stderr, "nim_server: no metrics\n");
+	if (log_dir != NULL && upgrade_sock < 0) { // cut off whatever a crash left half written
+		if (mkdir(log_dir, 0755) < 0 && errno != EEXIST) error(12);
+		long lost = log_recover(log_dir);
+		if (lost > 0) fprintf(stderr, "nim_server: game log recovered, "
+				"%ld bytes dropped\n", lost);
+	}
+
+	// With several shards the master forks one reactor process per shard
+	// and only supervises; run_master() returns in each shard.
+	if (nshards > 1) run_master();
+	serve();
+	exit(0);
+
+} // end main //////////////////////////////////////////////////////////////////
+
+// Run one reactor: initialize query and play sockets, create address file,
+// and loop forever reacting to readiness on the query and play sockets and
+// on every client connection, never blocking on any single client.
+void serve() {
+	if (upgrade_sock >= 0) upgrade_listeners();
+	else {
+		init_query_sock();
+		init_play_sock();
+	}
+	if (cluster_file != NULL && gossip_sock < 0) init_gossip_sock();
+	init_query_batch();
+	if (shard_id == 0 && owns_addr_file()) init_addr_file();
+	init_event_loop();
+	init_signal_fd();
+	timer_init(&timers);
+	if (gossip_sock >= 0) timer_arm(&timers, &gossip_timer, 0, gossip_round);
+	if (tourney.n > 0 && tourney_begin(&tourney) < 0) error(15);
+	if (rating_file != NULL && rating_open(&ratings, rating_file) < 0) error(16);
+	metrics_claim();
+	if (log_dir != NULL) {
+		if (log_open(&game_log, log_dir) < 0) error(12);
+		if (shard_id == 0 && log_start_committer(log_dir) < 0) error(12);
+	}
+	if (upgrade_sock >= 0) upgrade_adopt();
+	if (nworkers == 0) init_pool();
+
+	struct epoll_event events[NIM_MAX_EVENTS];
+	int active, i, timeout;
+	// embed signal handlers
+	if (signal(SIGUSR2, usr2handler) == SIG_ERR) error(9);
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) error(9);
+	for ( ; ; ) { 
+	
+		// Wait for events up to the next timer, or 1s for the lobby's
+		// periodic work, and dispatch them, then fire the timers due.
+		timeout = timer_timeout(&timers, now_ms());
+		if (timeout < 0 || timeout > 1000) timeout = 1000;
+		active = epoll_wait(epfd, events, NIM_MAX_EVENTS, timeout);
+		if (active < 0) {
+			if (errno == EINTR) continue;
+			error(5);
+		}
+		for (i = 0; i < active; i++) {
+			struct nim_source *src = events[i].data.ptr;
+			switch (src->kind) {
+			case SRC_QUERY: handle_query(); break;
+			case SRC_PLAY: accept_players(); break;
+			case SRC_SIGNAL: handle_signals(); break;
+			case SRC_CONN:
+				conn_event((struct nim_conn *) src, events[i].events);
+				break;
+			case SRC_PLAYER:
+				match_event(epfd, (struct nim_player *) src, events[i].events);
+				break;
+			case SRC_MAILBOX: handle_mailbox(); break;
+			case SRC_WORKER:
+				worker_event((struct nim_worker *) src, events[i].events);
+				break;
+			case SRC_WATCHER:
+				watch_event(epfd, (struct nim_watcher *) src, events[i].events);
+				break;
+			case SRC_CHILD: child_event((struct nim_child *) src); break;
+			case SRC_GOSSIP: handle_gossip(); break;
+			case SRC_RELAY:
+				relay_event((struct nim_relay_end *) src, events[i].events);
+				break;
+			case SRC_UPGRADE: upgrade_event(); break;
+			}
+		}
+		timer_advance(&timers, now_ms());
+		pair_waiting();
+		ev_reap();
+		publish_lobby();
+	} // end server loop
+}
+
+// Fork a reactor process per shard and restart any that die. Returns only
+// in the shard processes, with shard_id set.
+void run_master() {
+	int i, pid, status;
+	if ( (shared = shard_map(nshards)) == NULL ) error(11);
+	for (i = 0; i < nshards; i++) {
+		if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+				mailbox[i]) < 0) error(11);
+	}
+	if (signal(SIGUSR1, master_usr1handler) == SIG_ERR) error(9);
+	if (signal(SIGUSR2, master_usr2handler) == SIG_ERR) error(9);
+	if (signal(SIGHUP, master_huphandler) == SIG_ERR) error(9);
+	for (i = 0; i < nshards; i++) {
+		if ( (pid = fork()) < 0 ) error(10);
+		if (pid == 0) { start_shard(i); return; }
+		shard_pids[i] = pid;
+	}
+	for ( ; ; ) {
+		if ( (pid = wait(&status)) < 0 ) {
+			if (errno == EINTR) continue;
+			error(11);
+		}
+		metrics_release(pid);
+		for (i = 0; i < nshards && shard_pids[i] != pid; i++) ;
+		if (i == nshards) continue;
+		// a shard that cannot set up its sockets will not do better on
+		// restart, so stop the whole server
+		if (WIFEXITED(status) && WEXITSTATUS(status) >= 2
+				&& WEXITSTATUS(status) <= 5) {
+			shard_pids[i] = 0;
+			for (i = 0; i < nshards; i++)
+				if (shard_pids[i] > 0) kill(shard_pids[i], SIGUSR2);
+			remove("nim.conf");
+			error(11);
+		}
+		if (shared->cross_waiter == i) shard_withdraw(shared, i);
+		memset(&shared->shard[i], 0, sizeof(struct nim_shard_info));
+		if ( (pid = fork()) < 0 ) error(10);
+		if (pid == 0) { start_shard(i); return; }
+		shard_pids[i] = pid;
+	}
+}
+
+// Become shard i, exiting along with the master.
+void start_shard(int i) {
+	shard_id = i;
+	memset(shard_pids, 0, sizeof(shard_pids));
+	if (signal(SIGUSR2, usr2handler) == SIG_ERR) error(9);
+	prctl(PR_SET_PDEATHSIG, SIGUSR2);
+}
+
+// Publish this shard's lobby summary for the other shards' queries.
+void publish_lobby() {
+	if (shared == NULL || published == snapshot.version) return;
+	published = snapshot.version;
+	shard_publish(&shared->shard[shard_id], snapshot.inprog,
+			snapshot.resp.waiting, snapshot.resp.games);
+}
+
+// Take the signals pending on the signalfd: dump the trace on SIGUSR1,
+// reap children on SIGCHLD, and restart in place on SIGHUP.
+void handle_signals() {
+	struct signalfd_siginfo info;
+	int dump = 0, restart = 0;
+	while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGUSR1) dump = 1;
+		if (info.ssi_signo == SIGHUP) restart = 1;
+	}
+	if (dump) usr1handler();
+	reap_games();
+	if (restart) hot_restart();
+}
+
+// Reap every exited child and drop finished match servers from the games
+// registry. Workers are accounted for through their sockets.
+void reap_games() {
+	struct nim_game *game;
+	int pid, status;
+	while ( (pid = waitpid(-1, &status, WNOHANG)) > 0 ) {
+		trace(TR_REAP, pid);
+		metrics_release(pid);
+		if ( (game = registry_pid(&registry, pid)) != NULL ) {
+			reap_result(game);
+			remove_game(game);
+		}
+	}
+}
+
+// Block SIGCHLD, SIGUSR1 and SIGHUP and take them through a signalfd on
+// the event loop instead.
+void init_signal_fd() {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) error(9);
+	if ( (sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 )
+		error(9);
+	signal_src.kind = SRC_SIGNAL; signal_src.fd = sigfd;
+	if (ev_add(epfd, &signal_src, EPOLLIN) < 0) error(5);
+}
+
+// Point each receive slot at its buffer and address once.
+void init_query_batch() {
+	int i;
+	memset(q_msgs, 0, sizeof(q_msgs));
+	memset(r_msgs, 0, sizeof(r_msgs));
+	for (i = 0; i < NIM_QUERY_BATCH; i++) {
+		q_iov[i].iov_base = q_buf[i];
+		q_iov[i].iov_len = NIM_QUERY_MAX;
+		q_msgs[i].msg_hdr.msg_iov = &q_iov[i];
+		q_msgs[i].msg_hdr.msg_iovlen = 1;
+		q_msgs[i].msg_hdr.msg_name = &q_from[i];
+		r_msgs[i].msg_hdr.msg_iov = &r_iov[i];
+		r_msgs[i].msg_hdr.msg_iovlen = 1;
+		r_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+}
+
+// Drain pending client queries in batches and answer every one with a
+// correct password from the ready-made response.
+void handle_query() {
+	int num, i, len, replies, sent, bucket;
+	struct nim_query_response *response = &snapshot.resp;
+	q_wakeups += 1;
+	do {
+		// Receive a batch of client queries.
+		for (i = 0; i < NIM_QUERY_BATCH; i++)
+			q_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		num = recvmmsg(query_sock, q_msgs, NIM_QUERY_BATCH, MSG_DONTWAIT, NULL);
+		if (num <= 0) break;
+		q_batches += 1;
+		q_packets += num;
+		metrics_add(M_QUERIES, num);
+		trace(TR_QUERY, num);
+		for (bucket = 0; bucket < 7 && (2 << bucket) <= num; bucket++) ;
+		q_sizes[bucket] += 1;
+		if (shared != NULL) {
+			merge_shards();
+			response = &merged;
+		} else if (gossip_sock >= 0) {
+			merge_nodes();
+			response = &merged;
+		}
+
+		// If password enabled, check passwords and queue responses: a
+		// LOBBY frame for a v2 QUERY frame, otherwise the response struct.
+		replies = 0;
+		lobby_len = report_len = -1;
+		for (i = 0; i < num; i++) {
+			struct nim_cursor c;
+			len = q_msgs[i].msg_len;
+			int type = frame_datagram(q_buf[i], len, &c);
+			if (type == FRAME_QUERY || type == FRAME_METRICS || type == FRAME_STANDINGS
+					|| type == FRAME_RANK || type == FRAME_TOP) {
+				char pass[20], handle[20];
+				unsigned first = 0;
+				unsigned char *reply = leaders_frame;
+				get_str(&c, pass);
+				if ((type == FRAME_STANDINGS || type == FRAME_TOP) && c.left >= 4)
+					first = get_u32(&c);
+				if (type == FRAME_RANK) get_str(&c, handle);
+				if (c.bad) continue;
+				if ( (password != NULL) && (strcmp(password, pass)) ) continue;
+				if (type == FRAME_STANDINGS || type == FRAME_RANK || type == FRAME_TOP) {
+					// answered on its own, too big or too particular to share
+					if (type == FRAME_STANDINGS) {
+						reply = table_frame;
+						len = tourney_table(&tourney, first < NIM_TOURNEY_MAX
+								? first : NIM_TOURNEY_MAX, table_frame, sizeof(table_frame));
+					} else if (type == FRAME_RANK)
+						len = rating_encode(&ratings, handle, leaders_frame, sizeof(leaders_frame));
+					else len = rating_leaders(&ratings, first, leaders_frame, sizeof(leaders_frame));
+					if (len > 0 && sendto(query_sock, reply, len, 0,
+							(struct sockaddr *) &q_from[i], sizeof(struct sockaddr_in)) == len)
+						q_replies += 1;
+					continue;
+				} else if (type == FRAME_METRICS) {
+					if (report_len < 0) report_len = encode_report();
+					r_iov[replies].iov_base = report_frame;
+					r_iov[replies].iov_len = report_len;
+				} else {
+					if (lobby_len < 0) lobby_len = encode_lobby(response);
+					r_iov[replies].iov_base = lobby_frame;
+					r_iov[replies].iov_len = lobby_len;
+				}
+			} else {
+				if (len < NIM_QUERY_MIN) continue; // short query
+				q_buf[i][len < sizeof(struct nim_query) ? len : sizeof(struct nim_query)] = '\0';
+				if ( (password != NULL) && (strcmp(password, q_buf[i])) ) continue;
+				r_iov[replies].iov_base = response;
+				r_iov[replies].iov_len = sizeof(*response);
+			}
+			r_msgs[replies].msg_hdr.msg_name = &q_from[i];
+			replies += 1;
+		}
+
+		// Respond to the whole batch at once.
+		for (i = 0; i < replies; i += sent) {
+			sent = sendmmsg(query_sock, r_msgs + i, replies - i, 0);
+			if (sent <= 0) break;
+			q_replies += sent;
+		}
+	} while (num == NIM_QUERY_BATCH);
+}
+
+// Encode a query response as a LOBBY frame, listing the games from its
+// string without the holes left by finished ones. Returns the frame size.
+int encode_lobby(struct nim_query_response *response) {
+	struct nim_frame f;
+	char games[LINE_MAX], *h1, *h2, *save;
+	int count = 0, count_at;
+	frame_begin(&f, lobby_frame, sizeof(lobby_frame), FRAME_LOBBY);
+	frame_u32(&f, ntohl(response->inprog));
+	frame_str(&f, response->waiting);
+	count_at = f.len;
+	frame_u16(&f, 0);
+	memcpy(games, response->games, LINE_MAX);
+	games[LINE_MAX - 1] = '\0';
+	for (h1 = strtok_r(games, ":", &save); h1 != NULL; h1 = strtok_r(NULL, ":", &save)) {
+		if ( (h2 = strtok_r(NULL, ":", &save)) == NULL ) break;
+		frame_str(&f, h1);
+		frame_str(&f, h2);
+		count += 1;
+	}
+	lobby_frame[count_at] = count >> 8;
+	lobby_frame[count_at + 1] = count & 0xFF;
+	return frame_end(&f);
+}
+
+// Encode the metrics of every process as a REPORT frame. Returns the
+// frame size.
+int encode_report() {
+	struct nim_frame f;
+	frame_begin(&f, report_frame, sizeof(report_frame), FRAME_REPORT);
+	f.len += metrics_report((char *) report_frame + f.len, sizeof(report_frame) - f.len);
+	return frame_end(&f);
+}
+
+// Report query batching statistics.
+void print_query_stats() {
+	int i;
+	if (q_wakeups == 0) return;
+	fprintf(stderr, "nim_server: %lld queries, %lld answered, %lld wakeups, "
+			"%lld batches, %.2f per batch\n", q_packets, q_replies, q_wakeups,
+			q_batches, q_batches ? (double) q_packets / q_batches : 0.0);
+	fprintf(stderr, "nim_server: batch sizes");
+	for (i = 0; i < 8; i++)
+		fprintf(stderr, " %d-%d:%lld", 1 << i, (2 << i) - 1, q_sizes[i]);
+	fprintf(stderr, "\n");
+}
+
+// Rebuild the merged response of every shard's summary, starting with our
+// own, if any shard has published since it was last built.
+void merge_shards() {
+	int i, len, add, total, changed = 0;
+	struct nim_shard_info copy;
+	publish_lobby();
+	for (i = 0; i < nshards; i++) {
+		unsigned seq = __atomic_load_n(&shared->shard[i].seq, __ATOMIC_ACQUIRE);
+		if (seq != merged_seq[i]) changed = 1;
+	}
+	if (!changed) return;
+	memcpy(&merged, &snapshot.resp, sizeof(merged));
+	total = snapshot.inprog;
+	len = snapshot.len;
+	for (i = 0; i < nshards; i++) {
+		if (i == shard_id) {
+			merged_seq[i] = shared->shard[i].seq;
+			continue;
+		}
+		merged_seq[i] = shard_read(&shared->shard[i], &copy);
+		total += copy.inprog;
+		if (merged.waiting[0] == 0) strcpy(merged.waiting, copy.waiting);
+		add = strlen(copy.games);
+		if (len + add >= LINE_MAX) continue;
+		memcpy(merged.games + len, copy.games, add + 1);
+		len += add;
+	}
+	merged.inprog = htonl(total);
+}
+
+// Rebuild the merged response of every live node's news, starting with our
+// own lobby, if anything has changed since it was last built.
+void merge_nodes() {
+	long long now = now_ms();
+	int i, len, add, total;
+	struct nim_node *node;
+	if (merged_news == cluster.version && merged_snap == snapshot.version) return;
+	merged_news = cluster.version;
+	merged_snap = snapshot.version;
+	memcpy(&merged, &snapshot.resp, sizeof(merged));
+	total = snapshot.inprog;
+	len = snapshot.len;
+	for (i = 0; i < cluster.n; i++) {
+		if (i == cluster.self || !cluster_live(&cluster, i, now)) continue;
+		node = &cluster.node[i];
+		total += node->inprog;
+		if (merged.waiting[0] == 0) strcpy(merged.waiting, node->waiting);
+		add = strlen(node->games);
+		if (len + add >= LINE_MAX) continue;
+		memcpy(merged.games + len, node->games, add + 1);
+		len += add;
+	}
+	merged.inprog = htonl(total);
+}
+
+// Take in the news other nodes send.
+void handle_gossip() {
+	struct nim_cursor c;
+	int num;
+	for ( ; ; ) {
+		num = recv(gossip_sock, gossip_buf, NIM_GOSSIP_MAX, 0);
+		if (num < 0 && errno == EINTR) continue;
+		if (num < 0) return;
+		if (frame_datagram(gossip_buf, num, &c) == FRAME_GOSSIP)
+			gossip_merge(&cluster, &c, password ? password : "", now_ms());
+	}
+}
+
+// Gossip round: refresh our own news, mark nodes gone quiet as down, and
+// tell a few other nodes at random all the news still fresh.
+void gossip_round(struct nim_timer *t) {
+	struct nim_qentry *lone = queue_lone(&lobby, 0);
+	long long now = now_ms();
+	int i, k, to, size, first = rand() % (cluster.n > 1 ? cluster.n - 1 : 1);
+	cluster_publish(&cluster, snapshot.inprog, lobby.count + snapshot.inprog,
+			snapshot.resp.waiting, lone ? CONN_OF(lone)->handle : "",
+			snapshot.resp.games, now);
+	cluster_expire(&cluster, now);
+	for (k = 0; k < NIM_GOSSIP_FANOUT && k < cluster.n - 1; k++) {
+		if ( (to = (first + k) % (cluster.n - 1)) >= cluster.self ) to += 1;
+		for (i = 0; i < cluster.n; i++) {
+			if (i == to || !cluster_live(&cluster, i, now)) continue;
+			size = gossip_encode(&cluster, i, password ? password : "", gossip_buf);
+			sendto(gossip_sock, gossip_buf, size, 0,
+					(struct sockaddr *) &cluster.node[to].addr, sizeof(struct sockaddr_in));
+		}
+	}
+	timer_arm(&timers, t, NIM_GOSSIP_INTERVAL, gossip_round);
+}
+
+// Accept every pending play connection and start its handshake. Out of
+// descriptors, give up the spare to accept and close each one waiting, as
+// the play socket would otherwise stay ready and the loop spin.
+void accept_players() {
+	int new_sock;
+	if (spare_fd < 0) spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	for ( ; ; ) {
+		socklen_t p_size = sizeof(p_from);
+		new_sock = accept4(play_sock, (struct sockaddr*) &p_from, &p_size,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if ((errno != EMFILE && errno != ENFILE) || spare_fd < 0) return;
+			close(spare_fd);
+			if ( (new_sock = accept(play_sock, NULL, NULL)) >= 0 ) close(new_sock);
+			spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+			if (new_sock < 0) return;
+			continue;
+		}
+		struct nim_conn *conn = slab_alloc(&conn_slab);
+		if (conn == NULL) { close(new_sock); continue; }
+		if (nodelay) set_nodelay(new_sock);
+		conn->src.kind = SRC_CONN;
+		conn->src.fd = new_sock;
+		conn->state = CONN_PASSWORD;
+		conn->accept_us = now_us();
+		link_conn(conn);
+		metrics_count(M_ACCEPTS);
+		trace(TR_ACCEPT, new_sock);
+		if (ev_add(epfd, &conn->src, EPOLLIN) < 0) {
+			close_conn(conn);
+			continue;
+		}
+		if (handshake_ms > 0) timer_arm(&timers, &conn->timer, handshake_ms, conn_timeout);
+	}
+}
+
+// Advance a client connection's handshake on readiness.
+void conn_event(struct nim_conn *conn, unsigned events) {
+	int sock = conn->src.fd;
+	int done;
+
+	// Flush pending output first.
+	if (events & EPOLLOUT) {
+		if ( (done = nb_flush(sock, &conn->out)) < 0 ) { close_conn(conn); return; }
+		if (done && conn->state == CONN_CLOSING) { close_conn(conn); return; }
+		if (done && conn->state == CONN_JOINING) { queue_player(conn); return; }
+		if (done && conn->state == CONN_WATCHING) { watch_game(conn, 0); return; }
+		if (done) ev_mod(epfd, &conn->src, EPOLLIN);
+	}
+
+	// A queued client sends nothing until paired, so this is a hangup.
+	if (conn->state == CONN_QUEUED || conn->state == CONN_RELAYING) {
+		if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) close_conn(conn);
+		return;
+	}
+	if (conn->state == CONN_CLOSING) return;
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+
+	// The first byte tells a v2 client's HELLO frame, whose length begins
+	// with 0, from an old client's <P>.
+	if (conn->version == 0) {
+		unsigned char first;
+		int num = recv(sock, &first, 1, MSG_PEEK);
+		if (num < 0 && (errno == EAGAIN || errno == EINTR)) return;
+		if (num <= 0) { close_conn(conn); return; }
+		conn->version = (first == 0) ? 2 : 1;
+	}
+	if (conn->version >= 2) { conn_frames(conn); return; }
+
+	// Read toward the next handshake message.
+	done = nb_fill(sock, &conn->msg, &conn->have, sizeof(struct nim_msg));
+	if (done < 0) { close_conn(conn); return; }
+	if (done == 0) return;
+	conn->have = 0;
+
+	if (conn->state == CONN_PASSWORD) {
+		// Check password if enabled, then request client handle.
+		char rec_pass[20];
+		memcpy(rec_pass, conn->msg.data, 20);
+		rec_pass[19] = '\0';
+		memset(&conn->msg, 0, sizeof(struct nim_msg));
+		if ( (password == NULL) || (!strcmp(password, rec_pass)) ) {
+			conn->msg.type = 'H';
+			conn->state = CONN_HANDLE;
+			trace(TR_PASSWORD, sock);
+		} else { // incorrect password, notify client and close socket
+			conn->msg.type = 'X';
+			conn->state = CONN_CLOSING;
+			metrics_count(M_BAD_PASSWORDS);
+			trace(TR_BAD_PASSWORD, sock);
+		}
+		nb_queue(&conn->out, &conn->msg, sizeof(struct nim_msg));
+		conn_reply(conn);
+	} else if (conn->state == CONN_HANDLE) {
+		// Process client handle and set client to wait or play.
+		memcpy(conn->handle, conn->msg.data, 20);
+		conn->handle[19] = '\0';
+		trace(TR_HANDLE, sock);
+		conn->bucket = rating_bucket(conn);
+		queue_player(conn);
+	}
+}
+
+// Take a v2 client's HELLO and JOIN or WATCH frames, which may arrive
+// together, and answer with WELCOME or REJECT.
+void conn_frames(struct nim_conn *conn) {
+	struct nim_cursor c;
+	struct nim_frame f;
+	unsigned char buf[16];
+	char data[20];
+	int type, version, reason = 0, node = -1;
+	if (frame_read(conn->src.fd, &conn->in) < 0) { close_conn(conn); return; }
+	while (conn->state != CONN_JOINING && conn->state != CONN_WATCHING
+			&& conn->state != CONN_CLOSING && (type = frame_next(&conn->in, &c)) != 0) {
+		if (conn->state == CONN_PASSWORD && type == FRAME_HELLO) {
+			// Agree on a version and check password if enabled.
+			version = get_u8(&c);
+			get_str(&c, data);
+			if (c.bad) reason = REJECT_PROTOCOL;
+			else if (version < 2) reason = REJECT_VERSION;
+			else if (password != NULL && strcmp(password, data)) reason = REJECT_PASSWORD;
+			if (reason) break;
+			conn->version = version < NIM_VERSION ? version : NIM_VERSION;
+			frame_begin(&f, buf, sizeof(buf), FRAME_WELCOME);
+			frame_u8(&f, conn->version);
+			nb_queue(&conn->out, buf, frame_end(&f));
+			conn->state = CONN_HANDLE;
+			trace(TR_PASSWORD, conn->src.fd);
+		} else if (conn->state == CONN_HANDLE && (type == FRAME_JOIN || type == FRAME_RELAY)) {
+			// Take the handle and any variant asked for. A player joining
+			// the wrong node of a cluster is sent to the right one, but not
+			// one relayed to pair here.
+			get_str(&c, conn->handle);
+			if (c.left > 0) {
+				get_str(&c, data);
+				if ( (conn->variant = variant_find(data)) < 0 ) {
+					reason = c.bad ? REJECT_PROTOCOL : REJECT_VARIANT;
+					break;
+				}
+			}
+			if (c.bad) { reason = REJECT_PROTOCOL; break; }
+			if (type == FRAME_JOIN && gossip_sock >= 0 && (node = cluster_owner(&cluster,
+					conn->handle, now_ms())) != cluster.self) break;
+			conn->bucket = type == FRAME_JOIN ? rating_bucket(conn) : conn->variant;
+			conn->state = CONN_JOINING;
+			trace(TR_HANDLE, conn->src.fd);
+		} else if (conn->state == CONN_HANDLE && type == FRAME_WATCH) {
+			// Take the handle of the player to watch.
+			get_str(&c, conn->handle);
+			if (c.bad) { reason = REJECT_PROTOCOL; break; }
+			conn->state = CONN_WATCHING;
+		} else {
+			reason = REJECT_PROTOCOL;
+			break;
+		}
+	}
+	if (reason) {
+		if (reason == REJECT_PASSWORD) {
+			metrics_count(M_BAD_PASSWORDS);
+			trace(TR_BAD_PASSWORD, conn->src.fd);
+		}
+		frame_begin(&f, buf, sizeof(buf), FRAME_REJECT);
+		frame_u8(&f, reason);
+		nb_queue(&conn->out, buf, frame_end(&f));
+		conn->state = CONN_CLOSING;
+	} else if (node >= 0 && node != cluster.self) {
+		redirect_conn(conn, node);
+		return;
+	}
+	conn_reply(conn);
+}
+
+// Send a v2 client to the node of the cluster it should have come to.
+void redirect_conn(struct nim_conn *conn, int node) {
+	struct nim_frame f;
+	unsigned char buf[16];
+	frame_begin(&f, buf, sizeof(buf), FRAME_REDIRECT);
+	frame_u8(&f, node);
+	nb_queue(&conn->out, buf, frame_end(&f));
+	conn->state = CONN_CLOSING;
+	metrics_count(M_REDIRECTS);
+	trace(TR_REDIRECT, node);
+	conn_reply(conn);
+}
+
+// Send handshake replies. A rejected client is closed and a joined one
+// queued once they are out; otherwise wait for the socket to drain.
+void conn_reply(struct nim_conn *conn) {
+	int done = nb_flush(conn->src.fd, &conn->out);
+	if (done < 0 || (done && conn->state == CONN_CLOSING)) close_conn(conn);
+	else if (done && conn->state == CONN_JOINING) queue_player(conn);
+	else if (done && conn->state == CONN_WATCHING) watch_game(conn, 0);
+	else if (!done) ev_mod(epfd, &conn->src, EPOLLIN | EPOLLOUT);
+}
+
+// Send a spectator to the game it asked to watch, wherever that is hosted:
+// an in-process match takes the socket itself, a pool worker or forked
+// match server is sent it over its control socket, and a game on another
+// shard is found in that shard's summary and the spectator handed over, or
+// on another node in its news and the spectator redirected. A spectator
+// with no game to watch is turned away.
+void watch_game(struct nim_conn *conn, int handed) {
+	struct nim_game *game = registry_find(&registry, conn->handle);
+	struct nim_match_assign assign;
+	struct nim_frame f;
+	unsigned char buf[16];
+	int control = -1, shard, node;
+	if (game != NULL && game->match != NULL) {
+		ev_del(epfd, &conn->src);
+		if (match_watch(epfd, game->match, conn->src.fd) < 0) {
+			close_conn(conn);
+			return;
+		}
+		retire_conn(conn);
+		return;
+	}
+	if (game != NULL)
+		control = (game->worker >= 0) ? workers[game->worker].src.fd : game->control;
+	if (control >= 0) {
+		memset(&assign, 0, sizeof(assign));
+		assign.id = game->id;
+		assign.watch = 1;
+		if (send_fds(control, &assign, sizeof(assign), &conn->src.fd, 1) == 0) {
+			close_conn(conn); // the match has the socket now
+			return;
+		}
+	} else if (game == NULL && !handed && shared != NULL
+			&& (shard = shard_find(shared, shard_id, conn->handle)) >= 0
+			&& handoff_player(conn, shard) == 0)
+		return;
+	else if (game == NULL && gossip_sock >= 0
+			&& (node = cluster_find(&cluster, conn->handle, now_ms())) >= 0) {
+		redirect_conn(conn, node);
+		return;
+	}
+	frame_begin(&f, buf, sizeof(buf), FRAME_REJECT);
+	frame_u8(&f, REJECT_WATCH);
+	nb_queue(&conn->out, buf, frame_end(&f));
+	conn->state = CONN_CLOSING;
+	conn_reply(conn);
+}
+
+// Set client to wait for an opponent; pairing happens once per loop pass.
+// A tournament entrant waits for its next match instead, playing on the
+// default board, and one already waiting cannot join twice.
+void queue_player(struct nim_conn *conn) {
+	struct nim_entrant *e;
+	conn->queued_us = now_us();
+	if (conn->accept_us > 0) // not a player handed over by another shard
+		metrics_record(H_HANDSHAKE, conn->queued_us - conn->accept_us);
+	conn->state = CONN_QUEUED;
+	if ( (e = tourney_entrant(&tourney, conn->handle)) != NULL ) {
+		if (e->conn != NULL) { close_conn(conn); return; }
+		timer_cancel(&timers, &conn->timer);
+		ev_mod(epfd, &conn->src, EPOLLRDHUP);
+		trace(TR_ENTRANT, conn->src.fd);
+		conn->variant = 0;
+		conn->entrant = e;
+		tourney_arrive(&tourney, e, conn);
+		return;
+	}
+	if (idle_ms > 0) timer_arm(&timers, &conn->timer, idle_ms, conn_timeout);
+	else timer_cancel(&timers, &conn->timer);
+	ev_mod(epfd, &conn->src, EPOLLRDHUP);
+	if (conn->bucket >= NIM_MAX_VARIANTS // someone has given up on their band
+			&& queue_lone(&lobby, conn->bucket % NIM_MAX_VARIANTS) != NULL)
+		conn->bucket %= NIM_MAX_VARIANTS;
+	if (queue_push(&lobby, &conn->q, conn->bucket, now_ms()) < 0) close_conn(conn);
+}
+
+// Pairing key of a player joining the lobby: its variant, and with -P its
+// rating band too.
+int rating_bucket(struct nim_conn *conn) {
+	int rating;
+	if (rating_band == 0) return conn->variant;
+	if ( (rating = rating_of(&ratings, conn->handle)) < 0 ) rating = 0;
+	return conn->variant + NIM_MAX_VARIANTS * (1 + rating / rating_band);
+}
+
+// Let players who have waited NIM_BAND_WAIT for an opponent in their rating
+// band pair with anyone playing their variant.
+void widen_bands(long long now) {
+	struct nim_qentry *e;
+	struct nim_conn *conn;
+	for (e = queue_oldest(&lobby); e != NULL && now - e->since >= NIM_BAND_WAIT;
+			e = queue_newer(&lobby, e)) {
+		conn = CONN_OF(e);
+		if (conn->bucket >= NIM_MAX_VARIANTS
+				&& queue_rekey(&lobby, e, conn->bucket % NIM_MAX_VARIANTS) == 0)
+			conn->bucket %= NIM_MAX_VARIANTS;
+	}
+}
+
+// Pair every waiting client that has an opponent in its bucket, and give
+// clients who have waited past the bot timeout to the bot. A lone client in
+// the default bucket joins a client waiting on another shard, or else is
+// advertised to the other shards; in a cluster, a lone v2 client who has
+// waited a while is relayed to a node with a lone client of its own.
+// Clients paired by rating join the default bucket once they have waited
+// in their band long enough.
+void pair_waiting() {
+	struct nim_qentry *e;
+	int other;
+	long long now = now_ms();
+	if (rating_band > 0) widen_bands(now);
+	queue_pair(&lobby, pair_players);
+	if (bot_wait >= 0) { // whoever has waited too long plays the bot
+		while ( (e = queue_oldest(&lobby)) != NULL && now - e->since >= bot_wait ) {
+			queue_remove(&lobby, e);
+			start_bot_match(CONN_OF(e));
+		}
+	}
+	if (shared != NULL) {
+		if ( (e = queue_lone(&lobby, 0)) == NULL )
+			shard_withdraw(shared, shard_id);
+		else if ( (other = shard_claim(shared, shard_id)) < 0
+				|| handoff_player(CONN_OF(e), other) < 0 )
+			shard_advertise(shared, shard_id);
+	}
+	if (gossip_sock >= 0 && (e = queue_lone(&lobby, 0)) != NULL
+			&& CONN_OF(e)->version >= 2 && now - e->since >= NIM_RELAY_WAIT
+			&& (other = cluster_partner(&cluster, now)) >= 0)
+		relay_player(CONN_OF(e), other);
+	e = queue_oldest(&lobby);
+	snapshot_waiting(&snapshot, e != NULL ? CONN_OF(e)->handle : "");
+}
+
+// Start a tournament match between two waiting entrants, in-process
+// whatever the match mode, so that its result is seen here.
+void entrant_start(void *conn1, void *conn2) {
+	struct nim_conn *c1 = conn1, *c2 = conn2;
+	long long now = now_us();
+	c1->entrant = c2->entrant = NULL;
+	metrics_record(H_PAIRING, now - c1->queued_us);
+	metrics_record(H_PAIRING, now - c2->queued_us);
+	start_match(c1, c2);
+}
+
+// A waiting entrant has no tournament match to come: into the lobby.
+void entrant_release(void *conn) {
+	struct nim_conn *c = conn;
+	c->entrant = NULL;
+	queue_player(c);
+}
+
+// Spawn a new game for two clients taken off the queue.
+void pair_players(struct nim_qentry *e1, struct nim_qentry *e2) {
+	struct nim_conn *first = CONN_OF(e1), *conn = CONN_OF(e2);
+	long long now = now_us();
+	metrics_record(H_PAIRING, now - first->queued_us);
+	metrics_record(H_PAIRING, now - conn->queued_us);
+	trace(TR_PAIR, first->bucket);
+	if (engine_mode) start_match(first, conn);
+	else if (pool_size == 0 || assign_match(first, conn) < 0)
+		spawn_match(first, conn);
+}
+
+// Pass a player to the shard advertising a waiting player, or a spectator
+// to the shard hosting its game.
+int handoff_player(struct nim_conn *conn, int shard) {
+	struct nim_handoff handoff;
+	memset(&handoff, 0, sizeof(handoff));
+	memcpy(handoff.handle, conn->handle, 20);
+	handoff.version = conn->version;
+	handoff.watch = (conn->state == CONN_WATCHING);
+	if (send_fds(mailbox[shard][1], &handoff, sizeof(handoff),
+			&conn->src.fd, 1) < 0) return -1;
+	close_conn(conn);
+	return 0;
+}
+
+// Take in players and spectators handed over by other shards.
+void handle_mailbox() {
+	struct nim_handoff handoff;
+	int fds[8], nfds, i;
+	for ( ; ; ) {
+		if (recv_fds(mailbox[shard_id][0], &handoff, sizeof(handoff),
+				fds, &nfds) < 0) return;
+		for (i = 1; i < nfds; i++) close(fds[i]);
+		if (nfds < 1) continue;
+		struct nim_conn *conn = slab_alloc(&conn_slab);
+		if (conn == NULL) { close(fds[0]); continue; }
+		conn->src.kind = SRC_CONN;
+		conn->src.fd = fds[0];
+		memcpy(conn->handle, handoff.handle, 20);
+		conn->handle[19] = '\0';
+		conn->version = handoff.version;
+		set_nonblock(conn->src.fd, 1);
+		link_conn(conn);
+		if (ev_add(epfd, &conn->src, EPOLLRDHUP) < 0) {
+			close_conn(conn);
+			continue;
+		}
+		if (handshake_ms > 0) timer_arm(&timers, &conn->timer, handshake_ms, conn_timeout);
+		if (handoff.watch) {
+			conn->state = CONN_WATCHING;
+			watch_game(conn, 1);
+		} else queue_player(conn);
+	}
+}
+
+// Relay a lone queued player to another node, connecting to it in the
+// player's place. The player stays ours until the node welcomes it.
+void relay_player(struct nim_conn *conn, int node) {
+	struct nim_relay *r = slab_alloc(&relay_slab);
+	struct nim_frame f;
+	int sock, size;
+	if (r == NULL) return;
+	if ( (sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ) {
+		slab_free(&relay_slab, r);
+		return;
+	}
+	if (nodelay) set_nodelay(sock);
+	r->player.src.kind = r->node.src.kind = SRC_RELAY;
+	r->player.src.fd = -1;
+	r->node.src.fd = sock;
+	r->player.relay = r->node.relay = r;
+	r->node.events = EPOLLIN | EPOLLOUT;
+	if ( (connect(sock, (struct sockaddr *) &cluster.node[node].addr,
+			sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS)
+			|| ev_add(epfd, &r->node.src, r->node.events) < 0 ) {
+		close(sock);
+		slab_free(&relay_slab, r);
+		return;
+	}
+	frame_begin(&f, r->node.buf, NIM_RELAY_BUF, FRAME_HELLO);
+	frame_u8(&f, conn->version);
+	frame_str(&f, password ? password : "");
+	size = frame_end(&f);
+	frame_begin(&f, r->node.buf + size, NIM_RELAY_BUF - size, FRAME_RELAY);
+	frame_str(&f, conn->handle);
+	r->node.len = size + frame_end(&f);
+	queue_remove(&lobby, &conn->q);
+	timer_cancel(&timers, &conn->timer);
+	conn->state = CONN_RELAYING;
+	conn->relay = r;
+	r->conn = conn;
+	r->target = node;
+	timer_arm(&timers, &r->timer, NIM_RELAY_DEADLINE, relay_timeout);
+	link_relay(r);
+	metrics_count(M_RELAYS);
+	trace(TR_RELAY, node);
+}
+
+// Move bytes between a relayed player and the node it plays on. Once either
+// closes, whatever the other is still owed is written before both close.
+void relay_event(struct nim_relay_end *end, unsigned events) {
+	struct nim_relay *r = end->relay;
+	struct nim_relay_end *other = (end == &r->player) ? &r->node : &r->player;
+	int num;
+	if (r->conn != NULL) { relay_join(r, events); return; }
+	if ((events & EPOLLOUT) && relay_flush(end) < 0) { relay_close(r); return; }
+	if (!r->closing && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+		if (other->off > 0) {
+			memmove(other->buf, other->buf + other->off, other->len - other->off);
+			other->len -= other->off;
+			other->off = 0;
+		}
+		num = read(end->src.fd, other->buf + other->len, NIM_RELAY_BUF - other->len);
+		if (num > 0) {
+			other->len += num;
+			if (relay_flush(other) < 0) { relay_close(r); return; }
+		} else if (num == 0) r->closing = 1;
+		else if (errno != EAGAIN && errno != EINTR) { relay_close(r); return; }
+	}
+	if (r->closing && r->player.len == 0 && r->node.len == 0) { relay_close(r); return; }
+	relay_interest(r);
+}
+
+// Before the node welcomes a relayed player: finish connecting, send HELLO
+// and RELAY, and wait for WELCOME, which the player has had from us already.
+// Anything the node sends after it is the player's.
+void relay_join(struct nim_relay *r, unsigned events) {
+	struct nim_relay_end *node = &r->node, *player = &r->player;
+	struct nim_conn *conn = r->conn;
+	struct nim_cursor c;
+	int err = 0, num, size;
+	socklen_t len = sizeof(err);
+	if (events & EPOLLOUT) {
+		getsockopt(node->src.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0 || relay_flush(node) < 0) { relay_abort(r); return; }
+	}
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		num = read(node->src.fd, player->buf + player->len, NIM_RELAY_BUF - player->len);
+		if (num == 0 || (num < 0 && errno != EAGAIN && errno != EINTR)) {
+			relay_abort(r);
+			return;
+		}
+		if (num > 0) player->len += num;
+	}
+	if (player->len < NIM_FRAME_HEAD) { relay_interest(r); return; }
+	size = (player->buf[0] << 8 | player->buf[1]) + 2;
+	if (size > NIM_INBUF) { relay_abort(r); return; }
+	if (player->len < size) { relay_interest(r); return; }
+	if (frame_datagram(player->buf, size, &c) != FRAME_WELCOME) { // turned away
+		relay_abort(r);
+		return;
+	}
+	player->len -= size;
+	memmove(player->buf, player->buf + size, player->len);
+	// the player's socket is the relay's now
+	timer_cancel(&timers, &r->timer);
+	player->src.fd = conn->src.fd;
+	ev_del(epfd, &conn->src);
+	conn->relay = NULL;
+	retire_conn(conn);
+	r->conn = NULL;
+	player->events = EPOLLIN;
+	if (ev_add(epfd, &player->src, player->events) < 0 || relay_flush(player) < 0) {
+		relay_close(r);
+		return;
+	}
+	relay_interest(r);
+}
+
+// Write what an end is owed. Returns -1 on error.
+int relay_flush(struct nim_relay_end *end) {
+	int num;
+	while (end->off < end->len) {
+		num = write(end->src.fd, end->buf + end->off, end->len - end->off);
+		ev_writes += 1;
+		if (num < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		end->off += num;
+	}
+	end->off = end->len = 0;
+	return 0;
+}
+
+// Read from an end while the other has room for it, and wait to write to
+// it while it is owed anything.
+void relay_interest(struct nim_relay *r) {
+	struct nim_relay_end *end, *other;
+	unsigned events;
+	int i;
+	for (i = 0; i < 2; i++) {
+		end = i ? &r->node : &r->player;
+		other = i ? &r->player : &r->node;
+		if (end->src.fd < 0 || end->src.kind == SRC_DEAD) continue;
+		events = 0;
+		if (!r->closing && (r->conn != NULL || other->len < NIM_RELAY_BUF)) events |= EPOLLIN;
+		if (end->len > end->off) events |= EPOLLOUT;
+		if (events != end->events) {
+			ev_mod(epfd, &end->src, events);
+			end->events = events;
+		}
+	}
+}
+
+// The node did not welcome a relayed player: give up on it and put the
+// player back in our lobby, to wait out NIM_RELAY_WAIT before another try.
+void relay_abort(struct nim_relay *r) {
+	struct nim_conn *conn = r->conn;
+	relay_close(r);
+	conn->state = CONN_QUEUED;
+	if (queue_push(&lobby, &conn->q, conn->bucket, now_ms()) < 0) {
+		close_conn(conn);
+		return;
+	}
+	if (idle_ms > 0) timer_arm(&timers, &conn->timer, idle_ms, conn_timeout);
+}
+
+// Close both ends of a relay, leaving a player not yet welcomed to its
+// connection.
+void relay_close(struct nim_relay *r) {
+	struct nim_relay_end *end;
+	int i;
+	for (i = 0; i < 2; i++) {
+		end = i ? &r->node : &r->player;
+		if (end->src.fd >= 0) {
+			ev_del(epfd, &end->src);
+			close(end->src.fd);
+		}
+		end->src.kind = SRC_DEAD;
+	}
+	if (r->conn != NULL) r->conn->relay = NULL;
+	timer_cancel(&timers, &r->timer);
+	if (r->prev != NULL) r->prev->next = r->next;
+	else relays = r->next;
+	if (r->next != NULL) r->next->prev = r->prev;
+	ev_retire(&relay_slab, r);
+}
+
+// The node took too long to welcome a relayed player.
+void relay_timeout(struct nim_timer *t) {
+	relay_abort(TIMER_OWNER(t, struct nim_relay, timer));
+}
+
+// Keep a relay on the list of all of them.
+void link_relay(struct nim_relay *r) {
+	r->prev = NULL;
+	r->next = relays;
+	if (relays != NULL) relays->prev = r;
+	relays = r;
+}
+
+// Fork a match server for two paired clients, with a control socket over
+// which it is sent spectators.
+void spawn_match(struct nim_conn *c1, struct nim_conn *c2) {
+	int sock1 = c1->src.fd;
+	int sock2 = c2->src.fd;
+	int sv[2] = {-1, -1};
+	char handle1[20]; char handle2[20];
+	int version1 = c1->version, version2 = c2->version;
+	char spec[NIM_SPEC_MAX];
+	variant_spec(&nim_variants[c1->variant], spec);
+	strcpy(handle1, c1->handle);
+	strcpy(handle2, c2->handle);
+	ev_del(epfd, &c1->src);
+	ev_del(epfd, &c2->src);
+	retire_conn(c1); retire_conn(c2);
+
+	int child;
+	socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, sv);
+	if ( (child = fork()) < 0 ) error(10);
+	else if (child == 0) { // child
+		// server descriptors are close-on-exec; dup socket descriptors
+		// to well known values, by way of descriptors clear of them
+		int given[3] = {sock1, sock2, sv[1]}, fds[3], i;
+		for (i = 0; i < 3; i++)
+			fds[i] = given[i] < 0 ? -1 : fcntl(given[i], F_DUPFD_CLOEXEC, MATCH_SOCK_3 + 1);
+		for (i = 0; i < 3; i++) {
+			if (fds[i] >= 0) dup2(fds[i], MATCH_SOCK_1 + i);
+			if (given[i] > MATCH_SOCK_3) close(given[i]);
+		}
+		// spawn a match server for the game
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		char *env[10];
+		char envbuf1[23]; char envbuf2[23];
+		char envbuf3[16]; char envbuf4[16];
+		char envbuf5[NIM_SPEC_MAX + 8]; char envbuf6[24];
+		char envbuf7[PATH_MAX + 8]; char envbuf8[32];
+		int n = 6;
+		sprintf(envbuf1, "H1=%s", handle1);
+		sprintf(envbuf2, "H2=%s", handle2);
+		sprintf(envbuf3, "V1=%d", version1);
+		sprintf(envbuf4, "V2=%d", version2);
+		sprintf(envbuf5, "VARIANT=%s", spec);
+		env[0] = envbuf1;
+		env[1] = envbuf2;
+		env[2] = envbuf3;
+		env[3] = envbuf4;
+		env[4] = envbuf5;
+		sprintf(envbuf6, "NIM_METRICS=%d", metrics_fd);
+		env[5] = envbuf6;
+		if (log_dir != NULL) {
+			snprintf(envbuf7, sizeof(envbuf7), "NIM_LOG=%s", log_dir);
+			env[n++] = envbuf7;
+		}
+		if (move_clock > 0) {
+			sprintf(envbuf8, "NIM_MOVE_CLOCK=%d", move_clock);
+			env[n++] = envbuf8;
+		}
+		if (getenv("NIM_TURN_STATS")) env[n++] = "NIM_TURN_STATS=1";
+		env[n] = NULL;
+		char *args[2];
+		args[0] = "./nim_match_server";
+		args[1] = NULL;
+		execve("./nim_match_server", args, env);		
+		_exit(1);
+	} else { // parent
+		trace(TR_SPAWN, child);
+		// close player sockets
+		close(sock1);
+		close(sock2);
+		if (sv[1] >= 0) close(sv[1]);
+		// add match to games list
+		struct nim_game *game = add_game(child, handle1, handle2);
+		if (game != NULL) game->control = sv[0];
+		else if (sv[0] >= 0) close(sv[0]);
+	}
+}
+
+// Host a match for two paired clients on the event loop.
+void start_match(struct nim_conn *c1, struct nim_conn *c2) {
+	struct nim_match *m = slab_alloc(&match_slab);
+	if (m == NULL) { close_conn(c1); close_conn(c2); return; }
+	strcpy(m->p[0].handle, c1->handle);
+	strcpy(m->p[1].handle, c2->handle);
+	m->p[0].version = c1->version;
+	m->p[1].version = c2->version;
+	m->variant = &nim_variants[c1->variant];
+	m->done = match_done;
+	m->owner = add_game(0, c1->handle, c2->handle);
+	if (m->owner != NULL) {
+		((struct nim_game *) m->owner)->match = m;
+		trace(TR_MATCH, ((struct nim_game *) m->owner)->id);
+	}
+	// player sockets move from the handshake to the match
+	ev_del(epfd, &c1->src);
+	ev_del(epfd, &c2->src);
+	retire_conn(c1); retire_conn(c2);
+	if (match_start(epfd, m, c1->src.fd, c2->src.fd) < 0) {
+		if (m->p[0].src.fd >= 0) match_close(epfd, &m->p[0]);
+		match_close(epfd, &m->p[1]);
+	}
+}
+
+// Host a game against the bot on the event loop, whatever the match mode:
+// the bot needs no socket or process of its own. The player moves first.
+void start_bot_match(struct nim_conn *conn) {
+	struct nim_match *m = slab_alloc(&match_slab);
+	if (m == NULL) { close_conn(conn); return; }
+	strcpy(m->p[0].handle, conn->handle);
+	strcpy(m->p[1].handle, "bot");
+	metrics_record(H_PAIRING, now_us() - conn->queued_us);
+	trace(TR_BOT, conn->src.fd);
+	m->p[0].version = conn->version;
+	m->p[1].bot = 1;
+	m->variant = &nim_variants[conn->variant];
+	m->done = match_done;
+	m->owner = add_game(0, conn->handle, "bot");
+	if (m->owner != NULL) ((struct nim_game *) m->owner)->match = m;
+	ev_del(epfd, &conn->src);
+	retire_conn(conn);
+	if (match_start(epfd, m, conn->src.fd, -1) < 0) match_close(epfd, &m->p[0]);
+}
+
+// Drop a finished in-process match from the games list, reporting it to
+// any tournament.
+void match_done(struct nim_match *m) {
+	remove_game(m->owner);
+	if (!m->p[1].bot) rate_game(m->p[0].handle, m->p[1].handle, m->winner);
+	tourney_result(&tourney, m->p[0].handle, m->p[1].handle, m->winner);
+	ev_retire(&match_slab, m);
+}
+
+// Start the match worker pool.
+void init_pool() {
+	int i;
+	for (i = 0; i < pool_size; i++)
+		if (spawn_worker() < 0) error(10);
+}
+
+// Spawn a match worker holding one end of a control socket pair. Returns
+// its slot, or -1 if none is free or it could not be started.
+int spawn_worker() {
+	int i, sv[2], child;
+	for (i = 0; i < nworkers && workers[i].src.fd >= 0; i++) ;
+	if (i == NIM_MAX_WORKERS) return -1;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+		return -1;
+	if ( (child = fork()) < 0 ) {
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	} else if (child == 0) { // child
+		// the worker's end of the pair goes to a well known value
+		if (sv[1] != MATCH_SOCK_1) dup2(sv[1], MATCH_SOCK_1);
+		else fcntl(sv[1], F_SETFD, 0);
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		char *env[5];
+		char envbuf[24], logbuf[PATH_MAX + 8], clockbuf[32];
+		int n = 1;
+		sprintf(envbuf, "NIM_METRICS=%d", metrics_fd);
+		env[0] = envbuf;
+		if (log_dir != NULL) {
+			snprintf(logbuf, sizeof(logbuf), "NIM_LOG=%s", log_dir);
+			env[n++] = logbuf;
+		}
+		if (move_clock > 0) {
+			sprintf(clockbuf, "NIM_MOVE_CLOCK=%d", move_clock);
+			env[n++] = clockbuf;
+		}
+		if (getenv("NIM_TURN_STATS")) env[n++] = "NIM_TURN_STATS=1";
+		env[n] = NULL;
+		char *args[3];
+		args[0] = "./nim_match_server";
+		args[1] = "-w";
+		args[2] = NULL;
+		execve("./nim_match_server", args, env);
+		_exit(1);
+	}
+	trace(TR_SPAWN, child);
+	close(sv[1]);
+	set_nonblock(sv[0], 1);
+	workers[i].src.kind = SRC_WORKER;
+	workers[i].src.fd = sv[0];
+	workers[i].pid = child;
+	workers[i].active = 0;
+	if (ev_add(epfd, &workers[i].src, EPOLLIN) < 0) { // it exits on the hangup
+		close(sv[0]);
+		workers[i].src.fd = -1;
+		return -1;
+	}
+	if (i == nworkers) nworkers += 1;
+	return i;
+}
+
+// Hand two paired clients to the least loaded worker, growing the pool when
+// every worker is full. Returns -1 if no worker could take the match.
+int assign_match(struct nim_conn *c1, struct nim_conn *c2) {
+	int i, best = -1;
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].src.fd < 0) continue;
+		if (best < 0 || workers[i].active < workers[best].active) best = i;
+	}
+	if (best < 0 || workers[best].active >= worker_games) {
+		int grown = spawn_worker();
+		if (grown >= 0) best = grown;
+	}
+	if (best < 0) return -1;
+
+	struct nim_match_assign assign;
+	int fds[2];
+	struct nim_game *game = add_game(0, c1->handle, c2->handle);
+	if (game == NULL) return -1;
+	memset(&assign, 0, sizeof(assign));
+	assign.id = game->id;
+	strcpy(assign.handle1, c1->handle);
+	strcpy(assign.handle2, c2->handle);
+	assign.version1 = c1->version;
+	assign.version2 = c2->version;
+	if (c1->variant != 0) variant_spec(&nim_variants[c1->variant], assign.variant);
+	fds[0] = c1->src.fd;
+	fds[1] = c2->src.fd;
+	if (send_fds(workers[best].src.fd, &assign, sizeof(assign), fds, 2) < 0) {
+		remove_game(game);
+		return -1;
+	}
+	workers[best].active += 1;
+	game->worker = best;
+	trace(TR_ASSIGN, best);
+	// the worker holds the player sockets now
+	close_conn(c1);
+	close_conn(c2);
+	return 0;
+}
+
+// Collect results from a worker; a worker that goes away takes its games.
+void worker_event(struct nim_worker *w, unsigned events) {
+	struct nim_match_result result;
+	struct nim_game *cur, *next;
+	int num, index = w - workers;
+	for ( ; ; ) {
+		num = recv(w->src.fd, &result, sizeof(result), 0);
+		if (num < 0 && (errno == EAGAIN || errno == EINTR)) return;
+		if (num <= 0) break;
+		if (num != sizeof(result)) continue;
+		cur = registry_get(&registry, result.id);
+		if (cur != NULL && cur->worker == index) {
+			rate_game(cur->player1, cur->player2, result.winner - 1);
+			remove_game(cur);
+			w->active -= 1;
+		}
+	}
+	// the worker has exited or will shortly, SIGCHLD reaps it
+	for (cur = registry.live; cur != NULL; cur = next) {
+		next = cur->next;
+		if (cur->worker == index) remove_game(cur);
+	}
+	ev_del(epfd, &w->src);
+	close(w->src.fd);
+	w->src.fd = -1;
+}
+
+// Add a match to the games registry; in-process matches have no pid.
+struct nim_game *add_game(int pid, char *handle1, char *handle2) {
+	struct nim_game *game = registry_add(&registry, pid, handle1, handle2);
+	if (game != NULL) snapshot_add(&snapshot, game, registry.live);
+	return game;
+}
+
+// Rate a finished game, if keeping ratings and it was decided: winner is
+// 0 for the first player, 1 for the second.
+void rate_game(char *handle1, char *handle2, int winner) {
+	if (rating_file != NULL && winner >= 0) rating_game(&ratings, handle1, handle2, winner);
+}
+
+// Rate a forked match server's game from the result it left on its control
+// socket before exiting.
+void reap_result(struct nim_game *game) {
+	struct nim_match_result result;
+	if (game->control >= 0 && recv(game->control, &result, sizeof(result),
+			MSG_DONTWAIT) == sizeof(result))
+		rate_game(game->player1, game->player2, result.winner - 1);
+}
+
+// Drop a match from the games registry.
+void remove_game(struct nim_game *game) {
+	if (game == NULL) return;
+	if (game->control >= 0) close(game->control);
+	registry_remove(&registry, game);
+	snapshot_remove(&snapshot, game, registry.live);
+}
+
+// Drop a client connection, taking it off the queue if it was waiting.
+void close_conn(struct nim_conn *conn) {
+	queue_remove(&lobby, &conn->q);
+	if (conn->entrant != NULL) tourney_leave(&tourney, conn->entrant);
+	if (conn->relay != NULL) relay_close(conn->relay);
+	ev_del(epfd, &conn->src);
+	close(conn->src.fd);
+	retire_conn(conn);
+}
+
+// Keep a client connection on the list of all of them.
+void link_conn(struct nim_conn *conn) {
+	conn->prev = NULL;
+	conn->next = conns;
+	if (conns != NULL) conns->prev = conn;
+	conns = conn;
+}
+
+// Retire a client connection whose socket is closed or passed on.
+void retire_conn(struct nim_conn *conn) {
+	if (conn->prev != NULL) conn->prev->next = conn->next;
+	else conns = conn->next;
+	if (conn->next != NULL) conn->next->prev = conn->prev;
+	timer_cancel(&timers, &conn->timer);
+	conn->src.kind = SRC_DEAD;
+	ev_retire(&conn_slab, conn);
+}
+
+// A connection's deadline passed: one still in its handshake, or queued
+// and never paired, is closed.
+void conn_timeout(struct nim_timer *t) {
+	struct nim_conn *conn = TIMER_OWNER(t, struct nim_conn, timer);
+	if (conn->state == CONN_QUEUED) metrics_count(M_IDLE_EVICTIONS);
+	else metrics_count(M_HANDSHAKE_TIMEOUTS);
+	trace(TR_TIMEOUT, conn->src.fd);
+	close_conn(conn);
+}
+
+// On SIGHUP, run ./nim_server again with the same arguments and go on
+// serving until it says READY (see upgrade_event()). If it fails to start,
+// carry on serving.
+void hot_restart() {
+	int sv[2], child;
+	if (upgrade_child > 0) return; // one under way
+	if (shared != NULL) {
+		fprintf(stderr, "nim_server: hot restart needs a single reactor\n");
+		return;
+	}
+	if (tourney.n > 0) {
+		fprintf(stderr, "nim_server: no hot restart for a tournament server\n");
+		return;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) return;
+	if ( (child = fork()) < 0 ) {
+		close(sv[0]);
+		close(sv[1]);
+		fprintf(stderr, "nim_server: hot restart failed to fork, carrying on\n");
+		return;
+	} else if (child == 0) { // child
+		char envbuf1[16], envbuf2[16];
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		fcntl(sv[1], F_SETFD, 0);
+		sprintf(envbuf1, "%d", sv[1]);
+		setenv("NIM_UPGRADE", envbuf1, 1);
+		if (metrics_fd >= 0) {
+			sprintf(envbuf2, "%d", metrics_fd);
+			setenv("NIM_METRICS", envbuf2, 1);
+		}
+		execv("./nim_server", server_argv);
+		_exit(1);
+	}
+	trace(TR_SPAWN, child);
+	close(sv[1]);
+	upgrade_child = child;
+	upgrade_src.kind = SRC_UPGRADE;
+	upgrade_src.fd = sv[0];
+	if (ev_add(epfd, &upgrade_src, EPOLLIN) < 0) {
+		upgrade_abort("no epoll");
+		return;
+	}
+	timer_arm(&timers, &upgrade_timer, NIM_UPGRADE_WAIT, upgrade_timeout);
+}
+
+// The new server has said READY, or given up: hand it everything and exit
+// once it has taken over. Only waiting on its ACK blocks the loop, for as
+// long as it takes to restore what it was sent, and at most
+// NIM_UPGRADE_WAIT.
+void upgrade_event() {
+	struct nim_cursor c;
+	int fds[8], nfds, i, type;
+	timer_cancel(&timers, &upgrade_timer);
+	type = upgrade_recv(upgrade_src.fd, upgrade_buf, &c, fds, &nfds);
+	for (i = 0; i < nfds; i++) close(fds[i]);
+	if (type != UPG_READY) { upgrade_abort("failed"); return; }
+	if (send_state(upgrade_src.fd) == 0
+			&& upgrade_recv(upgrade_src.fd, upgrade_buf, &c, fds, &nfds) == UPG_ACK) {
+		fprintf(stderr, "nim_server: handed over to pid %d\n", upgrade_child);
+		print_query_stats();
+		match_print_stats("nim_server");
+		alloc_print_stats("nim_server");
+		metrics_release(getpid());
+		exit(0);
+	}
+	for (i = 0; i < nfds; i++) close(fds[i]);
+	upgrade_abort("failed");
+}
+
+// Give up on the new server and carry on serving.
+void upgrade_abort(char *why) {
+	timer_cancel(&timers, &upgrade_timer);
+	ev_del(epfd, &upgrade_src);
+	close(upgrade_src.fd); // the new server gives up once it sees this
+	kill(upgrade_child, SIGTERM);
+	upgrade_child = 0;
+	fprintf(stderr, "nim_server: hot restart %s, carrying on\n", why);
+}
+
+// The new server took too long to say READY.
+void upgrade_timeout(struct nim_timer *t) {
+	upgrade_abort("timed out");
+}
+
+// Send the new server the listening sockets, the pool, every game, every
+// lobby connection, queued players first in the order they queued, and
+// every player relayed to another node.
+int send_state(int sock) {
+	struct nim_frame f;
+	struct nim_game *g;
+	struct nim_watcher *w;
+	struct nim_qentry *e;
+	struct nim_conn *conn;
+	struct nim_relay *r;
+	int fds[8], n, pidfd, ret, i;
+	fds[0] = query_sock;
+	fds[1] = play_sock;
+	fds[2] = gossip_sock;
+	if (upgrade_signal(sock, UPG_LISTEN, fds, gossip_sock >= 0 ? 3 : 2) < 0) return -1;
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].src.fd < 0) continue;
+		if ( (fds[1] = pidfd_open(workers[i].pid)) < 0 ) continue; // gone
+		fds[0] = workers[i].src.fd;
+		frame_begin(&f, upgrade_buf, NIM_UPGRADE_MAX, UPG_WORKER);
+		frame_u8(&f, i);
+		frame_u32(&f, workers[i].pid);
+		frame_u32(&f, workers[i].active);
+		ret = upgrade_send(sock, &f, fds, 2);
+		close(fds[1]);
+		if (ret < 0) return -1;
+	}
+	for (g = registry.live; g != NULL; g = g->next) {
+		pidfd = -1;
+		n = 0;
+		if (g->match != NULL) {
+			frame_begin(&f, upgrade_buf, NIM_UPGRADE_MAX, UPG_MATCH);
+			frame_u32(&f, g->id);
+			n = match_save(g->match, &f, fds);
+		} else {
+			if (g->match_pid > 0 && (pidfd = pidfd_open(g->match_pid)) < 0) continue;
+			frame_begin(&f, upgrade_buf, NIM_UPGRADE_MAX, UPG_GAME);
+			frame_u32(&f, g->id);
+			frame_u32(&f, g->match_pid);
+			frame_u8(&f, g->worker + 1);
+			frame_str(&f, g->player1);
+			frame_str(&f, g->player2);
+			if (pidfd >= 0) fds[n++] = pidfd;
+			if (pidfd >= 0 && g->control >= 0) fds[n++] = g->control;
+		}
+		ret = upgrade_send(sock, &f, fds, n);
+		if (pidfd >= 0) close(pidfd);
+		if (ret < 0) return -1;
+		if (g->match == NULL) continue;
+		for (w = g->match->watchers.first; w != NULL; w = w->next) {
+			frame_begin(&f, upgrade_buf, NIM_UPGRADE_MAX, UPG_WATCHER);
+			watch_save(w, &f);
+			if (upgrade_send(sock, &f, &w->src.fd, 1) < 0) return -1;
+		}
+	}
+	for (e = lobby.order.newer; e != &lobby.order; e = e->newer)
+		if (save_conn(sock, CONN_OF(e)) < 0) return -1;
+	for (conn = conns; conn != NULL; conn = conn->next)
+		if (conn->state != CONN_QUEUED && save_conn(sock, conn) < 0) return -1;
+	for (r = relays; r != NULL; r = r->next)
+		if (r->conn == NULL && save_relay(sock, r) < 0) return -1;
+	return upgrade_signal(sock, UPG_END, NULL, 0);
+}
+
+// Send a lobby connection with its handshake state and buffers: u8 state,
+// u8 version, u16 length and the variant's spec, u8 have and the nim_msg
+// read so far, u16 length and the input buffered, the same for output,
+// str handle, then as two u32 each the time queued in ms and the accept
+// and queued times in us. A player being relayed is sent as queued, to be
+// relayed afresh.
+int save_conn(int sock, struct nim_conn *conn) {
+	struct nim_frame f;
+	char spec[NIM_SPEC_MAX];
+	variant_spec(&nim_variants[conn->variant], spec);
+	frame_begin(&f, upgrade_buf, NIM_UPGRADE_MAX, UPG_CONN);
+	frame_u8(&f, conn->state == CONN_RELAYING ? CONN_QUEUED : conn->state);
+	frame_u8(&f, conn->version);
+	frame_u16(&f, strlen(spec));
+	frame_put(&f, spec, strlen(spec));
+	frame_u8(&f, conn->have);
+	frame_put(&f, &conn->msg, sizeof(struct nim_msg));
+	frame_u16(&f, conn->in.len - conn->in.off);
+	frame_put(&f, conn->in.data + conn->in.off, conn->in.len - conn->in.off);
+	frame_u16(&f, conn->out.len - conn->out.off);
+	frame_put(&f, conn->out.data + conn->out.off, conn->out.len - conn->out.off);
+	frame_str(&f, conn->handle);
+	frame_u32(&f, conn->q.since >> 32);
+	frame_u32(&f, conn->q.since & 0xFFFFFFFF);
+	frame_u32(&f, conn->accept_us >> 32);
+	frame_u32(&f, conn->accept_us & 0xFFFFFFFF);
+	frame_u32(&f, conn->queued_us >> 32);
+	frame_u32(&f, conn->queued_us & 0xFFFFFFFF);
+	return upgrade_send(sock, &f, &conn->src.fd, 1);
+}
+
+// Send a relay the node has welcomed its player to: u8 node, u16 length and
+// the bytes owed to the player, the same for the node, u8 closing.
+int save_relay(int sock, struct nim_relay *r) {
+	struct nim_frame f;
+	int fds[2];
+	frame_begin(&f, upgrade_buf, NIM_UPGRADE_MAX, UPG_RELAY);
+	frame_u8(&f, r->target);
+	frame_u16(&f, r->player.len - r->player.off);
+	frame_put(&f, r->player.buf + r->player.off, r->player.len - r->player.off);
+	frame_u16(&f, r->node.len - r->node.off);
+	frame_put(&f, r->node.buf + r->node.off, r->node.len - r->node.off);
+	frame_u8(&f, r->closing);
+	fds[0] = r->player.src.fd;
+	fds[1] = r->node.src.fd;
+	return upgrade_send(sock, &f, fds, 2);
+}
+
+// Tell the server we are replacing that we are ready, and take its
+// listening sockets and, from a cluster node, its gossip socket.
+void upgrade_listeners() {
+	struct nim_cursor c;
+	int fds[8], nfds, i;
+	if (upgrade_signal(upgrade_sock, UPG_READY, NULL, 0) < 0
+			|| upgrade_recv(upgrade_sock, upgrade_buf, &c, fds, &nfds) != UPG_LISTEN
+			|| nfds < 2) error(13);
+	query_sock = fds[0];
+	play_sock = fds[1];
+	if (nfds > 2 && cluster_file != NULL) gossip_sock = fds[2];
+	else if (nfds > 2) close(fds[2]);
+	for (i = 3; i < nfds; i++) close(fds[i]);
+}
+
+// Take over the old server's pool, games and lobby, then tell it to go.
+// Nothing is written to any socket until the event loop runs.
+void upgrade_adopt() {
+	struct nim_cursor c;
+	struct nim_match *last = NULL; // spectators follow their match
+	int type, fds[8], nfds, i;
+	while ( (type = upgrade_recv(upgrade_sock, upgrade_buf, &c, fds, &nfds)) != UPG_END ) {
+		switch (type) {
+		case UPG_WORKER: adopt_worker(&c, fds, nfds); break;
+		case UPG_GAME: adopt_game(&c, fds, nfds); break;
+		case UPG_MATCH: last = adopt_match(&c, fds, nfds); break;
+		case UPG_WATCHER:
+			if (nfds == 1 && last != NULL && watch_restore(epfd,
+					&last->watchers, fds[0], &c) == 0) break;
+			for (i = 0; i < nfds; i++) close(fds[i]);
+			break;
+		case UPG_CONN: restore_conn(&c, fds, nfds); break;
+		case UPG_RELAY: restore_relay(&c, fds, nfds); break;
+		case -1: error(13); break; // the old server carries on
+		default:
+			for (i = 0; i < nfds; i++) close(fds[i]);
+		}
+	}
+	registry_reclaim(&registry);
+	if (upgrade_signal(upgrade_sock, UPG_ACK, NULL, 0) < 0) error(13);
+	close(upgrade_sock);
+	upgrade_sock = -1;
+}
+
+// Take over a pool worker in the slot it had.
+void adopt_worker(struct nim_cursor *c, int *fds, int nfds) {
+	int slot = get_u8(c), pid = get_u32(c), active = get_u32(c), i;
+	if (c->bad || nfds != 2 || slot >= NIM_MAX_WORKERS) {
+		for (i = 0; i < nfds; i++) close(fds[i]);
+		return;
+	}
+	for (i = nworkers; i < slot; i++) workers[i].src.fd = -1;
+	if (slot >= nworkers) nworkers = slot + 1;
+	workers[slot].src.kind = SRC_WORKER;
+	workers[slot].src.fd = fds[0];
+	workers[slot].pid = pid;
+	workers[slot].active = active;
+	if (ev_add(epfd, &workers[slot].src, EPOLLIN) < 0) error(13);
+	adopt_child(fds[1], pid);
+}
+
+// Take over a game run by a pool worker or a forked match server.
+void adopt_game(struct nim_cursor *c, int *fds, int nfds) {
+	struct nim_game *game = NULL;
+	char handle1[20], handle2[20];
+	unsigned id = get_u32(c);
+	int pid = get_u32(c), worker = (int) get_u8(c) - 1, i;
+	get_str(c, handle1);
+	get_str(c, handle2);
+	if (!c->bad && (worker >= 0 ? worker < nworkers && workers[worker].src.fd >= 0
+			: pid > 0 && nfds >= 1))
+		game = restore_game(id, worker >= 0 ? 0 : pid, handle1, handle2);
+	if (game == NULL) {
+		for (i = 0; i < nfds; i++) close(fds[i]);
+		return;
+	}
+	game->worker = worker;
+	if (worker >= 0) return;
+	game->control = nfds > 1 ? fds[1] : -1;
+	adopt_child(fds[0], pid);
+}
+
+// Take over an in-process match.
+struct nim_match *adopt_match(struct nim_cursor *c, int *fds, int nfds) {
+	unsigned id = get_u32(c);
+	struct nim_match *m = match_restore(epfd, c, fds, nfds);
+	int i;
+	if (m == NULL) {
+		for (i = 0; i < nfds; i++) close(fds[i]);
+		return NULL;
+	}
+	m->done = match_done;
+	m->owner = restore_game(id, 0, m->p[0].handle, m->p[1].handle);
+	if (m->owner != NULL) ((struct nim_game *) m->owner)->match = m;
+	return m;
+}
+
+// Take over a lobby connection as save_conn() sent it.
+void restore_conn(struct nim_cursor *c, int *fds, int nfds) {
+	struct nim_conn *conn = slab_alloc(&conn_slab);
+	char spec[NIM_SPEC_MAX];
+	unsigned len;
+	int i;
+	if (conn == NULL) {
+		for (i = 0; i < nfds; i++) close(fds[i]);
+		return;
+	}
+	conn->state = get_u8(c);
+	conn->version = get_u8(c);
+	if ( (len = get_u16(c)) >= NIM_SPEC_MAX ) c->bad = 1;
+	frame_get(c, spec, c->bad ? 0 : len);
+	spec[c->bad ? 0 : len] = '\0';
+	if ( (conn->variant = variant_parse(spec)) < 0 ) conn->variant = 0;
+	conn->bucket = conn->variant;
+	conn->have = get_u8(c);
+	frame_get(c, &conn->msg, sizeof(struct nim_msg));
+	if ( (conn->in.len = get_u16(c)) > NIM_INBUF ) c->bad = 1;
+	frame_get(c, conn->in.data, c->bad ? 0 : conn->in.len);
+	if ( (conn->out.len = get_u16(c)) > NIM_OUTBUF ) c->bad = 1;
+	frame_get(c, conn->out.data, c->bad ? 0 : conn->out.len);
+	get_str(c, conn->handle);
+	long long since = (long long) get_u32(c) << 32;
+	since |= get_u32(c);
+	conn->accept_us = (long long) get_u32(c) << 32;
+	conn->accept_us |= get_u32(c);
+	conn->queued_us = (long long) get_u32(c) << 32;
+	conn->queued_us |= get_u32(c);
+	if (c->bad || nfds != 1 || conn->state > CONN_CLOSING) {
+		for (i = 0; i < nfds; i++) close(fds[i]);
+		slab_free(&conn_slab, conn);
+		return;
+	}
+	conn->src.kind = SRC_CONN;
+	conn->src.fd = fds[0];
+	link_conn(conn);
+	if (conn->state == CONN_QUEUED) {
+		if (ev_add(epfd, &conn->src, EPOLLRDHUP) < 0) { close_conn(conn); return; }
+		if (queue_push(&lobby, &conn->q, conn->bucket, since) < 0) {
+			close_conn(conn);
+			return;
+		}
+		if (idle_ms > 0) timer_arm(&timers, &conn->timer, idle_ms, conn_timeout);
+		return;
+	}
+	if (ev_add(epfd, &conn->src, conn->out.len ? EPOLLIN | EPOLLOUT : EPOLLIN) < 0) {
+		close_conn(conn);
+		return;
+	}
+	if (handshake_ms > 0) timer_arm(&timers, &conn->timer, handshake_ms, conn_timeout);
+}
+
+// Take over a relay as save_relay() sent it.
+void restore_relay(struct nim_cursor *c, int *fds, int nfds) {
+	struct nim_relay *r = slab_alloc(&relay_slab);
+	int i;
+	if (r == NULL) {
+		for (i = 0; i < nfds; i++) close(fds[i]);
+		return;
+	}
+	r->target = get_u8(c);
+	if ( (r->player.len = get_u16(c)) > NIM_RELAY_BUF ) c->bad = 1;
+	frame_get(c, r->player.buf, c->bad ? 0 : r->player.len);
+	if ( (r->node.len = get_u16(c)) > NIM_RELAY_BUF ) c->bad = 1;
+	frame_get(c, r->node.buf, c->bad ? 0 : r->node.len);
+	r->closing = get_u8(c);
+	if (c->bad || nfds != 2 || r->target >= cluster.n) {
+		for (i = 0; i < nfds; i++) close(fds[i]);
+		slab_free(&relay_slab, r);
+		return;
+	}
+	r->player.src.kind = r->node.src.kind = SRC_RELAY;
+	r->player.src.fd = fds[0];
+	r->node.src.fd = fds[1];
+	r->player.relay = r->node.relay = r;
+	link_relay(r);
+	if (ev_add(epfd, &r->player.src, 0) < 0 || ev_add(epfd, &r->node.src, 0) < 0) {
+		relay_close(r);
+		return;
+	}
+	relay_interest(r);
+}
+
+// Add a game taken over in a hot restart to the games registry.
+struct nim_game *restore_game(unsigned id, int pid, char *handle1, char *handle2) {
+	struct nim_game *game = registry_restore(&registry, id, pid, handle1, handle2);
+	if (game != NULL) snapshot_add(&snapshot, game, registry.live);
+	return game;
+}
+
+// Watch a process taken over in a hot restart for its exit.
+void adopt_child(int pidfd, int pid) {
+	struct nim_child *child = malloc(sizeof(struct nim_child));
+	child->src.kind = SRC_CHILD;
+	child->src.fd = pidfd;
+	child->pid = pid;
+	if (ev_add(epfd, &child->src, EPOLLIN) < 0) {
+		close(pidfd);
+		free(child);
+	}
+}
+
+// A process taken over in a hot restart has exited: drop its game, as
+// reap_games() does for our own children.
+void child_event(struct nim_child *child) {
+	struct nim_game *game;
+	trace(TR_REAP, child->pid);
+	metrics_release(child->pid);
+	if ( (game = registry_pid(&registry, child->pid)) != NULL ) {
+		reap_result(game);
+		remove_game(game);
+	}
+	ev_del(epfd, &child->src);
+	close(child->src.fd);
+	child->src.kind = SRC_DEAD;
+	ev_retire(NULL, child);
+}
+
+// Initialize datagram socket to listen and respond to client quaries.
+void init_query_sock() {
+
+	// Set hints struct and get address info.
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_PASSIVE;
+	hints.ai_protocol = 0;
+	hints.ai_canonname = NULL;
+	hints.ai_addr = NULL;
+	hints.ai_next = NULL;
+	if ( (err_code = getaddrinfo(NULL, query_port, &hints, &addrlist)) != 0 ) 
+		error(2);
+	q_in = (struct sockaddr_in*) addrlist->ai_addr;
+
+	// Initialize socket and bind to port, shared by every shard.
+	int on = 1;
+	query_sock = socket(addrlist->ai_family,
+			addrlist->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (query_sock < 0) error(3);
+	if (nshards > 1 && setsockopt(query_sock, SOL_SOCKET, SO_REUSEPORT,
+			&on, sizeof(on)) < 0) error(3);
+	if ( bind(query_sock, (struct sockaddr*) q_in, sizeof(struct sockaddr_in)) < 0 )
+		error(3);
+}
+
+// Initialize stream socket to listen and repond to client play requests.
+void init_play_sock() {
+
+	// Set hints struct and get address info.
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_PASSIVE;
+	hints.ai_protocol = 0;
+	hints.ai_canonname = NULL;
+	hints.ai_addr = NULL;
+	hints.ai_next = NULL;
+	if ( (err_code = getaddrinfo(NULL, play_port, &hints, &addrlist) ) != 0 )
+		error(2);
+	p_in = (struct sockaddr_in*) addrlist->ai_addr;
+	
+	// Initialize socket, bind to port and set to listen, shared by every
+	// shard.
+	int on = 1;
+	play_sock = socket(addrlist->ai_family,
+			addrlist->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (play_sock < 0) error(4);
+	if (setsockopt(play_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+		error(4);
+	if (nshards > 1 && setsockopt(play_sock, SOL_SOCKET, SO_REUSEPORT,
+			&on, sizeof(on)) < 0) error(4);
+	if ( bind(play_sock, (struct sockaddr*) p_in, sizeof(struct sockaddr_in)) < 0 )
+		error(4);
+	if ( listen(play_sock, SOMAXCONN) < 0 )
+		error(4);
+}
+
+// Create the epoll instance and register the query and play sockets.
+void init_event_loop() {
+	if ( (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) error(5);
+	query_src.kind = SRC_QUERY; query_src.fd = query_sock;
+	play_src.kind = SRC_PLAY; play_src.fd = play_sock;
+	if (ev_add(epfd, &query_src, EPOLLIN) < 0) error(5);
+	if (ev_add(epfd, &play_src, EPOLLIN) < 0) error(5);
+	spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (shared != NULL) {
+		mailbox_src.kind = SRC_MAILBOX; mailbox_src.fd = mailbox[shard_id][0];
+		if (ev_add(epfd, &mailbox_src, EPOLLIN) < 0) error(5);
+	}
+	if (gossip_sock >= 0) {
+		gossip_src.kind = SRC_GOSSIP; gossip_src.fd = gossip_sock;
+		if (ev_add(epfd, &gossip_src, EPOLLIN) < 0) error(5);
+	}
+}
+
+// Bind a datagram socket to our play port number for other nodes' gossip.
+void init_gossip_sock() {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = cluster.node[cluster.self].addr.sin_port;
+	gossip_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (gossip_sock < 0) error(14);
+	if (bind(gossip_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) error(14);
+}
+
+// Create address file with local symbolic host and port numbers of
+// query and play sockets, seperated with colons. In a cluster it lists
+// every node, a line each.
+void init_addr_file() {
+
+	// Get local hostname.
+	char hostname[HOST_NAME_MAX];
+	int i;
+	hostname[HOST_NAME_MAX-1] = '\0';
+	gethostname(hostname, HOST_NAME_MAX);
+	
+	// Write to address file: hostname:query_port:play_port
+	config = fopen("nim.conf", "w");
+	if (config == NULL) error(8);
+	if (cluster_file == NULL) fprintf(config, "%s:%s:%s", hostname, query_port, play_port);
+	for (i = 0; cluster_file != NULL && i < cluster.n; i++)
+		fprintf(config, "%s:%s:%s\n", cluster.node[i].host,
+				cluster.node[i].query_port, cluster.node[i].play_port);
+	fclose(config);
+}
+
+// Whether we write nim.conf and remove it on exit: in a cluster only node
+// 0 does, and then only if it was not given nim.conf as the node list.
+int owns_addr_file() {
+	return cluster_file == NULL || (cluster.self == 0 && strcmp(cluster_file, "nim.conf"));
+}
+
+// Signal handler for SIGUSR2 induced clean termination.
+// NOTE: Games in progress allowed to finish, per preliminary grading rubric.
+void usr2handler() {
+
+	// report query and turn statistics
+	print_query_stats();
+	match_print_stats("nim_server");
+	alloc_print_stats("nim_server");
+	// remove config file
+	if (owns_addr_file()) remove("nim.conf");
+	// terminate normally
+	exit(0);
+}
+
+// SIGUSR2 in the master stops every shard, then terminates the same way.
+void master_usr2handler() {
+	int i;
+	for (i = 0; i < nshards; i++)
+		if (shard_pids[i] > 0) kill(shard_pids[i], SIGUSR2);
+	usr2handler();
+}
+
+// On SIGUSR1, taken through the signalfd, write out the trace ring.
+void usr1handler() {
+	char who[32];
+	if (shared != NULL) sprintf(who, "nim_server shard %d", shard_id);
+	else strcpy(who, "nim_server");
+	if (trace_dump(who) < 0) perror("nim_server: trace dump");
+}
+
+// SIGHUP in the master: each shard holds its own lobby and games, which no
+// single new process could take over.
+void master_huphandler() {
+	fprintf(stderr, "nim_server: hot restart needs a single reactor\n");
+}
+
+// SIGUSR1 in the master has every shard write out its trace.
+void master_usr1handler() {
+	int i;
+	for (i = 0; i < nshards; i++)
+		if (shard_pids[i] > 0) kill(shard_pids[i], SIGUSR1);
+}
+
+// Print appropriate error message and exit.
+void error(int code) {
+	switch(code) {
+	case 1:
+		fprintf(stderr, "nim_server: argument error: exit 1\n");
+		exit(1); break;
+	case 2:
+		fprintf(stderr, "nim_server: getaddrinfo: %s: exit 2\n", gai_strerror(err_code));
+		exit(2); break;
+	case 3:
+		fprintf(stderr, "nim_server: problem initializing query socket: exit 3\n");
+		exit(3); break;
+	case 4:
+		fprintf(stderr, "nim_server: problem initializing play socket: exit 4\n");
+		exit(4); break;
+	case 5:
+		fprintf(stderr, "nim_server: problem with epoll: exit 5\n");
+		exit(5); break;
+	case 6:
+		fprintf(stderr, "nim_server: error processing client query: exit 6\n");
+		exit(6); break;
+	case 7:
+		fprintf(stderr, "nim_server: error processing client play request: exit 7\n");
+		exit(7); break;
+	case 8:
+		fprintf(stderr, "nim_server: error creating server address file: exit 8\n");
+		exit(8); break;
+	case 9:
+		fprintf(stderr, "nim_server: signal error: exit 9\n");
+		exit(9); break;
+	case 10:
+		fprintf(stderr, "nim_server: fork error: exit 10\n");
+		exit(10); break;
+	case 11:
+		fprintf(stderr, "nim_server: problem starting shards: exit 11\n");
+		exit(11); break;
+	case 12:
+		fprintf(stderr, "nim_server: problem opening game log: exit 12\n");
+		exit(12); break;
+	case 13:
+		fprintf(stderr, "nim_server: problem taking over from the old server: exit 13\n");
+		exit(13); break;
+	case 14:
+		fprintf(stderr, "nim_server: problem joining the cluster: exit 14\n");
+		exit(14); break;
+	case 15:
+		fprintf(stderr, "nim_server: problem reading the tournament roster: exit 15\n");
+		exit(15); break;
+	case 16:
+		fprintf(stderr, "nim_server: problem opening the ratings file: exit 16\n");
+		exit(16); break;
+	}
+}
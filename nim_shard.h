@@ -0,0 +1,114 @@
+// CS415 Project #4: nim_shard.h (lobby shards)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// State shared between nim_server shard processes. Each shard runs its own
+// event loop on SO_REUSEPORT sockets; the only things they share are a
+// summary of each shard's lobby for aggregated query responses, a slot
+// advertising a lone waiting player for pairing across shards, and a
+// mailbox per shard used to hand a player's socket to the shard holding
+// the waiting player, or a spectator's to the shard holding the game.
+
+#ifndef NIM_SHARD_H
+#define NIM_SHARD_H
+
+#define NIM_MAX_SHARDS 64
+
+// One shard's lobby summary, published under a sequence lock: seq is odd
+// while the shard is writing it.
+struct nim_shard_info {
+	unsigned seq;
+	int inprog;
+	char waiting[20];
+	char games[LINE_MAX];
+} __attribute__((aligned(64)));
+
+// Shared mapping created by the master before the shards are forked.
+struct nim_shared {
+	int nshards;
+	int cross_waiter; // shard with a lone waiting player, -1 if none
+	struct nim_shard_info shard[NIM_MAX_SHARDS];
+};
+
+// Mailbox message handing a player over to another shard; the player's
+// socket travels with it as SCM_RIGHTS.
+struct nim_handoff {
+	char handle[20]; // the player's, or for a spectator the player watched
+	int version; // protocol version
+	int watch; // a spectator, not a player
+};
+
+// Map the shared state for n shards.
+struct nim_shared *shard_map(int n) {
+	struct nim_shared *sh = mmap(NULL, sizeof(struct nim_shared),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sh == MAP_FAILED) return NULL;
+	memset(sh, 0, sizeof(struct nim_shared));
+	sh->nshards = n;
+	sh->cross_waiter = -1;
+	return sh;
+}
+
+// Publish a shard's lobby summary.
+void shard_publish(struct nim_shard_info *info, int inprog, char *waiting,
+		char *games) {
+	__atomic_add_fetch(&info->seq, 1, __ATOMIC_ACQ_REL);
+	info->inprog = inprog;
+	memcpy(info->waiting, waiting, 20);
+	strncpy(info->games, games, LINE_MAX - 1);
+	__atomic_add_fetch(&info->seq, 1, __ATOMIC_RELEASE);
+}
+
+// Take a consistent copy of another shard's lobby summary, returning the
+// version copied.
+unsigned shard_read(struct nim_shard_info *info, struct nim_shard_info *copy) {
+	unsigned seq;
+	for ( ; ; ) {
+		seq = __atomic_load_n(&info->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) continue;
+		copy->inprog = info->inprog;
+		memcpy(copy->waiting, info->waiting, 20);
+		memcpy(copy->games, info->games, LINE_MAX);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&info->seq, __ATOMIC_RELAXED) == seq) break;
+	}
+	copy->games[LINE_MAX - 1] = '\0';
+	return seq;
+}
+
+// Advertise or withdraw this shard's lone waiting player.
+void shard_advertise(struct nim_shared *sh, int self) {
+	int none = -1;
+	__atomic_compare_exchange_n(&sh->cross_waiter, &none, self, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+void shard_withdraw(struct nim_shared *sh, int self) {
+	int mine = self;
+	__atomic_compare_exchange_n(&sh->cross_waiter, &mine, -1, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// Claim another shard's advertised waiting player, -1 if there is none.
+int shard_claim(struct nim_shared *sh, int self) {
+	int other = __atomic_load_n(&sh->cross_waiter, __ATOMIC_ACQUIRE);
+	if (other < 0 || other == self) return -1;
+	if (!__atomic_compare_exchange_n(&sh->cross_waiter, &other, -1, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return -1;
+	return other;
+}
+
+// Find another shard listing a game the player is in, -1 if none.
+int shard_find(struct nim_shared *sh, int self, char *handle) {
+	struct nim_shard_info copy;
+	char *name, *save;
+	int i;
+	for (i = 0; i < sh->nshards; i++) {
+		if (i == self) continue;
+		shard_read(&sh->shard[i], &copy);
+		for (name = strtok_r(copy.games, ":", &save); name != NULL;
+				name = strtok_r(NULL, ":", &save))
+			if (strcmp(name, handle) == 0) return i;
+	}
+	return -1;
+}
+
+#endif
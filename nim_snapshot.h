@@ -0,0 +1,96 @@
+// CS415 Project #4: nim_snapshot.h (lobby snapshot)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Query response kept ready to send. It is updated in place as games start
+// and end and as the waiting player changes, so answering a query is a
+// single sendto of this buffer. Each listed game remembers where its
+// "player1:player2:" entry sits in the games string; a finished game's
+// entry is overwritten with colons, which the client's strtok() skips, and
+// the string is only compacted when new entries no longer fit at its end,
+// or once enough has been freed to list games that did not fit before.
+
+#ifndef NIM_SNAPSHOT_H
+#define NIM_SNAPSHOT_H
+
+struct nim_snapshot {
+	struct nim_query_response resp; // encoded response
+	int inprog; // games in progress
+	int len; // length of the games string
+	int holes; // bytes of finished entries still in the string
+	int unlisted; // games that did not fit in the string
+	unsigned version; // bumped on every change
+};
+
+void snapshot_init(struct nim_snapshot *snap) {
+	memset(snap, 0, sizeof(struct nim_snapshot));
+}
+
+// Rewrite the games string from the live games, dropping holes.
+void snapshot_compact(struct nim_snapshot *snap, struct nim_game *live) {
+	struct nim_game *g;
+	snap->len = snap->holes = snap->unlisted = 0;
+	for (g = live; g != NULL; g = g->next) {
+		int size = strlen(g->player1) + strlen(g->player2) + 2;
+		g->snap_len = 0;
+		if (snap->len + size >= LINE_MAX) { // listed once there is room
+			snap->unlisted += 1;
+			continue;
+		}
+		g->snap_off = snap->len;
+		g->snap_len = size;
+		sprintf(snap->resp.games + snap->len, "%s:%s:", g->player1, g->player2);
+		snap->len += size;
+	}
+	memset(snap->resp.games + snap->len, 0, LINE_MAX - snap->len);
+}
+
+// List a game that has started.
+void snapshot_add(struct nim_snapshot *snap, struct nim_game *g,
+		struct nim_game *live) {
+	int size = strlen(g->player1) + strlen(g->player2) + 2;
+	snap->inprog += 1;
+	snap->resp.inprog = htonl(snap->inprog);
+	snap->version += 1;
+	g->snap_len = 0;
+	if (snap->len + size >= LINE_MAX && snap->holes >= size)
+		snapshot_compact(snap, live); // lists g too
+	else if (snap->len + size < LINE_MAX) {
+		g->snap_off = snap->len;
+		g->snap_len = size;
+		sprintf(snap->resp.games + snap->len, "%s:%s:", g->player1, g->player2);
+		snap->len += size;
+	} else snap->unlisted += 1;
+}
+
+// Unlist a game that has ended; the caller has already unlinked it from
+// the live games.
+void snapshot_remove(struct nim_snapshot *snap, struct nim_game *g,
+		struct nim_game *live) {
+	snap->inprog -= 1;
+	snap->resp.inprog = htonl(snap->inprog);
+	snap->version += 1;
+	if (g->snap_len == 0) {
+		snap->unlisted -= 1;
+		return;
+	}
+	if (g->snap_off + g->snap_len == snap->len) { // last entry, trim
+		snap->len = g->snap_off;
+		memset(snap->resp.games + snap->len, 0, g->snap_len);
+	} else {
+		memset(snap->resp.games + g->snap_off, ':', g->snap_len);
+		snap->holes += g->snap_len;
+	}
+	g->snap_len = 0;
+	if (snap->inprog == 0 || (snap->unlisted > 0 && snap->holes >= LINE_MAX / 4))
+		snapshot_compact(snap, live);
+}
+
+// Set the waiting player's handle.
+void snapshot_waiting(struct nim_snapshot *snap, char *handle) {
+	if (strcmp(snap->resp.waiting, handle) == 0) return;
+	memset(snap->resp.waiting, 0, 20);
+	strncpy(snap->resp.waiting, handle, 19);
+	snap->version += 1;
+}
+
+#endif
@@ -0,0 +1,138 @@
+// CS415 Project #4: nim_timer.h (timer wheel)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Hierarchical timer wheel with millisecond ticks. Four levels of 64 slots
+// cover about four and a half hours, each level's slots spanning 64 times
+// those of the level below; a timer goes in the lowest level whose span
+// reaches its expiry, and drops a level each time the slot it is in comes
+// round. Timers are embedded in the objects they time and linked straight
+// into their slot, so arming and cancelling are O(1) and take no memory,
+// and advancing the wheel only ever touches the slots whose time has come,
+// however many timers are armed. A process runs one wheel alongside its
+// epoll loop: it waits no longer than timer_timeout() and then calls
+// timer_advance(), which fires every timer due.
+
+#ifndef NIM_TIMER_H
+#define NIM_TIMER_H
+
+#define NIM_TIMER_BITS 6 // slots per level, as a power of two
+#define NIM_TIMER_SLOTS (1 << NIM_TIMER_BITS)
+#define NIM_TIMER_LEVELS 4
+#define NIM_TIMER_MAX ((1LL << (NIM_TIMER_BITS * NIM_TIMER_LEVELS)) - 1) // ms
+
+// Timer embedded in the object it times.
+struct nim_timer {
+	struct nim_timer *next;
+	struct nim_timer **pprev; // link pointing at this timer, NULL if idle
+	long long expires; // tick
+	void (*fire)(struct nim_timer *t); // called once expired, disarmed
+};
+#define TIMER_OWNER(t, type, member) ((type *) ((char *) (t) - offsetof(type, member)))
+
+// Timer wheel.
+struct nim_wheel {
+	long long now; // next tick to process, in now_ms() time
+	int count; // timers armed
+	struct nim_timer *slot[NIM_TIMER_LEVELS][NIM_TIMER_SLOTS];
+};
+
+struct nim_wheel timers; // the process's wheel
+
+// Start a wheel at the current time.
+void timer_init(struct nim_wheel *w) {
+	memset(w, 0, sizeof(struct nim_wheel));
+	w->now = now_ms();
+}
+
+// Link an armed timer into the slot for its expiry.
+void timer_place(struct nim_wheel *w, struct nim_timer *t) {
+	long long delta = t->expires - w->now;
+	int level, index;
+	if (delta < 0) t->expires = w->now; // overdue, fire on the next tick
+	else if (delta > NIM_TIMER_MAX) t->expires = w->now + NIM_TIMER_MAX;
+	delta = t->expires - w->now;
+	for (level = 0; level < NIM_TIMER_LEVELS - 1; level++)
+		if (delta < 1LL << (NIM_TIMER_BITS * (level + 1))) break;
+	index = (t->expires >> (NIM_TIMER_BITS * level)) & (NIM_TIMER_SLOTS - 1);
+	t->next = w->slot[level][index];
+	if (t->next != NULL) t->next->pprev = &t->next;
+	w->slot[level][index] = t;
+	t->pprev = &w->slot[level][index];
+}
+
+// Take a timer out of its slot, if it is armed.
+void timer_cancel(struct nim_wheel *w, struct nim_timer *t) {
+	if (t->pprev == NULL) return;
+	*t->pprev = t->next;
+	if (t->next != NULL) t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+	w->count -= 1;
+}
+
+// Arm a timer to fire ms from now, re-arming it if it is already armed.
+void timer_arm(struct nim_wheel *w, struct nim_timer *t, int ms,
+		void (*fire)(struct nim_timer *t)) {
+	timer_cancel(w, t);
+	if (w->count == 0) w->now = now_ms(); // nothing to fire on the way
+	t->expires = now_ms() + ms;
+	t->fire = fire;
+	timer_place(w, t);
+	w->count += 1;
+}
+
+// Move every timer in a higher level slot down to the levels below.
+// Returns the slot's index, which is 0 when the next level up is due too.
+int timer_cascade(struct nim_wheel *w, int level) {
+	int index = (w->now >> (NIM_TIMER_BITS * level)) & (NIM_TIMER_SLOTS - 1);
+	struct nim_timer *t = w->slot[level][index], *next;
+	w->slot[level][index] = NULL;
+	for ( ; t != NULL; t = next) {
+		next = t->next;
+		timer_place(w, t);
+	}
+	return index;
+}
+
+// Fire every timer due by now, in order of expiry to the millisecond.
+// A timer may be re-armed, and any other cancelled, from a fire callback.
+void timer_advance(struct nim_wheel *w, long long now) {
+	struct nim_timer *t, **head;
+	int index, level;
+	if (w->count == 0 && w->now <= now) w->now = now + 1; // skip idle ticks
+	while (w->now <= now) {
+		index = w->now & (NIM_TIMER_SLOTS - 1);
+		for (level = 1; index == 0 && level < NIM_TIMER_LEVELS; level++)
+			index = timer_cascade(w, level);
+		head = &w->slot[0][w->now & (NIM_TIMER_SLOTS - 1)];
+		w->now += 1; // timers armed from here on land in later slots
+		while ( (t = *head) != NULL ) {
+			timer_cancel(w, t);
+			t->fire(t);
+		}
+	}
+}
+
+// Milliseconds until the wheel next needs advancing, for epoll_wait(): the
+// earliest expiry in the lowest level, or an earlier slot of a higher level
+// coming round. -1 if nothing is armed.
+int timer_timeout(struct nim_wheel *w, long long now) {
+	long long best = -1, tick, step;
+	int level, k;
+	if (w->count == 0) return -1;
+	for (level = 0; level < NIM_TIMER_LEVELS; level++) {
+		step = 1LL << (NIM_TIMER_BITS * level);
+		tick = (w->now + step - 1) & ~(step - 1); // next time this level moves
+		for (k = 0; k < NIM_TIMER_SLOTS; k++, tick += step) {
+			if (best >= 0 && tick >= best) break;
+			if (w->slot[level][(tick / step) & (NIM_TIMER_SLOTS - 1)] != NULL) {
+				best = tick;
+				break;
+			}
+		}
+	}
+	if (best < 0) return 1000; // unreachable while count is right
+	return best <= now ? 0 : (best - now > INT_MAX ? INT_MAX : best - now);
+}
+
+#endif
@@ -0,0 +1,513 @@
+// CS415 Project #4: nim_tourney.h (tournaments)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// A tournament among a roster of handles, run by the server beside its
+// lobby: a round robin, or a single or double elimination bracket seeded in
+// roster order, the top seeds taking any byes. An entrant joins like any
+// player and, instead of being queued, waits for its next match, which
+// starts the moment both its players are there: a match never waits on the
+// rest of its round, only on the matches feeding it. A bracket is laid out
+// whole at the start, each match knowing where its winner and its loser go;
+// in a double elimination bracket the losers' bracket champion meets the
+// winners' in a single grand final. A round robin is scheduled by the circle
+// method, an entrant's opponent for a round worked out when wanted, so
+// nothing is kept per pairing. A bracket match whose players are not both
+// there within the forfeit time of it being ready goes to whoever is, and a
+// round robin entrant away that long between matches is withdrawn, its
+// opponents taking walkovers. Every step costs O(1) but the standings,
+// sorted when asked for and only if a result has come in since. The host
+// starts each match through the start hook, is handed back through the
+// release hook an entrant left waiting with no match to come, and reports
+// how each match ended with tourney_result().
+
+#ifndef NIM_TOURNEY_H
+#define NIM_TOURNEY_H
+
+#define NIM_TOURNEY_MAX 65536 // entrants
+#define NIM_TABLE_ROWS 1000 // standings rows in a TABLE datagram
+
+// Formats.
+enum {
+	TOURNEY_ROUND_ROBIN,
+	TOURNEY_SINGLE, // single elimination
+	TOURNEY_DOUBLE // double elimination
+};
+
+// Bracket match states.
+enum {
+	TM_WAITING, // a player still to come from an earlier match
+	TM_READY, // both players known, not both there yet
+	TM_PLAYING,
+	TM_DONE
+};
+
+// Entrant.
+struct nim_entrant {
+	char handle[20];
+	int seed; // roster line, from 0
+	int wins, losses;
+	void *conn; // the host's connection while it waits, NULL if away; it
+		// may come back before the host has the result of its match
+	int playing; // in a match now
+	int out; // eliminated or withdrawn
+	int done; // played every round, or won the bracket
+	int place; // bracket stage it was last beaten in, for the standings
+	int match; // bracket match it is in, -1 if none
+	int round; // round robin round to play next
+	struct nim_timer timer; // round robin: away between matches
+	int hnext; // hash chain, -1 at the end
+};
+
+// Bracket match; players are entrant indexes, -1 if still to come and -2
+// for a bye.
+struct nim_tmatch {
+	int p[2];
+	int state;
+	int stage; // how late in the bracket, for the standings
+	int win_to, win_slot; // match the winner goes on to, -1 if none
+	int lose_to, lose_slot; // match the loser drops to, -1 if eliminated
+	struct nim_timer timer; // forfeit, while ready
+};
+
+struct nim_tourney {
+	int format;
+	int n; // entrants, 0 if no tournament
+	struct nim_entrant *e;
+	int *hash, hmask; // handle to entrant
+	struct nim_tmatch *m; // bracket matches
+	int nmatches, stages;
+	int rounds; // round robin rounds
+	int active; // entrants neither out nor done
+	int played, playing; // matches decided and in progress
+	int forfeit_ms;
+	unsigned version; // bumped by every result
+	int *order; // entrants in standings order
+	unsigned order_version;
+	void (*start)(void *conn1, void *conn2); // the host's, to start a match
+	void (*release)(void *conn); // the host's, for an entrant with no match to come
+};
+
+struct nim_tourney tourney; // the server's, n 0 if none
+
+void tourney_feed(struct nim_tourney *t, int i, int slot, int who);
+void rr_away(struct nim_timer *timer);
+
+unsigned tourney_hash(char *s) {
+	unsigned h = 2166136261u;
+	for ( ; *s != '\0'; s++) h = (h ^ (unsigned char) *s) * 16777619u;
+	return h;
+}
+
+// The entrant with a handle, NULL if none.
+struct nim_entrant *tourney_find(struct nim_tourney *t, char *handle) {
+	int i;
+	if (t->n == 0) return NULL;
+	for (i = t->hash[tourney_hash(handle) & t->hmask]; i >= 0; i = t->e[i].hnext)
+		if (strcmp(t->e[i].handle, handle) == 0) return &t->e[i];
+	return NULL;
+}
+
+// Read a roster, a handle per line in seed order, for a tournament of the
+// given format. Returns -1 if it cannot be read, has fewer than two
+// handles or too many, or names a handle twice.
+int tourney_load(struct nim_tourney *t, int format, char *path) {
+	FILE *file;
+	char line[LINE_MAX];
+	int cap = 64, i, h;
+	memset(t, 0, sizeof(struct nim_tourney));
+	t->format = format;
+	if ( (file = fopen(path, "r")) == NULL ) return -1;
+	t->e = malloc(cap * sizeof(struct nim_entrant));
+	while (t->e != NULL && fgets(line, LINE_MAX, file) != NULL) {
+		char *handle = strtok(line, " \t\r\n");
+		if (handle == NULL || handle[0] == '#') continue;
+		if (t->n == NIM_TOURNEY_MAX) { t->n = 0; break; }
+		if (t->n == cap) t->e = realloc(t->e, (cap *= 2) * sizeof(struct nim_entrant));
+		if (t->e == NULL) break;
+		memset(&t->e[t->n], 0, sizeof(struct nim_entrant));
+		snprintf(t->e[t->n].handle, 20, "%s", handle);
+		t->e[t->n].seed = t->n;
+		t->e[t->n].match = -1;
+		t->n += 1;
+	}
+	fclose(file);
+	if (t->e == NULL || t->n < 2) { t->n = 0; return -1; }
+	for (t->hmask = 1; t->hmask < 2 * t->n; t->hmask *= 2) ;
+	t->hash = malloc(t->hmask * sizeof(int));
+	t->order = malloc(t->n * sizeof(int));
+	if (t->hash == NULL || t->order == NULL) { t->n = 0; return -1; }
+	t->hmask -= 1;
+	for (i = 0; i <= t->hmask; i++) t->hash[i] = -1;
+	for (i = 0; i < t->n; i++) {
+		if (tourney_find(t, t->e[i].handle) != NULL) { t->n = 0; return -1; }
+		h = tourney_hash(t->e[i].handle) & t->hmask;
+		t->e[i].hnext = t->hash[h];
+		t->hash[h] = i;
+	}
+	t->active = t->n;
+	t->order_version = t->version - 1;
+	return 0;
+}
+
+// Hand a waiting entrant with no match to come back to the host.
+void tourney_release(struct nim_tourney *t, struct nim_entrant *e) {
+	void *conn = e->conn;
+	if (conn == NULL) return;
+	e->conn = NULL;
+	t->release(conn);
+}
+
+// Start a ready bracket match if both its players are there.
+void tourney_try(struct nim_tourney *t, int i) {
+	struct nim_tmatch *m = &t->m[i];
+	struct nim_entrant *a = &t->e[m->p[0]], *b = &t->e[m->p[1]];
+	void *conn1 = a->conn, *conn2 = b->conn;
+	if (m->state != TM_READY || conn1 == NULL || conn2 == NULL || a->playing || b->playing)
+		return;
+	timer_cancel(&timers, &m->timer);
+	m->state = TM_PLAYING;
+	a->playing = b->playing = 1;
+	a->conn = b->conn = NULL;
+	t->playing += 1;
+	t->start(conn1, conn2);
+}
+
+// Settle a bracket match for the player in the given slot, counting it in
+// both players' records unless it was a bye, and send both on.
+void tourney_decide(struct nim_tourney *t, int i, int slot, int counted) {
+	struct nim_tmatch *m = &t->m[i];
+	int winner = m->p[slot], loser = m->p[1 - slot];
+	timer_cancel(&timers, &m->timer);
+	m->state = TM_DONE;
+	t->version += 1;
+	if (counted) {
+		t->played += 1;
+		t->e[winner].wins += 1;
+		t->e[loser].losses += 1;
+	}
+	if (loser >= 0) {
+		t->e[loser].match = -1;
+		t->e[loser].place = m->stage;
+		if (m->lose_to < 0) {
+			t->e[loser].out = 1;
+			t->active -= 1;
+			tourney_release(t, &t->e[loser]);
+		}
+	}
+	if (winner >= 0) {
+		t->e[winner].match = -1;
+		if (m->win_to < 0) { // the champion
+			t->e[winner].done = 1;
+			t->active -= 1;
+			tourney_release(t, &t->e[winner]);
+		}
+	}
+	if (m->lose_to >= 0) tourney_feed(t, m->lose_to, m->lose_slot, loser);
+	if (m->win_to >= 0) tourney_feed(t, m->win_to, m->win_slot, winner);
+}
+
+// A ready bracket match's players were not both there in time: whoever
+// was wins, the higher seed if neither was.
+void tourney_forfeit(struct nim_timer *timer) {
+	struct nim_tmatch *m = TIMER_OWNER(timer, struct nim_tmatch, timer);
+	struct nim_tourney *t = &tourney;
+	if (m->state != TM_READY) return;
+	tourney_decide(t, m - t->m, t->e[m->p[0]].conn == NULL && t->e[m->p[1]].conn != NULL, 1);
+}
+
+// Put a player into a bracket match; a match with both its players is
+// ready, or, against a bye, decided on the spot.
+void tourney_feed(struct nim_tourney *t, int i, int slot, int who) {
+	struct nim_tmatch *m = &t->m[i];
+	m->p[slot] = who;
+	if (m->p[0] == -1 || m->p[1] == -1) return;
+	if (m->p[0] < 0 || m->p[1] < 0) { // the other player goes through
+		tourney_decide(t, i, m->p[0] < 0, 0);
+		return;
+	}
+	m->state = TM_READY;
+	t->e[m->p[0]].match = t->e[m->p[1]].match = i;
+	timer_arm(&timers, &m->timer, t->forfeit_ms, tourney_forfeit);
+	tourney_try(t, i);
+}
+
+// Lay out a bracket and seed its first round: winners' bracket rounds 1 to
+// k, then for double elimination losers' bracket rounds 1 to 2(k-1), each
+// odd one fed by the last one's winners and each even one also by the
+// winners' bracket's losers, and the grand final. Returns -1 if out of
+// memory.
+int tourney_bracket(struct nim_tourney *t) {
+	int size = 2, k = 1, lb_rounds, r, j, count, next, *pos, *grow;
+	int wb[32], lb[64], gf = -1;
+	while (size < t->n) { size *= 2; k += 1; }
+	lb_rounds = t->format == TOURNEY_DOUBLE ? 2 * (k - 1) : 0;
+	t->nmatches = size - 1 + (t->format == TOURNEY_DOUBLE ? size - 1 : 0);
+	if ( (t->m = calloc(t->nmatches, sizeof(struct nim_tmatch))) == NULL ) return -1;
+	for (next = 0, r = 1; r <= k; r++) { wb[r] = next; next += size >> r; }
+	for (r = 1; r <= lb_rounds; r++) { lb[r] = next; next += size >> ((r + 1) / 2 + 1); }
+	if (t->format == TOURNEY_DOUBLE) gf = next;
+	for (j = 0; j < t->nmatches; j++) {
+		t->m[j].p[0] = t->m[j].p[1] = -1;
+		t->m[j].win_to = t->m[j].lose_to = -1;
+	}
+	for (r = 1; r <= k; r++) { // winners' bracket
+		count = size >> r;
+		for (j = 0; j < count; j++) {
+			struct nim_tmatch *m = &t->m[wb[r] + j];
+			m->stage = r;
+			if (r < k) { m->win_to = wb[r + 1] + j / 2; m->win_slot = j % 2; }
+			else m->win_to = gf;
+			if (t->format != TOURNEY_DOUBLE) continue;
+			if (k == 1) { m->lose_to = gf; m->lose_slot = 1; }
+			else if (r == 1) { m->lose_to = lb[1] + j / 2; m->lose_slot = j % 2; }
+			else { m->lose_to = lb[2 * (r - 1)] + count - 1 - j; m->lose_slot = 1; }
+		}
+	}
+	for (r = 1; r <= lb_rounds; r++) { // losers' bracket
+		count = size >> ((r + 1) / 2 + 1);
+		for (j = 0; j < count; j++) {
+			struct nim_tmatch *m = &t->m[lb[r] + j];
+			m->stage = r;
+			if (r == lb_rounds) { m->win_to = gf; m->win_slot = 1; }
+			else if (r % 2 == 1) m->win_to = lb[r + 1] + j;
+			else { m->win_to = lb[r + 1] + j / 2; m->win_slot = j % 2; }
+		}
+	}
+	if (gf >= 0) t->m[gf].stage = lb_rounds + 1;
+	t->stages = gf >= 0 ? lb_rounds + 1 : k;
+	// first round places by seed, 1 v size, 2 v size-1 and so on, nested so
+	// that the top seeds meet last
+	if ( (pos = malloc(size * sizeof(int))) == NULL ) return -1;
+	if ( (grow = malloc(size * sizeof(int))) == NULL ) { free(pos); return -1; }
+	pos[0] = 1;
+	for (count = 1; count < size; count *= 2) {
+		for (j = 0; j < count; j++) {
+			grow[2 * j] = pos[j];
+			grow[2 * j + 1] = 2 * count + 1 - pos[j];
+		}
+		memcpy(pos, grow, 2 * count * sizeof(int));
+	}
+	for (j = 0; j < size; j++)
+		tourney_feed(t, wb[1] + j / 2, j % 2, pos[j] <= t->n ? pos[j] - 1 : -2);
+	free(pos);
+	free(grow);
+	return 0;
+}
+
+// Round robin opponent of an entrant in a round, n or more for a bye: the
+// last place holds still while the rest turn round it, and with an odd
+// number of entrants that place is the bye.
+int rr_opponent(struct nim_tourney *t, int i, int round) {
+	int fixed = t->rounds;
+	if (i == fixed) return round;
+	if (i == round) return fixed;
+	return ((2 * round - i) % fixed + fixed) % fixed;
+}
+
+// Pass over any rounds a round robin entrant has nothing to play in: a bye,
+// or a withdrawn opponent, which is a walkover.
+void rr_skip(struct nim_tourney *t, struct nim_entrant *e) {
+	int opp;
+	while (e->round < t->rounds && !e->out) {
+		if ( (opp = rr_opponent(t, e->seed, e->round)) < t->n ) {
+			if (!t->e[opp].out) break;
+			e->wins += 1;
+			t->e[opp].losses += 1;
+			t->played += 1;
+			t->version += 1;
+		}
+		e->round += 1;
+	}
+	if (e->round == t->rounds && !e->done && !e->out) {
+		e->done = 1;
+		t->active -= 1;
+		timer_cancel(&timers, &e->timer);
+		tourney_release(t, e);
+	}
+}
+
+// Start a round robin entrant's next match if it and its opponent are both
+// there for it.
+void rr_next(struct nim_tourney *t, struct nim_entrant *e) {
+	struct nim_entrant *o;
+	void *conn1 = e->conn, *conn2;
+	if (e->out || e->done || e->playing || conn1 == NULL) return;
+	o = &t->e[rr_opponent(t, e->seed, e->round)];
+	if ( (conn2 = o->conn) == NULL || o->playing || o->round != e->round ) return;
+	e->playing = o->playing = 1;
+	e->conn = o->conn = NULL;
+	t->playing += 1;
+	t->start(conn1, conn2);
+}
+
+// A round robin entrant is away between matches: give it the forfeit time
+// to come back.
+void rr_leave(struct nim_tourney *t, struct nim_entrant *e) {
+	if (e->out || e->done || e->playing || e->conn != NULL) return;
+	timer_arm(&timers, &e->timer, t->forfeit_ms, rr_away);
+}
+
+// Withdraw a round robin entrant. Each opponent it has left that is
+// waiting on it takes a walkover and goes on to its next match; the rest
+// take theirs when they get to it.
+void rr_withdraw(struct nim_tourney *t, struct nim_entrant *e) {
+	int r, opp;
+	e->out = 1;
+	t->active -= 1;
+	t->version += 1;
+	for (r = e->round; r < t->rounds; r++) {
+		struct nim_entrant *o;
+		if ( (opp = rr_opponent(t, e->seed, r)) >= t->n ) continue;
+		if ( (o = &t->e[opp])->round != r || o->playing ) continue;
+		rr_skip(t, o);
+		rr_next(t, o);
+	}
+}
+
+// A round robin entrant has stayed away the forfeit time.
+void rr_away(struct nim_timer *timer) {
+	struct nim_entrant *e = TIMER_OWNER(timer, struct nim_entrant, timer);
+	if (!e->out && !e->done && !e->playing && e->conn == NULL) rr_withdraw(&tourney, e);
+}
+
+// Start the tournament, once the host's timer wheel is running. Returns -1
+// if out of memory.
+int tourney_begin(struct nim_tourney *t) {
+	int i;
+	if (t->format != TOURNEY_ROUND_ROBIN) return tourney_bracket(t);
+	t->rounds = t->n % 2 ? t->n : t->n - 1;
+	for (i = 0; i < t->n; i++) {
+		rr_skip(t, &t->e[i]);
+		rr_leave(t, &t->e[i]);
+	}
+	return 0;
+}
+
+// The entrant with a handle if it has a match to come, NULL if the handle
+// is not one or it has none.
+struct nim_entrant *tourney_entrant(struct nim_tourney *t, char *handle) {
+	struct nim_entrant *e = tourney_find(t, handle);
+	if (e == NULL || e->out || e->done) return NULL;
+	return e;
+}
+
+// An entrant has come on a connection of the host's to wait for its next
+// match, which may start at once.
+void tourney_arrive(struct nim_tourney *t, struct nim_entrant *e, void *conn) {
+	e->conn = conn;
+	if (t->format != TOURNEY_ROUND_ROBIN) {
+		if (e->match >= 0) tourney_try(t, e->match);
+		return;
+	}
+	timer_cancel(&timers, &e->timer);
+	rr_next(t, e);
+}
+
+// A waiting entrant's connection has gone.
+void tourney_leave(struct nim_tourney *t, struct nim_entrant *e) {
+	e->conn = NULL;
+	if (t->format == TOURNEY_ROUND_ROBIN) rr_leave(t, e);
+}
+
+// A match between two entrants has ended, won by the first handle if
+// winner is 0, the second if 1; undecided, -1, it is played again. A match
+// the tournament did not start is ignored.
+void tourney_result(struct nim_tourney *t, char *handle1, char *handle2, int winner) {
+	struct nim_entrant *a = tourney_find(t, handle1), *b = tourney_find(t, handle2);
+	struct nim_tmatch *m;
+	if (a == NULL || b == NULL || !a->playing || !b->playing) return;
+	if (t->format == TOURNEY_ROUND_ROBIN) {
+		if (a->round != b->round || rr_opponent(t, a->seed, a->round) != b->seed) return;
+	} else if (a->match < 0 || a->match != b->match) return;
+	a->playing = b->playing = 0;
+	t->playing -= 1;
+	if (t->format == TOURNEY_ROUND_ROBIN) {
+		if (winner >= 0) {
+			(winner == 0 ? a : b)->wins += 1;
+			(winner == 0 ? b : a)->losses += 1;
+			a->round += 1;
+			b->round += 1;
+			t->played += 1;
+			t->version += 1;
+			rr_skip(t, a);
+			rr_skip(t, b);
+		}
+		rr_leave(t, a);
+		rr_leave(t, b);
+		rr_next(t, a);
+		rr_next(t, b);
+		return;
+	}
+	m = &t->m[a->match];
+	if (winner < 0) { // again, once both are back
+		m->state = TM_READY;
+		timer_arm(&timers, &m->timer, t->forfeit_ms, tourney_forfeit);
+		tourney_try(t, a->match);
+		return;
+	}
+	tourney_decide(t, a->match, (m->p[0] == a->seed) == (winner == 1), 1);
+}
+
+// Standings status of an entrant, a TABLE_ value.
+int tourney_status(struct nim_entrant *e) {
+	if (e->done) return TABLE_DONE;
+	if (e->out) return TABLE_OUT;
+	if (e->playing) return TABLE_PLAYING;
+	return e->conn != NULL ? TABLE_WAITING : TABLE_ABSENT;
+}
+
+// How far an entrant has got in a bracket, for the standings: the champion
+// first, then those still in, then the rest by the stage that put them out.
+int tourney_rank(struct nim_tourney *t, struct nim_entrant *e) {
+	if (t->format == TOURNEY_ROUND_ROBIN) return 0;
+	return e->done ? t->stages + 2 : e->out ? e->place : t->stages + 1;
+}
+
+int tourney_cmp(const void *x, const void *y) {
+	struct nim_entrant *a = &tourney.e[*(int *) x], *b = &tourney.e[*(int *) y];
+	int ra = tourney_rank(&tourney, a), rb = tourney_rank(&tourney, b);
+	if (ra != rb) return rb - ra;
+	if (a->wins != b->wins) return b->wins - a->wins;
+	if (a->losses != b->losses) return a->losses - b->losses;
+	return a->seed - b->seed;
+}
+
+// Entrants in standings order: in a bracket by how far they got, then by
+// record, then seed; in a round robin by record, then seed. Sorted again
+// only once a result has come in.
+int *tourney_standings(struct nim_tourney *t) {
+	int i;
+	if (t->order_version == t->version) return t->order;
+	for (i = 0; i < t->n; i++) t->order[i] = i;
+	qsort(t->order, t->n, sizeof(int), tourney_cmp);
+	t->order_version = t->version;
+	return t->order;
+}
+
+// Write a TABLE datagram of the standings from a rank, counted from 0, as
+// many rows as NIM_TABLE_ROWS allows. Returns its size, -1 if it does not
+// fit.
+int tourney_table(struct nim_tourney *t, int first, unsigned char *buf, int cap) {
+	struct nim_frame f;
+	int *order = tourney_standings(t), i, rows;
+	if (first > t->n) first = t->n;
+	rows = t->n - first < NIM_TABLE_ROWS ? t->n - first : NIM_TABLE_ROWS;
+	frame_begin(&f, buf, cap, FRAME_TABLE);
+	frame_u8(&f, t->format);
+	frame_u8(&f, t->active == 0);
+	frame_u32(&f, t->n);
+	frame_u32(&f, t->played);
+	frame_u32(&f, t->playing);
+	frame_u32(&f, first);
+	frame_u16(&f, rows);
+	for (i = first; i < first + rows; i++) {
+		struct nim_entrant *e = &t->e[order[i]];
+		frame_str(&f, e->handle);
+		frame_u16(&f, e->wins);
+		frame_u16(&f, e->losses);
+		frame_u8(&f, tourney_status(e));
+	}
+	return frame_end(&f);
+}
+
+#endif
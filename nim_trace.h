@@ -0,0 +1,86 @@
+// CS415 Project #4: nim_trace.h (event trace)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Flight recorder: the lobby notes each step a player or query takes
+// through it, with a monotonic timestamp, in a fixed ring holding the most
+// recent NIM_TRACE_EVENTS events. Each process has its own ring and only
+// its event loop writes to it, so recording is a clock read and three
+// stores with no lock or atomic; it stays on all the time. On request the
+// ring is written out in the Chrome trace event format (load it in
+// chrome://tracing or Perfetto) by a forked child working from a copy of
+// the ring, so the event loop never waits on the file.
+
+#ifndef NIM_TRACE_H
+#define NIM_TRACE_H
+
+#define NIM_TRACE_EVENTS 65536 // ring size, a power of two
+
+// Event kinds.
+enum {
+	TR_ACCEPT, // arg: socket
+	TR_PASSWORD, // password accepted, arg: socket
+	TR_BAD_PASSWORD, // arg: socket
+	TR_HANDLE, // handle received, arg: socket
+	TR_PAIR, // two players paired, arg: pairing bucket
+	TR_BOT, // a player given to the bot, arg: socket
+	TR_SPAWN, // match server or worker forked, arg: pid
+	TR_ASSIGN, // match handed to a pool worker, arg: worker
+	TR_MATCH, // match started in-process, arg: game id
+	TR_REAP, // child reaped, arg: pid
+	TR_QUERY, // query batch served, arg: datagrams
+	TR_TIMEOUT, // connection closed on its deadline, arg: socket
+	TR_REDIRECT, // player sent to the node owning its handle, arg: node
+	TR_RELAY, // lone player relayed to pair on another node, arg: node
+	TR_ENTRANT, // tournament entrant waiting for its match, arg: socket
+	TR_KINDS
+};
+
+struct nim_trace_event {
+	long long us; // CLOCK_MONOTONIC
+	int kind;
+	int arg;
+};
+
+char *trace_names[TR_KINDS][2] = { // event name, argument name
+	{"accept", "fd"}, {"password", "fd"}, {"bad password", "fd"},
+	{"handle", "fd"}, {"pair", "bucket"}, {"bot", "fd"}, {"spawn", "pid"},
+	{"assign", "worker"}, {"match", "game"}, {"reap", "pid"},
+	{"query", "datagrams"}, {"timeout", "fd"}, {"redirect", "node"},
+	{"relay", "node"}, {"entrant", "fd"}
+};
+
+struct nim_trace_event trace_ring[NIM_TRACE_EVENTS];
+unsigned long long trace_head; // events ever recorded
+
+// Record an event.
+void trace(int kind, int arg) {
+	struct nim_trace_event *e = &trace_ring[trace_head++ & (NIM_TRACE_EVENTS - 1)];
+	e->us = now_us();
+	e->kind = kind;
+	e->arg = arg;
+}
+
+// Write the ring to nim_trace.<pid>.json from a forked child, naming the
+// process who. Returns the child's pid, or -1 if it could not be forked.
+int trace_dump(char *who) {
+	char path[64];
+	unsigned long long i = trace_head > NIM_TRACE_EVENTS ? trace_head - NIM_TRACE_EVENTS : 0;
+	int pid = getpid(), child;
+	FILE *out;
+	if ( (child = fork()) != 0 ) return child;
+	sprintf(path, "nim_trace.%d.json", pid);
+	if ( (out = fopen(path, "w")) == NULL ) _exit(1);
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+			"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+			pid, who);
+	for ( ; i < trace_head; i++) {
+		struct nim_trace_event *e = &trace_ring[i & (NIM_TRACE_EVENTS - 1)];
+		fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld,"
+				"\"pid\":%d,\"tid\":%d,\"args\":{\"%s\":%d}}", trace_names[e->kind][0],
+				e->us, pid, pid, trace_names[e->kind][1], e->arg);
+	}
+	fprintf(out, "\n]}\n");
+	_exit(fclose(out) == 0 ? 0 : 1);
+}
+
+#endif
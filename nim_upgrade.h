@@ -0,0 +1,90 @@
+// CS415 Project #4: nim_upgrade.h (hot restart)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Hand-over from a running nim_server to a freshly exec'd one. The old
+// server forks and execs the new binary with one end of a SEQPACKET socket
+// pair named by NIM_UPGRADE in its environment; the new one sets up
+// everything it would on a cold start except its sockets, says READY, and
+// is then sent one record per message, each a frame in the form of
+// nim_proto.h with any descriptors attached: the listening query and play
+// sockets, the pool workers and the games they and forked match servers
+// are running (with pidfds, since they are not the new server's children),
+// every in-process match in full with its player and spectator sockets,
+// every lobby connection with its handshake state, queued players in the
+// order they queued, and every player relayed to another node. Games keep
+// their registry handles. The new server touches no socket until END, then
+// answers ACK and starts serving, and the old one exits on ACK. Until then
+// the old server still holds everything, so if the new binary fails to
+// start or dies part way it simply carries on. It goes on serving while
+// the new binary starts, watching for READY on its event loop, and only
+// stops from sending the first record until ACK, for as long as the new
+// server takes to restore them and at most NIM_UPGRADE_WAIT. Connections
+// arriving meanwhile wait in the listen backlog and data in the socket
+// buffers, so none is refused or reset.
+
+#ifndef NIM_UPGRADE_H
+#define NIM_UPGRADE_H
+
+#define NIM_UPGRADE_MAX (NIM_FRAME_HEAD + 0xFFFF) // longest record, the longest frame
+#define NIM_UPGRADE_WAIT 5000 // ms either server waits on the other
+
+// Record types.
+enum {
+	UPG_READY = 1, // new -> old: set up and waiting
+	UPG_LISTEN, // old -> new: nothing; query and play sockets attached, and
+		// a cluster node's gossip socket
+	UPG_WORKER, // u8 slot, u32 pid, u32 games; control socket and pidfd
+	UPG_GAME, // u32 id, u32 pid (0 on a worker), u8 worker slot + 1 (0 for
+		// a match server), str handle1, str handle2; a match server's
+		// pidfd and then its control socket, if it has one, attached
+	UPG_MATCH, // u32 id, then the match as match_save() writes it; the
+		// player sockets still open attached
+	UPG_WATCHER, // u16 length, output pending, for a spectator of the last
+		// match; its socket attached
+	UPG_CONN, // a lobby connection, see save_conn(); its socket attached
+	UPG_RELAY, // a player relayed to another node, see save_relay(); the
+		// player's socket and the connection to the node attached
+	UPG_END, // old -> new: that is everything
+	UPG_ACK // new -> old: taken over
+};
+
+// Descriptor that becomes readable when a process exits, which works for
+// processes that are not our children.
+int pidfd_open(int pid) {
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+// Finish a record and send it. Returns -1 if it did not fit or the other
+// server is gone.
+int upgrade_send(int sock, struct nim_frame *f, int *fds, int nfds) {
+	int size = frame_end(f);
+	if (size < 0) return -1;
+	return send_fds(sock, f->data, size, fds, nfds);
+}
+
+// Send a record with no payload.
+int upgrade_signal(int sock, int type, int *fds, int nfds) {
+	struct nim_frame f;
+	unsigned char buf[NIM_FRAME_HEAD];
+	frame_begin(&f, buf, sizeof(buf), type);
+	return upgrade_send(sock, &f, fds, nfds);
+}
+
+// Wait for the next record, pointing the cursor at its payload in buf,
+// which holds NIM_UPGRADE_MAX. Returns its type, or -1 on timeout, end of
+// stream or a malformed record.
+int upgrade_recv(int sock, unsigned char *buf, struct nim_cursor *c,
+		int *fds, int *nfds) {
+	struct pollfd pfd = {sock, POLLIN, 0};
+	int num, type, i;
+	*nfds = 0;
+	if (poll(&pfd, 1, NIM_UPGRADE_WAIT) <= 0) return -1;
+	if ( (num = recv_fds(sock, buf, NIM_UPGRADE_MAX, fds, nfds)) <= 0 ) return -1;
+	if ( (type = frame_datagram(buf, num, c)) < 0 ) {
+		for (i = 0; i < *nfds; i++) close(fds[i]);
+		*nfds = 0;
+	}
+	return type;
+}
+
+#endif
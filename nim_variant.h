@@ -0,0 +1,106 @@
+// CS415 Project #4: nim_variant.h (board variants)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Board variants: any number of rows of any length up to 255, played
+// misere (taking the last stone loses, as in the classic game) or normal
+// (taking the last stone wins). A position is the count of stones left in
+// each row, since a move always takes a stone and everything to its right.
+// Variant 0 is the classic 1, 3, 5, 7 board; the server may define more
+// with specs of the form name=len,len,...[:normal|:misere], and a match
+// server is handed the spec of the variant it is to play.
+
+#ifndef NIM_VARIANT_H
+#define NIM_VARIANT_H
+
+#define NIM_MAX_ROWS 64 // a multiple of the evaluator's 16 byte vectors
+#define NIM_MAX_VARIANTS 16
+
+struct nim_variant {
+	char name[20];
+	int rows;
+	int misere; // taking the last stone loses
+	unsigned char len[NIM_MAX_ROWS]; // stones in each row at the start
+};
+
+// Stones left in each row; rows past the variant's are always empty.
+struct nim_heaps {
+	unsigned char h[NIM_MAX_ROWS];
+} __attribute__((aligned(16)));
+
+struct nim_variant nim_variants[NIM_MAX_VARIANTS] = {
+	{"classic", 4, 1, {1, 3, 5, 7}}
+};
+int nim_nvariants = 1;
+
+// Look up a variant by name, -1 if there is none.
+int variant_find(char *name) {
+	int i;
+	for (i = 0; i < nim_nvariants; i++)
+		if (strcmp(nim_variants[i].name, name) == 0) return i;
+	return -1;
+}
+
+// Define a variant from its spec, returning its id, or -1 if the spec is
+// malformed or the table is full. A spec naming a known variant returns
+// that variant.
+int variant_parse(char *spec) {
+	struct nim_variant v;
+	char copy[NIM_SPEC_MAX], *rows, *play, *len, *save;
+	int id;
+	memset(&v, 0, sizeof(v));
+	snprintf(copy, sizeof(copy), "%s", spec);
+	if ( (rows = strchr(copy, '=')) == NULL ) return -1;
+	*rows++ = '\0';
+	if (copy[0] == '\0' || strlen(copy) > 19) return -1;
+	if ( (id = variant_find(copy)) >= 0 ) return id;
+	strcpy(v.name, copy);
+	v.misere = 1;
+	if ( (play = strchr(rows, ':')) != NULL ) {
+		*play++ = '\0';
+		if (strcmp(play, "normal") == 0) v.misere = 0;
+		else if (strcmp(play, "misere") != 0) return -1;
+	}
+	for (len = strtok_r(rows, ",", &save); len != NULL; len = strtok_r(NULL, ",", &save)) {
+		if (v.rows == NIM_MAX_ROWS || atoi(len) < 1 || atoi(len) > 255) return -1;
+		v.len[v.rows++] = atoi(len);
+	}
+	if (v.rows == 0 || nim_nvariants == NIM_MAX_VARIANTS) return -1;
+	nim_variants[nim_nvariants] = v;
+	return nim_nvariants++;
+}
+
+// Write a variant's spec.
+void variant_spec(struct nim_variant *v, char *spec) { // spec holds NIM_SPEC_MAX
+	int i, n = sprintf(spec, "%s=", v->name);
+	for (i = 0; i < v->rows; i++)
+		n += sprintf(spec + n, i ? ",%d" : "%d", v->len[i]);
+	sprintf(spec + n, v->misere ? ":misere" : ":normal");
+}
+
+// Set up a variant's starting position.
+void heaps_init(struct nim_heaps *p, struct nim_variant *v) {
+	memset(p, 0, sizeof(struct nim_heaps));
+	memcpy(p->h, v->len, v->rows);
+}
+
+// Check a move: the stone at row, col must still be on the board.
+int heaps_legal(struct nim_heaps *p, struct nim_variant *v, int row, int col) {
+	return row >= 1 && row <= v->rows && col >= 1 && col <= p->h[row - 1];
+}
+
+// Take the stone at row, col and the rest of its row; an illegal move
+// leaves the position unchanged.
+void heaps_move(struct nim_heaps *p, struct nim_variant *v, int row, int col) {
+	if (heaps_legal(p, v, row, col)) p->h[row - 1] = col - 1;
+}
+
+// The classic position as a bitboard.
+nim_bits heaps_bits(struct nim_heaps *p) {
+	nim_bits b = 0;
+	int row;
+	for (row = 0; row < NIM_ROWS; row++)
+		b |= ((1u << p->h[row]) - 1) << (NIM_COLS * row);
+	return b;
+}
+
+#endif
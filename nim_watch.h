@@ -0,0 +1,226 @@
+// CS415 Project #4: nim_watch.h (spectators)
+// Gavin Cabbage - gavincabbage@gmail.com
+
+// Fan-out of a match's board updates to any number of spectators. Each
+// update is encoded once into a reference counted frame that every
+// spectator's queue points at, and is written to each socket straight from
+// there. Writes never block: a spectator whose socket is full holds only the
+// frame it is part way through and the newest one after it, and any frame
+// in between is dropped, so a slow spectator costs the match nothing but
+// skipped boards and never holds up the players or the other spectators.
+// A spectator outlives the match it watched long enough to finish the last
+// frame it was given. In a hot restart a spectator is passed on with the
+// bytes it has yet to be sent. Spectators and frames come from slabs (see
+// nim_alloc.h), but for a frame too long for one, which only a hot restart
+// makes.
+
+#ifndef NIM_WATCH_H
+#define NIM_WATCH_H
+
+#define NIM_WATCH_LINGER 5000 // ms a match server waits on spectators once done
+#define NIM_SHARED_SMALL 192 // longest frame kept in the frame slab
+
+// Frame shared by every spectator it is queued for.
+struct nim_shared_frame {
+	int refs;
+	int len;
+	unsigned char data[];
+};
+
+struct nim_watch_list;
+
+// One spectator.
+struct nim_watcher {
+	struct nim_source src; // kind SRC_WATCHER
+	struct nim_watch_list *list; // NULL once the match has ended
+	struct nim_watcher *prev, *next;
+	struct nim_shared_frame *cur; // being written, NULL if idle
+	int off; // bytes of cur written
+	struct nim_shared_frame *newest; // waiting behind cur, NULL if none
+	unsigned events; // current epoll interest
+};
+
+// A match's spectators.
+struct nim_watch_list {
+	struct nim_watcher *first;
+	int count;
+};
+
+int watch_live; // spectators open in this process
+struct nim_slab watcher_slab = {"watcher", sizeof(struct nim_watcher)};
+struct nim_slab frame_slab = {"frame", sizeof(struct nim_shared_frame) + NIM_SHARED_SMALL};
+
+struct nim_watcher *watch_new(int epfd, struct nim_watch_list *list, int sock,
+		unsigned events);
+
+// Make a shared frame holding one reference, for the caller.
+struct nim_shared_frame *shared_frame(void *data, int len) {
+	struct nim_shared_frame *f = len <= NIM_SHARED_SMALL ? slab_alloc(&frame_slab)
+			: malloc(sizeof(struct nim_shared_frame) + len);
+	if (f == NULL) return NULL;
+	f->refs = 1;
+	f->len = len;
+	memcpy(f->data, data, len);
+	return f;
+}
+
+// Give up a reference, freeing the frame with the last one.
+void shared_frame_drop(struct nim_shared_frame *f) {
+	if (f == NULL || --f->refs > 0) return;
+	if (f->len <= NIM_SHARED_SMALL) slab_free(&frame_slab, f);
+	else free(f);
+}
+
+// Close a spectator, taking it off its list.
+void watch_close(int epfd, struct nim_watcher *w) {
+	if (w->list != NULL) {
+		if (w->prev != NULL) w->prev->next = w->next;
+		else w->list->first = w->next;
+		if (w->next != NULL) w->next->prev = w->prev;
+		w->list->count -= 1;
+	}
+	shared_frame_drop(w->cur);
+	shared_frame_drop(w->newest);
+	ev_del(epfd, &w->src);
+	close(w->src.fd);
+	w->src.kind = SRC_DEAD;
+	ev_retire(&watcher_slab, w);
+	watch_live -= 1;
+}
+
+// Write as much queued output as the socket takes, closing a spectator
+// whose match has ended once it has all of it.
+void watch_flush(int epfd, struct nim_watcher *w) {
+	unsigned events = EPOLLRDHUP;
+	int num;
+	while (w->cur != NULL) {
+		num = write(w->src.fd, w->cur->data + w->off, w->cur->len - w->off);
+		ev_writes += 1;
+		if (num < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			watch_close(epfd, w);
+			return;
+		}
+		if ( (w->off += num) < w->cur->len ) continue;
+		shared_frame_drop(w->cur);
+		w->cur = w->newest;
+		w->newest = NULL;
+		w->off = 0;
+	}
+	if (w->cur == NULL && w->list == NULL) { watch_close(epfd, w); return; }
+	if (w->cur != NULL) events |= EPOLLOUT;
+	if (events != w->events) {
+		ev_mod(epfd, &w->src, events);
+		w->events = events;
+	}
+}
+
+// Queue a frame for a spectator, replacing any frame still waiting behind
+// the one being written.
+void watch_send(int epfd, struct nim_watcher *w, struct nim_shared_frame *f) {
+	f->refs += 1;
+	if (w->cur == NULL) {
+		w->cur = f;
+		w->off = 0;
+		watch_flush(epfd, w);
+		return;
+	}
+	if (w->newest != NULL) {
+		shared_frame_drop(w->newest);
+		metrics_count(M_WATCH_DROPPED);
+	}
+	w->newest = f;
+}
+
+// Add a connected, non-blocking spectator socket to a list, sending it a
+// first frame. Returns -1 if it could not be added; the caller still owns
+// the socket then.
+int watch_add(int epfd, struct nim_watch_list *list, int sock,
+		struct nim_shared_frame *first) {
+	struct nim_watcher *w = watch_new(epfd, list, sock, EPOLLRDHUP);
+	if (w == NULL) return -1;
+	metrics_count(M_WATCHERS);
+	watch_send(epfd, w, first);
+	return 0;
+}
+
+// Register a spectator socket with the given interest and put it on a list.
+struct nim_watcher *watch_new(int epfd, struct nim_watch_list *list, int sock,
+		unsigned events) {
+	struct nim_watcher *w = slab_alloc(&watcher_slab);
+	if (w == NULL) return NULL;
+	w->src.kind = SRC_WATCHER;
+	w->src.fd = sock;
+	w->events = events;
+	if (ev_add(epfd, &w->src, w->events) < 0) {
+		slab_free(&watcher_slab, w);
+		return NULL;
+	}
+	w->list = list;
+	w->next = list->first;
+	if (list->first != NULL) list->first->prev = w;
+	list->first = w;
+	list->count += 1;
+	watch_live += 1;
+	return w;
+}
+
+// Write a spectator's pending output into a hot restart record.
+void watch_save(struct nim_watcher *w, struct nim_frame *f) {
+	int cur = w->cur ? w->cur->len - w->off : 0, newest = w->newest ? w->newest->len : 0;
+	frame_u16(f, cur + newest);
+	if (cur > 0) frame_put(f, w->cur->data + w->off, cur);
+	if (newest > 0) frame_put(f, w->newest->data, newest);
+}
+
+// Take over a spectator from a hot restart record, its pending output
+// going out once the socket is writable. Returns -1 if it could not be
+// added; the caller still owns the socket then.
+int watch_restore(int epfd, struct nim_watch_list *list, int sock,
+		struct nim_cursor *c) {
+	struct nim_shared_frame *f = NULL;
+	struct nim_watcher *w;
+	int len = get_u16(c);
+	if (c->bad || len > c->left) return -1;
+	if (len > 0 && (f = shared_frame(c->p, len)) == NULL) return -1;
+	if ( (w = watch_new(epfd, list, sock, f ? EPOLLRDHUP | EPOLLOUT : EPOLLRDHUP)) == NULL ) {
+		shared_frame_drop(f);
+		return -1;
+	}
+	w->cur = f;
+	return 0;
+}
+
+// Send one encoded update to every spectator on a list.
+void watch_broadcast(int epfd, struct nim_watch_list *list, void *data, int len) {
+	struct nim_watcher *w, *next;
+	struct nim_shared_frame *f;
+	if (list->first == NULL || (f = shared_frame(data, len)) == NULL) return;
+	for (w = list->first; w != NULL; w = next) {
+		next = w->next; // w may be closed
+		watch_send(epfd, w, f);
+	}
+	shared_frame_drop(f);
+}
+
+// The match has ended: spectators close once they have their last frame.
+void watch_end(int epfd, struct nim_watch_list *list) {
+	struct nim_watcher *w, *next;
+	for (w = list->first; w != NULL; w = next) {
+		next = w->next;
+		w->list = NULL;
+		if (w->cur == NULL) watch_close(epfd, w);
+	}
+	list->first = NULL;
+	list->count = 0;
+}
+
+// React to readiness on a spectator socket; spectators send nothing, so
+// anything but room to write is a hangup.
+void watch_event(int epfd, struct nim_watcher *w, unsigned events) {
+	if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) watch_close(epfd, w);
+	else if (events & EPOLLOUT) watch_flush(epfd, w);
+}
+
+#endif